@@ -14,6 +14,8 @@ extern MSFilterDesc ms_scale_desc;
 extern MSFilterDesc ms_muxer_desc;
 extern MSFilterDesc ms_vmix_desc;
 extern MSFilterDesc ms_amix_desc;
+extern MSFilterDesc ms_rtp_jitter_desc;
+extern MSFilterDesc ms_mp3_parser_desc;
 
 
 
@@ -32,6 +34,8 @@ MSFilterDesc *ms_filter_descs[] =
     &ms_muxer_desc,
     &ms_vmix_desc,
     &ms_amix_desc,
+    &ms_rtp_jitter_desc,
+    &ms_mp3_parser_desc,
     NULL
 };
 
@@ -17,6 +17,8 @@ typedef enum MSFilterId
     MS_SCALE_ID,
     MS_AMIX_ID,
     MS_VMIX_ID,
+    MS_RTP_JITTER_ID,
+    MS_MP3_PARSER_ID,
 }MSFilterId;
 
 #endif
@@ -0,0 +1,47 @@
+#ifndef __MS_CODEC_UTILS_H__
+#define __MS_CODEC_UTILS_H__
+#include <stdint.h>
+#include <base/mscommon.h>
+
+
+/**
+ * What a H.264 sequence parameter set tells about the stream.
+ */
+typedef struct _MSH264SpsInfo
+{
+    int profile_idc;
+    int level_idc;
+    int sps_id;
+    int width;      /**< cropping applied */
+    int height;
+}MSH264SpsInfo;
+
+/* parse a SPS NAL unit of len bytes, its one byte NAL header included; 0 on success */
+int ms_h264_parse_sps(const uint8_t *nal, int len, MSH264SpsInfo *info);
+
+/*
+ * Next NAL unit of an Annex B byte stream, searched from *pos up to size: return it, its start code
+ * skipped, with its length in *len, and move *pos past it; NULL at the end of the stream.
+ */
+const uint8_t *ms_h264_next_nal(const uint8_t *data, int size, int *pos, int *len);
+
+
+/**
+ * MPEG-1/2/2.5 audio frame header.
+ */
+typedef struct _MSMpaHeader
+{
+    int version;            /**< 1, 2, or 25 for MPEG 2.5 */
+    int layer;              /**< 1, 2 or 3 */
+    int bitrate;            /**< bits per second, 0 for a free format stream */
+    int sample_rate;
+    int channels;
+    int samples_per_frame;
+    int frame_size;         /**< bytes, header included, 0 when it cannot be known (free format) */
+}MSMpaHeader;
+
+/* decode the 4 bytes header at p; 0 on success, -1 if they are not a valid header */
+int ms_mpa_parse_header(const uint8_t *p, MSMpaHeader *h);
+
+
+#endif
@@ -19,6 +19,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #ifndef mscommon_h
 #define mscommon_h
 
+#include <pthread.h>
 #include <ortp/port.h>
 
 #define MS_UNUSED(x) ((void)(x))
@@ -30,28 +31,26 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define ms_new0     ortp_new0
 #define ms_free     ortp_free
 
-#if 0
-#define ms_mutex_t		ortp_mutex_t
-#define ms_mutex_init		ortp_mutex_init
-#define ms_mutex_destroy	ortp_mutex_destroy
-#define ms_mutex_lock		ortp_mutex_lock
-#define ms_mutex_unlock		ortp_mutex_unlock
+#define ms_mutex_t		pthread_mutex_t
+#define ms_mutex_init		pthread_mutex_init
+#define ms_mutex_destroy	pthread_mutex_destroy
+#define ms_mutex_lock		pthread_mutex_lock
+#define ms_mutex_unlock		pthread_mutex_unlock
 
-#define ms_cond_t		ortp_cond_t
-#define ms_cond_init		ortp_cond_init
-#define ms_cond_wait		ortp_cond_wait
-#define ms_cond_signal		ortp_cond_signal
-#define ms_cond_broadcast	ortp_cond_broadcast
-#define ms_cond_destroy		ortp_cond_destroy
+#define ms_cond_t		pthread_cond_t
+#define ms_cond_init		pthread_cond_init
+#define ms_cond_wait		pthread_cond_wait
+#define ms_cond_signal		pthread_cond_signal
+#define ms_cond_broadcast	pthread_cond_broadcast
+#define ms_cond_destroy		pthread_cond_destroy
 
 
 
 
-#define ms_thread_t		ortp_thread_t
-#define ms_thread_create 	ortp_thread_create
-#define ms_thread_join		ortp_thread_join
-#define ms_thread_self		ortp_thread_self
-#endif
+#define ms_thread_t		pthread_t
+#define ms_thread_create 	pthread_create
+#define ms_thread_join		pthread_join
+#define ms_thread_self		pthread_self
 
 
 
@@ -34,6 +34,14 @@
 #define MS_GET_PIX_FMT              24
 #define MS_SET_AMIX_INFO            25
 #define MS_SET_VMIX_INFO            26
+#define MS_GET_EOF                  27
+#define MS_SET_TIME_RANGE           28
+#define MS_ADD_FLOW                 29
+#define MS_SET_JITTER_DEPTH         30
+#define MS_SET_JITTER_DELAY         31
+#define MS_GET_JITTER_STATS         32
+#define MS_SET_PASSTHROUGH          33
+#define MS_SET_PAYLOAD_TYPES        34
 
 
 struct _MSFilter;
@@ -84,6 +92,7 @@ typedef enum _MSFilterCategory{
 **/
 typedef enum _MSFilterFlags{
 	MS_FILTER_IS_PUMP = 1, /**< The filter must be called in process function every tick.*/
+	MS_FILTER_IS_THREADED = 1<<1, /**< Heavy filter, a pipelined ticker runs it on its own thread.*/
 	/*...*/
 	/*private flags: don't use it in filters.*/
 	MS_FILTER_IS_ENABLED = 1<<31 /*<Flag to specify if a filter is enabled or not. Only enabled filters are returned by function ms_filter_get_encoder */
@@ -125,6 +134,7 @@ typedef struct _MSFilter
     /*private attributes, they can be moved and changed at any time*/
     bctbx_list_t *notify_callbacks;
     uint32_t last_tick;
+    struct _MSFilterThread *thread; /* set while a pipelined ticker runs the filter on its own thread */
 //    MSFilterStats *stats;
 //    int postponed_task; /*number of postponed tasks*/
 //    bool_t seen;
@@ -146,6 +156,10 @@ typedef struct _MSConnectionHelper
 
 void ms_filter_destroy(MSFilter *f);
 
+/* called by the ticker once before the first process(), and once after the last one */
+void ms_filter_preprocess(MSFilter *f, struct _MSTicker *t);
+void ms_filter_postprocess(MSFilter *f);
+
 
 
 void ms_connection_helper_start(MSConnectionHelper *h);
@@ -156,6 +170,8 @@ int ms_connection_helper_unlink(MSConnectionHelper *h, MSFilter *f, int inpin, i
 
 
 int ms_filter_link(MSFilter *f1, int pin1, MSFilter *f2, int pin2);
+/* same as ms_filter_link(), MS_QUEUE_SPSC is for a link between filters processed on different threads */
+int ms_filter_link_with_type(MSFilter *f1, int pin1, MSFilter *f2, int pin2, MSQueueType type);
 int ms_filter_unlink(MSFilter *f1, int pin1, MSFilter *f2, int pin2);
 
 
@@ -0,0 +1,249 @@
+#ifndef __MS_PCAP_H__
+#define __MS_PCAP_H__
+#include <stdint.h>
+#include <netinet/in.h>
+#include <base/mscommon.h>
+
+
+#define MS_PCAP_LINKTYPE_NULL       0       /* BSD loopback */
+#define MS_PCAP_LINKTYPE_ETHERNET   1
+#define MS_PCAP_LINKTYPE_RAW        101     /* bare IPv4 or IPv6 */
+#define MS_PCAP_LINKTYPE_LINUX_SLL  113
+#define MS_PCAP_LINKTYPE_LINUX_SLL2 276
+
+#define MS_PCAP_FILE_HDR_PEEK       24      /* bytes ms_pcap_format_init() needs to tell the format of a capture */
+#define MS_PCAP_MAX_INTERFACES      16      /* pcapng interfaces of a section */
+
+#define MS_PCAP_NO_RTP              0xff    /* payload_type of a packet which does not look like RTP */
+
+#define MS_PCAP_FLAG_MARKER         (1 << 0)
+
+#define MS_PCAP_PROBE_SIZE          (8 << 20)   /* bytes of a capture sampled by default by ms_pcap_probe() */
+
+
+/**
+ * Layout of a capture: classic pcap in either byte order with micro or nanosecond timestamps,
+ * or pcapng, whose interfaces each have a link type and a timestamp resolution.
+ */
+typedef struct _MSPcapFormat
+{
+    bool_t ng;
+    bool_t swapped;             /**< written in the other byte order */
+    bool_t nanosecond;          /**< classic pcap */
+    int link_type;              /**< classic pcap */
+    int ninterfaces;            /**< pcapng, of the current section */
+    struct
+    {
+        int link_type;
+        uint8_t tsresol;        /**< if_tsresol option, 6 by default */
+    }interfaces[MS_PCAP_MAX_INTERFACES];
+    uint64_t last_time_us;      /**< for the pcapng blocks without a timestamp */
+}MSPcapFormat;
+
+/**
+ * A captured packet, pointing into the buffer given to ms_pcap_next_record().
+ */
+typedef struct _MSPcapRecord
+{
+    uint64_t offset;            /**< of its record (or block) in the buffer */
+    uint64_t time_us;           /**< capture time, in microseconds since the epoch */
+    int link_type;
+    const uint8_t *data;
+    uint32_t cap_len;
+}MSPcapRecord;
+
+/*
+ * Tell the format of a capture from its first MS_PCAP_FILE_HDR_PEEK bytes. Return the length of
+ * its file header, at least MS_PCAP_FILE_HDR_PEEK, after which the records start; -1 if it is
+ * not a capture.
+ */
+int ms_pcap_format_init(MSPcapFormat *fmt, const uint8_t *data, uint32_t size);
+
+/* bytes of a record needed by ms_pcap_record_size(): 16 for pcap, 12 for pcapng */
+int ms_pcap_record_peek_size(const MSPcapFormat *fmt);
+
+/* whole size of the record starting with the ms_pcap_record_peek_size() bytes at hdr, 0 if it is corrupted */
+uint32_t ms_pcap_record_size(const MSPcapFormat *fmt, const uint8_t *hdr);
+
+/*
+ * Walk the records of a capture in the size bytes at data, from *pos to the next captured packet,
+ * pcapng sections and interfaces being read on the way. Return 0 and move *pos past the packet,
+ * -1 if there is no whole packet left.
+ */
+int ms_pcap_next_record(MSPcapFormat *fmt, const uint8_t *data, uint64_t size, uint64_t *pos, MSPcapRecord *rec);
+
+
+/**
+ * What ms_pcap_dissect() found in a captured packet.
+ */
+typedef struct _MSPcapPacket
+{
+    uint32_t src_addr;          /**< IPv4: network byte order, IPv6: see ms_pcap_addr_key() */
+    uint32_t dst_addr;
+    uint8_t ip_version;         /**< 4 or 6 */
+    uint8_t src_ip[16];         /**< the whole address, 4 bytes long for IPv4 */
+    uint8_t dst_ip[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t protocol;           /**< IP protocol */
+    uint8_t payload_type;       /**< RTP payload type, MS_PCAP_NO_RTP if not RTP */
+    uint8_t marker;
+    uint16_t seq;
+    uint32_t timestamp;         /**< RTP timestamp */
+    uint32_t ssrc;
+    uint32_t payload_offset;    /**< from the start of the packet: RTP payload if RTP, else UDP payload */
+    uint32_t payload_size;
+}MSPcapPacket;
+
+/*
+ * Walk the link (Ethernet with VLAN tags, Linux cooked, loopback or raw), IPv4 or IPv6, UDP and
+ * RTP headers of a captured packet of len bytes, in place.
+ * Return 0 for a UDP packet (RTP or not, see payload_type), -1 otherwise.
+ */
+int ms_pcap_dissect(int link_type, const uint8_t *data, uint32_t len, MSPcapPacket *pkt);
+
+/*
+ * 32 bits key of an address given as text, as found in MSPcapPacket: the address itself for IPv4,
+ * a hash of it for IPv6. INADDR_NONE if it is not an address.
+ */
+uint32_t ms_pcap_addr_key(const char *addr);
+
+
+/**
+ * One packet of a capture, as saved in the index sidecar file.
+ */
+typedef struct _MSPcapIndexEntry
+{
+    uint64_t offset;            /**< file offset of the record header */
+    uint64_t time_us;           /**< capture time, in microseconds since the epoch */
+    uint32_t src_addr;          /**< as in MSPcapPacket, 0 if not UDP */
+    uint32_t dst_addr;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t seq;
+    uint8_t protocol;
+    uint8_t payload_type;       /**< MS_PCAP_NO_RTP if not RTP */
+    uint8_t flags;              /**< MS_PCAP_FLAG_* */
+    uint8_t reserved[7];
+}MSPcapIndexEntry;
+
+typedef struct _MSPcapIndex
+{
+    MSPcapIndexEntry *entries;
+    int count;
+    uint64_t file_size;         /**< of the capture when indexed, to detect a stale index */
+    int64_t file_mtime;
+}MSPcapIndex;
+
+/**
+ * Time window [start, end) of a capture, in microseconds since its first packet. end_us < 0 for no end.
+ * The pts given by ParsePcap count from the first packet of the capture, so that the ranges parsed
+ * at once line up, or from start_us with rebase set.
+ */
+typedef struct _MSPcapTimeRange
+{
+    int64_t start_us;
+    int64_t end_us;
+    bool_t rebase;
+}MSPcapTimeRange;
+
+/**
+ * RTP payload types ParsePcap sends to the audio and video outputs of a participant (see
+ * MS_SET_PAYLOAD_TYPES), 0 for the defaults: PCMU (0) or MPA (14) audio, and 96 video.
+ */
+typedef struct _MSPcapPayloadTypes
+{
+    int audio;
+    int video;
+}MSPcapPayloadTypes;
+
+/**
+ * One more participant for ParsePcap to demux (see MS_ADD_FLOW).
+ */
+typedef struct _MSPcapFlowSpec
+{
+    const char *src_addr;
+    const char *dst_addr;
+    int pin;                    /**< out: output of its audio, its video leaves on pin + 1 */
+    MSPcapPayloadTypes pt;
+}MSPcapFlowSpec;
+
+/* scan the whole capture once, NULL if it cannot be read */
+MSPcapIndex *ms_pcap_index_build(const char *pcap_file);
+
+/* sidecar file of a capture: "<pcap_file>.idx" (the caller frees it) */
+char *ms_pcap_index_file_name(const char *pcap_file);
+
+/* the sidecar is a small header followed by the entries, in host byte order */
+int ms_pcap_index_save(const MSPcapIndex *index, const char *index_file);
+
+/* NULL if the index file is missing, corrupted or older than the capture */
+MSPcapIndex *ms_pcap_index_load(const char *index_file, const char *pcap_file);
+
+/* load the sidecar of the capture, or build it and save it when it is missing or stale */
+MSPcapIndex *ms_pcap_index_open(const char *pcap_file);
+
+/* first entry captured at or after time_us since the first packet (count if none), the capture being in time order */
+int ms_pcap_index_find(const MSPcapIndex *index, int64_t time_us);
+
+/*
+ * Cut the capture into n disjoint time ranges of about the same number of packets, so that
+ * n ParsePcap (see MS_SET_TIME_RANGE) can parse it at once. Return the number of ranges filled.
+ */
+int ms_pcap_index_split(const MSPcapIndex *index, int n, MSPcapTimeRange *ranges);
+
+void ms_pcap_index_free(MSPcapIndex *index);
+
+
+/**
+ * One RTP stream found by ms_pcap_probe().
+ */
+typedef struct _MSPcapFlowInfo
+{
+    uint32_t src_addr;          /**< as in MSPcapPacket */
+    uint32_t dst_addr;
+    char src[INET6_ADDRSTRLEN]; /**< addresses as text, IPv6 ones included */
+    char dst[INET6_ADDRSTRLEN];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t ssrc;
+    uint8_t payload_type;
+    bool_t video;
+    const char *encoding;       /**< RTP encoding name, NULL if unknown */
+    const char *mime_type;      /**< of the decoder in the factory, or "MP2" which only the muxer takes; NULL if unknown */
+    int clock_rate;
+    int sample_rate;            /**< audio, 0 if unknown */
+    int channels;
+    int width;                  /**< video, from its SPS, 0 if none was seen */
+    int height;
+    uint32_t packets;
+    uint64_t bytes;             /**< RTP payload */
+    uint64_t first_us;          /**< capture times */
+    uint64_t last_us;
+    double packet_rate;         /**< packets per second */
+    int bitrate;                /**< payload bits per second */
+    uint32_t h264_errors;       /**< internal: packets which cannot be H.264 */
+    uint32_t h264_key_nals;     /**< internal: IDR, SPS and PPS NAL units seen */
+}MSPcapFlowInfo;
+
+typedef struct _MSPcapProbe
+{
+    MSPcapFlowInfo *flows;      /**< in order of first appearance */
+    int count;
+    uint64_t bytes_scanned;
+    bool_t complete;            /**< the whole capture fitted in the sample */
+}MSPcapProbe;
+
+/*
+ * Sample the first max_bytes of a capture (the whole capture if 0) and describe its RTP streams:
+ * codec, resolution or sample rate, packet rate and bitrate. Return 0 on success.
+ */
+int ms_pcap_probe(const char *pcap_file, uint64_t max_bytes, MSPcapProbe *probe);
+
+void ms_pcap_probe_print(const MSPcapProbe *probe);
+
+/* free the flows of a probe filled by ms_pcap_probe() */
+void ms_pcap_probe_uninit(MSPcapProbe *probe);
+
+
+#endif
@@ -21,28 +21,62 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "ortp/str_utils.h"
 #include "base/mscommon.h"
 
+struct _MSFilter;
+
+/*a pin of a filter, as seen from the queue linking it to another filter*/
+typedef struct _MSCPoint{
+	struct _MSFilter *filter;
+	int pin;
+}MSCPoint;
+
+typedef enum _MSQueueType{
+	MS_QUEUE_DEFAULT,	/*plain queue_t, producer and consumer run on the same thread*/
+	MS_QUEUE_SPSC		/*lock-free, for a producer and a consumer running on two different threads*/
+}MSQueueType;
+
 typedef struct _MSQueue
 {
-	queue_t q;
+	queue_t q;	/*for MS_QUEUE_SPSC, only used by the consumer, to peek at what it already received*/
+	MSCPoint prev; /*the filter writing into the queue*/
+	MSCPoint next; /*the filter reading from the queue*/
+	MSQueueType type;
+	/*MS_QUEUE_SPSC: intrusive list of mblk_t chained by b_next, pushed at spsc_tail and popped from spsc_head*/
+	mblk_t *spsc_head;	/*consumer side*/
+	mblk_t *spsc_tail;	/*producer side*/
+	mblk_t spsc_stub;
+	int spsc_count;
+	int max_size;	/*soft bound in mblk_t, 0 for none: see ms_queue_full()*/
 }MSQueue;
 
 
-MSQueue * ms_queue_new();
+MSQueue * ms_queue_new(struct _MSFilter *f1, int pin1, struct _MSFilter *f2, int pin2);
+MSQueue * ms_queue_new_with_type(struct _MSFilter *f1, int pin1, struct _MSFilter *f2, int pin2, MSQueueType type);
+
+/*MS_QUEUE_SPSC implementation: put may only be called by the producer thread, the others by the consumer thread*/
+void ms_queue_spsc_put(MSQueue *q, mblk_t *m);
+mblk_t *ms_queue_spsc_get(MSQueue *q);
+void ms_queue_spsc_remove(MSQueue *q, mblk_t *m);
+/*move everything received so far into q->q*/
+void ms_queue_spsc_fetch(MSQueue *q);
 
 static mblk_t *ms_queue_get(MSQueue *q){
+	if (q->type==MS_QUEUE_SPSC) return ms_queue_spsc_get(q);
 	return getq(&q->q);
 }
 
 static void ms_queue_put(MSQueue *q, mblk_t *m){
-	putq(&q->q,m);
+	if (q->type==MS_QUEUE_SPSC) ms_queue_spsc_put(q,m);
+	else putq(&q->q,m);
 	return;
 }
 
 static mblk_t * ms_queue_peek_last(MSQueue *q){
+	if (q->type==MS_QUEUE_SPSC) ms_queue_spsc_fetch(q);
 	return qlast(&q->q);
 }
 
 static mblk_t *ms_queue_peek_first(MSQueue *q){
+	if (q->type==MS_QUEUE_SPSC) ms_queue_spsc_fetch(q);
 	return qbegin(&q->q);
 }
 
@@ -55,13 +89,29 @@ static bool_t ms_queue_end(MSQueue *q, mblk_t *m){
 }
 
 static void ms_queue_remove(MSQueue *q, mblk_t *m){
-	remq(&q->q,m);
+	if (q->type==MS_QUEUE_SPSC) ms_queue_spsc_remove(q,m);
+	else remq(&q->q,m);
 }
 
 static bool_t ms_queue_empty(MSQueue *q){
+	if (q->type==MS_QUEUE_SPSC) ms_queue_spsc_fetch(q);
 	return qempty(&q->q);
 }
 
+/*number of mblk_t in the queue, may be called from either side (the result is then only a snapshot)*/
+static int ms_queue_size(MSQueue *q){
+	if (q->type==MS_QUEUE_SPSC) return __atomic_load_n(&q->spsc_count,__ATOMIC_ACQUIRE);
+	return q->q.q_mcount;
+}
+
+/*
+ * A bounded queue never refuses a put: it is full once it holds max_size mblk_t, and the
+ * ticker then stops scheduling the producer until the consumer catches up.
+ */
+static bool_t ms_queue_full(MSQueue *q){
+	return q->max_size>0 && ms_queue_size(q)>=q->max_size;
+}
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -74,6 +124,11 @@ void ms_queue_init(MSQueue *q);
 
 void ms_queue_flush(MSQueue *q);
 
+/*change the type of a queue while neither its producer nor its consumer is running*/
+void ms_queue_set_type(MSQueue *q, MSQueueType type);
+
+void ms_queue_set_max_size(MSQueue *q, int max_size);
+
 void ms_queue_destroy(MSQueue *q);
 
 
@@ -94,12 +149,21 @@ void ms_queue_destroy(MSQueue *q);
 #define mblk_set_cng_flag(m,bit)    __mblk_set_flag(m,3,bit)  /*use to mark a cng generated block*/
 #define mblk_get_cng_flag(m)    (((m)->reserved2)>>3 & 0x1) /*bit 4*/
 
+#define mblk_set_key_frame_flag(m,bit)    __mblk_set_flag(m,4,bit)  /*compressed video frame which can be decoded alone*/
+#define mblk_get_key_frame_flag(m)    (((m)->reserved2)>>4 & 0x1) /*bit 5*/
+
 #define mblk_set_user_flag(m,bit)    __mblk_set_flag(m,7,bit)  /* to be used by extensions to mediastreamer2*/
 #define mblk_get_user_flag(m)    (((m)->reserved2)>>7 & 0x1) /*bit 8*/
 
-#define mblk_set_cseq(m,value) (m)->reserved2=(m)->reserved2| ((value&0xFFFF)<<16);	
+#define mblk_set_cseq(m,value) (m)->reserved2=((m)->reserved2 & 0xFFFF) | (((value)&0xFFFF)<<16);	/*RTP sequence number*/
 #define mblk_get_cseq(m) ((m)->reserved2>>16)
 
+#define mblk_set_rtp_timestamp_info(m,ts) (m)->reserved3=(ts);
+#define mblk_get_rtp_timestamp_info(m)    ((m)->reserved3)
+
+#define mblk_set_ssrc_info(m,ssrc) (m)->reserved4=(ssrc);
+#define mblk_get_ssrc_info(m)    ((m)->reserved4)
+
 #define HAVE_ms_bufferizer_fill_current_metas
 	
 struct _MSBufferizer{
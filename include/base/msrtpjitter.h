@@ -0,0 +1,23 @@
+#ifndef __MS_RTP_JITTER_H__
+#define __MS_RTP_JITTER_H__
+#include <stdint.h>
+
+
+#define MS_RTP_JITTER_MAX_DEPTH     1024    /* packets an RtpJitter can hold back */
+
+
+/**
+ * Counters of an RtpJitter filter (see MS_GET_JITTER_STATS).
+ */
+typedef struct _MSRtpJitterStats
+{
+    uint64_t received;          /**< packets put in the buffer */
+    uint64_t lost;              /**< sequence numbers skipped, never received in time */
+    uint64_t late;              /**< dropped, arrived after their place was given up */
+    uint64_t duplicated;        /**< dropped, already in the buffer */
+    uint64_t reordered;         /**< arrived after a packet of a higher sequence number, put back in order */
+    uint64_t resets;            /**< sequence jumps taken as a new stream */
+}MSRtpJitterStats;
+
+
+#endif
@@ -1,13 +1,46 @@
 #ifndef __MS_TICKER_H__
-#define __MS_TICKET_H__
+#define __MS_TICKER_H__
+#include <stdint.h>
 #include <pthread.h>
+#include <base/mscommon.h>
 #include <bctoolbox/bctoolbox.h>
 
+struct _MSFilter;
+
+/**
+ * Structure describing the last time the ticker could not keep up with its interval.
+ */
+typedef struct _MSTickerLateEvent
+{
+    int lateMs;             /**< late at the time of the last event, in miliseconds */
+    uint64_t time;          /**< ticker time of the last event, in miliseconds */
+    int current_late_ms;    /**< late at the last tick, in miliseconds */
+}MSTickerLateEvent;
+
+
+/**
+ * How the ticker schedules its ticks.
+ */
+typedef enum _MSTickerMode
+{
+    MS_TICKER_MODE_REALTIME,    /**< one tick every interval of wall-clock time */
+    MS_TICKER_MODE_OFFLINE      /**< ticks run back-to-back, the ticker stops by itself once the graph is drained */
+}MSTickerMode;
+
+typedef struct _MSTickerParams
+{
+    const char *name;
+    MSTickerMode mode;
+    int nthreads;   /* worker threads running the independent branches of the graph, 0 or 1 to run everything on the ticker thread */
+    bool_t pipeline;    /* run each MS_FILTER_IS_THREADED filter on its own thread, over bounded queues */
+}MSTickerParams;
+
+struct _MSTickerPool;
 
 
 typedef struct _MSTicker
 {
-//    ms_mutex_t lock; /*main lock protecting the filter execution list */
+    ms_mutex_t lock; /*main lock protecting the filter execution list */
 //    ms_cond_t cond;
     bctbx_list_t *execution_list;     /* the list of source filters to be executed.*/
 //    bctbx_list_t *task_list; /* list of tasks (see ms_filter_postpone_task())*/
@@ -21,20 +54,47 @@ typedef struct _MSTicker
 //    void *get_cur_time_data;
 //    ms_mutex_t cur_time_lock; /*mutex protecting the get_cur_time_ptr/get_cur_time_data which can be changed at any time*/
     char *name;
-//    double av_load;   /*average load of the ticker */
+    double av_load;   /*average load of the ticker */
 //    MSTickerPrio prio;
 //    MSTickerTickFunc wait_next_tick;
 //    void *wait_next_tick_data;
-//    MSTickerLateEvent late_event;
+    MSTickerLateEvent late_event;
     unsigned long thread_id;
+    MSTickerMode mode;
+    struct _MSTickerPool *pool;   /* NULL for a single-threaded ticker */
+    bool_t pipeline;
+    bctbx_list_t *filter_threads; /* MSFilterThread of the threaded filters, pipeline only */
     bool_t run;       /* flag to indicate whether the ticker must be run or not */
 }MSTicker;
 
 
 MSTicker *ms_ticker_new();
+MSTicker *ms_ticker_new_with_params(const MSTickerParams *params);
 void ms_ticker_destroy(MSTicker *ticker);
 
+/*
+ * Schedule f and every filter linked to it through ms_filter_link(). The ticker runs them in
+ * topological order, so build the whole graph before attaching it.
+ */
+int ms_ticker_attach(MSTicker *ticker, struct _MSFilter *f);
 
-#endif
+/* stop scheduling the graph containing f, each filter is postprocessed */
+int ms_ticker_detach(MSTicker *ticker, struct _MSFilter *f);
+
+/*
+ * Block until an offline ticker has drained its graph: every filter has been postprocessed
+ * and the filters can be destroyed. Must not be used on a realtime ticker.
+ */
+void ms_ticker_wait(MSTicker *ticker);
+
+/* monotonic time in miliseconds, used as time base by the ticker */
+uint64_t ms_get_cur_time_ms(void);
 
+/* average load of the ticker, in percent of the tick interval */
+float ms_ticker_get_average_load(MSTicker *ticker);
 
+/* copy the last late tick event into ev */
+void ms_ticker_get_last_late_tick(MSTicker *ticker, MSTickerLateEvent *ev);
+
+
+#endif
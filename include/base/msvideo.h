@@ -0,0 +1,67 @@
+#ifndef __MS_VIDEO_H__
+#define __MS_VIDEO_H__
+#include <stdint.h>
+#include <ortp/str_utils.h>
+#include <base/mscommon.h>
+
+
+/**
+ * Layout of a video frame held in a mblk_t. Every frame produced by a video filter carries one in
+ * its data block (dblk_t::db_meta), so the planes may be aligned and padded, or belong to a decoder,
+ * and still flow through the chain without being repacked at each filter.
+ */
+typedef struct _MSPicture
+{
+    int w;
+    int h;
+    int pix_fmt;            /**< enum AVPixelFormat */
+    uint8_t *planes[4];     /**< Y, U, V, unused */
+    int strides[4];         /**< bytes per row of each plane, padding included */
+}MSPicture;
+
+/* size of a packed YUV420P picture of w x h */
+int ms_yuv_buf_size(int w, int h);
+
+/* describe the packed YUV420P picture of w x h starting at ptr */
+void ms_yuv_buf_init(MSPicture *buf, int w, int h, uint8_t *ptr);
+
+/*
+ * Describe the picture held by m: the descriptor travelling with its data block, else (a message
+ * coming from outside the video filters) a packed YUV420P frame of w x h.
+ */
+void ms_yuv_buf_init_from_mblk(MSPicture *buf, mblk_t *m, int w, int h);
+
+/* copy the picture src into dst, both of the same size and pix_fmt, whatever their strides */
+void ms_picture_copy(MSPicture *dst, const MSPicture *src);
+
+/*
+ * Wrap, without any copy, a picture whose planes belong to someone else (eg. a refcounted AVFrame
+ * of a decoder). freefn(arg) is called once the last reference to the message is freed. The planes
+ * need not be contiguous: only b_rptr..b_wptr covers the first one, the MSPicture is the reference.
+ */
+mblk_t *ms_yuv_buf_wrap(const MSPicture *pic, void (*freefn)(void*), void *arg);
+
+
+/*
+ * Pool of YUV420P frame buffers of one resolution, built on msgb_allocator_t: a frame goes back
+ * to the pool when its last user frees it, instead of a multi-megabyte buffer being allocated and
+ * page-faulted for every picture. Asking for another resolution drops the pooled frames of the
+ * previous one. Not thread-safe: it belongs to the filter producing the frames, which may be freed
+ * anywhere.
+ */
+typedef struct _MSYuvBufAllocator MSYuvBufAllocator;
+
+#define MS_PICTURE_ALIGN 32     /* alignment of the rows of the pooled frames, enough for AVX2 */
+
+MSYuvBufAllocator *ms_yuv_buf_allocator_new(void);
+
+/*
+ * Get a YUV420P frame of w x h, its rows aligned on MS_PICTURE_ALIGN bytes. buf (may be NULL) is
+ * filled with its layout, which also travels with the message. b_rptr..b_wptr spans the whole frame.
+ */
+mblk_t *ms_yuv_buf_allocator_get(MSYuvBufAllocator *obj, MSPicture *buf, int w, int h);
+
+void ms_yuv_buf_allocator_free(MSYuvBufAllocator *obj);
+
+
+#endif
@@ -1,5 +1,6 @@
 #ifndef __BCTOOLBOX_H__
 #define __BCTOOLBOX_H__
+#include <stddef.h>
 
 typedef void (*bctbx_list_free_func)(void *);
 typedef struct _bctbx_list
@@ -19,6 +20,9 @@ bctbx_list_t* bctbx_list_next(const bctbx_list_t *elem);
 bctbx_list_t*  bctbx_list_concat(bctbx_list_t* first, bctbx_list_t* second);
 bctbx_list_t* bctbx_list_unlink(bctbx_list_t* list, bctbx_list_t* elem);
 bctbx_list_t * bctbx_list_erase_link(bctbx_list_t* list, bctbx_list_t* elem);
+size_t bctbx_list_size(const bctbx_list_t* list);
+bctbx_list_t* bctbx_list_find(bctbx_list_t* list, const void *data);
+bctbx_list_t* bctbx_list_remove(bctbx_list_t* list, void *data);
 bctbx_list_t * bctbx_list_free(bctbx_list_t * elem);
 bctbx_list_t * bctbx_list_free_with_data(bctbx_list_t *list, bctbx_list_free_func freefunc);
 
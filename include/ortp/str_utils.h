@@ -52,6 +52,8 @@ typedef struct msgb
 	unsigned char *b_wptr;
 	uint32_t reserved1;
 	uint32_t reserved2;
+	uint32_t reserved3;	/* RTP timestamp of the packet the data came from */
+	uint32_t reserved4;	/* RTP SSRC of the packet the data came from */
 #if defined(ORTP_TIMESTAMP)
 	struct timeval timestamp;
 #endif
@@ -65,7 +67,11 @@ typedef struct datab
 	unsigned char *db_base;
 	unsigned char *db_lim;
 	void (*db_freefn)(void*);
-	int db_ref;
+	void *db_freearg;	/* argument of db_freefn, db_base unless given to esballoc_with_arg() */
+	void *db_meta;	/* optional description of the data, valid as long as the block (eg. MSPicture of a video frame) */
+	int db_ref;	/* atomic, a mblk_t and its dupb() copies may be freed from different threads */
+	int db_pool;	/* size class of the pool the dblk_t was taken from, -1 if it was malloc'ed */
+	struct _msgb_pool *db_allocator;	/* msgb_allocator_t the block goes back to when freed, or NULL */
 } dblk_t;
 
 typedef struct _queue
@@ -98,13 +104,18 @@ void mblk_init(mblk_t *mp);
 
 void mblk_meta_copy(const mblk_t *source, mblk_t *dest);
 	
-/* allocates a mblk_t, that points to a datab_t, that points to a buffer of size size. */
+/* allocates a mblk_t, that points to a datab_t, that points to a buffer of size size.
+ * mblk_t headers and data blocks up to 256KB are recycled through per-thread size-class pools,
+ * so that the packet path does not go through malloc/free. */
 mblk_t *allocb(int size, int unused);
 #define BPRI_MED 0
 
 /* allocates a mblk_t, that points to a datab_t, that points to buf; buf will be freed using freefn */
 mblk_t *esballoc(uint8_t *buf, int size, int pri, void (*freefn)(void*) );
 
+/* same as esballoc(), but freefn is called with arg instead of buf (eg. the object owning buf) */
+mblk_t *esballoc_with_arg(uint8_t *buf, int size, int pri, void (*freefn)(void*), void *arg);
+
 /* frees a mblk_t, and if the datab ref_count is 0, frees it and the buffer too */
 void freeb(mblk_t *m);
 
@@ -142,14 +153,36 @@ mblk_t *concatb(mblk_t *mp, mblk_t *newm);
 #define qend(q,mp)	((mp)==&(q)->_q_stopper)
 #define qnext(q,mp) ((mp)->b_next)
 
+/*
+ * Allocator keeping the data blocks it hands out: when the last reference to a block (the
+ * mblk_t returned or any dupb() of it) is freed, from whatever thread, the block goes back to
+ * the free list of its power of two size bucket. msgb_allocator_alloc() is O(1) and must only be
+ * called by the thread owning the allocator. Blocks may outlive msgb_allocator_uninit().
+ */
 typedef struct _msgb_allocator{
-	queue_t q;
+	struct _msgb_pool *pool;
+	int max_blocks;	/* 0 for no limit */
 }msgb_allocator_t;
 
 void msgb_allocator_init(msgb_allocator_t *pa);
+/* once max_blocks are in use, msgb_allocator_alloc() returns plain allocb() blocks */
+void msgb_allocator_set_max_blocks(msgb_allocator_t *pa, int max_blocks);
 mblk_t *msgb_allocator_alloc(msgb_allocator_t *pa, int size);
 void msgb_allocator_uninit(msgb_allocator_t *pa);
 
+/* give the blocks cached by the pools back to the system (they are refilled on demand) */
+void msgb_pool_trim(void);
+
+struct AVBufferRef;
+
+/*
+ * Message pointing at data held by a refcounted FFmpeg buffer (AVPacket::buf, AVFrame::buf[0]),
+ * without any copy: the message takes its own reference on buf, released with the data block.
+ * When buf is NULL (data not refcounted) the data is copied into a block of fallback, or of
+ * allocb() when fallback is NULL. b_rptr..b_wptr spans the size bytes at data.
+ */
+mblk_t *msgb_from_avbuffer(msgb_allocator_t *fallback, struct AVBufferRef *buf, uint8_t *data, int size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,239 @@
+#include <string.h>
+#include <base/mscodecutils.h>
+
+
+#define SPS_MAX_SIZE 512    /*beyond this, the end of a SPS (VUI...) is not needed for the fields parsed here*/
+
+
+typedef struct _BitReader
+{
+    const uint8_t *data;
+    int size;       /*bits*/
+    int pos;
+}BitReader;
+
+static int read_bit(BitReader *br)
+{
+    int bit = 0;
+    if (br->pos >= br->size)    return 0;
+    bit = (br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1;
+    br->pos++;
+    return bit;
+}
+
+static uint32_t read_bits(BitReader *br, int n)
+{
+    uint32_t v = 0;
+    while (n-- > 0)     v = (v << 1) | read_bit(br);
+    return v;
+}
+
+static uint32_t read_ue(BitReader *br)
+{
+    int zeros = 0;
+    while (read_bit(br) == 0 && zeros < 32 && br->pos < br->size)   zeros++;
+    if (zeros == 0)     return 0;
+    return ((1u << zeros) - 1) + read_bits(br, zeros);
+}
+
+static int32_t read_se(BitReader *br)
+{
+    uint32_t v = read_ue(br);
+    return (v & 1) ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+}
+
+static void skip_scaling_list(BitReader *br, int size)
+{
+    int last = 8;
+    int next = 8;
+    int i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (next != 0)  next = (last + read_se(br) + 256) % 256;
+        last = (next == 0) ? last : next;
+    }
+}
+
+int ms_h264_parse_sps(const uint8_t *nal, int len, MSH264SpsInfo *info)
+{
+    uint8_t rbsp[SPS_MAX_SIZE];
+    BitReader br;
+    int size = 0;
+    int zeros = 0;
+    int chroma_format_idc = 1;
+    int separate_colour_plane = 0;
+    int frame_mbs_only = 0;
+    int width_mbs, height_map_units;
+    int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    int crop_unit_x, crop_unit_y;
+    int i;
+
+    if (len < 4 || (nal[0] & 0x1f) != 7)    return -1;
+
+    /*drop the emulation prevention bytes*/
+    for (i = 1; i < len && size < SPS_MAX_SIZE; i++)
+    {
+        if (zeros >= 2 && nal[i] == 3)
+        {
+            zeros = 0;
+            continue;
+        }
+        zeros = (nal[i] == 0) ? zeros + 1 : 0;
+        rbsp[size++] = nal[i];
+    }
+    br.data = rbsp;
+    br.size = size * 8;
+    br.pos = 0;
+
+    memset(info, 0, sizeof(MSH264SpsInfo));
+    info->profile_idc = read_bits(&br, 8);
+    read_bits(&br, 8);      /*constraint flags*/
+    info->level_idc = read_bits(&br, 8);
+    info->sps_id = read_ue(&br);
+
+    switch (info->profile_idc)
+    {
+        case 100: case 110: case 122: case 244: case 44:
+        case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+        {
+            chroma_format_idc = read_ue(&br);
+            if (chroma_format_idc == 3)     separate_colour_plane = read_bit(&br);
+            read_ue(&br);       /*bit_depth_luma_minus8*/
+            read_ue(&br);       /*bit_depth_chroma_minus8*/
+            read_bit(&br);      /*qpprime_y_zero_transform_bypass_flag*/
+            if (read_bit(&br))  /*seq_scaling_matrix_present_flag*/
+            {
+                for (i = 0; i < (chroma_format_idc != 3 ? 8 : 12); i++)
+                {
+                    if (read_bit(&br))  skip_scaling_list(&br, i < 6 ? 16 : 64);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    read_ue(&br);       /*log2_max_frame_num_minus4*/
+    switch (read_ue(&br))   /*pic_order_cnt_type*/
+    {
+        case 0:
+        {
+            read_ue(&br);   /*log2_max_pic_order_cnt_lsb_minus4*/
+            break;
+        }
+        case 1:
+        {
+            int n;
+            read_bit(&br);  /*delta_pic_order_always_zero_flag*/
+            read_se(&br);   /*offset_for_non_ref_pic*/
+            read_se(&br);   /*offset_for_top_to_bottom_field*/
+            n = read_ue(&br);
+            for (i = 0; i < n && br.pos < br.size; i++)     read_se(&br);
+            break;
+        }
+        default:
+            break;
+    }
+    read_ue(&br);       /*max_num_ref_frames*/
+    read_bit(&br);      /*gaps_in_frame_num_value_allowed_flag*/
+    width_mbs = read_ue(&br) + 1;
+    height_map_units = read_ue(&br) + 1;
+    frame_mbs_only = read_bit(&br);
+    if (!frame_mbs_only)    read_bit(&br);  /*mb_adaptive_frame_field_flag*/
+    read_bit(&br);      /*direct_8x8_inference_flag*/
+    if (read_bit(&br))  /*frame_cropping_flag*/
+    {
+        crop_left = read_ue(&br);
+        crop_right = read_ue(&br);
+        crop_top = read_ue(&br);
+        crop_bottom = read_ue(&br);
+    }
+    if (br.pos > br.size)   return -1;
+
+    if (chroma_format_idc == 0 || separate_colour_plane)
+    {
+        crop_unit_x = 1;
+        crop_unit_y = 2 - frame_mbs_only;
+    }
+    else
+    {
+        crop_unit_x = (chroma_format_idc == 3) ? 1 : 2;
+        crop_unit_y = ((chroma_format_idc == 1) ? 2 : 1) * (2 - frame_mbs_only);
+    }
+    info->width = width_mbs * 16 - crop_unit_x * (crop_left + crop_right);
+    info->height = (2 - frame_mbs_only) * height_map_units * 16 - crop_unit_y * (crop_top + crop_bottom);
+    if (info->width <= 0 || info->height <= 0)  return -1;
+    return 0;
+}
+
+const uint8_t *ms_h264_next_nal(const uint8_t *data, int size, int *pos, int *len)
+{
+    const uint8_t *nal = NULL;
+    int i = *pos;
+
+    /*the start code: 00 00 01, maybe after more zeros*/
+    while (i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1))   i++;
+    if (i + 3 > size)
+    {
+        *pos = size;
+        return NULL;
+    }
+    i += 3;
+    nal = data + i;
+
+    /*up to the next start code, the zeros before it excluded*/
+    while (i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && (data[i + 2] == 1 || data[i + 2] == 0)))   i++;
+    if (i + 3 > size)   i = size;
+    *len = data + i - nal;
+    *pos = i;
+    return nal;
+}
+
+
+static const int mpa_bitrates[2][3][15] = {
+    {   /*MPEG 1: layer 1, 2, 3*/
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    },
+    {   /*MPEG 2 and 2.5*/
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    },
+};
+
+static const int mpa_sample_rates[3] = {44100, 48000, 32000};
+
+int ms_mpa_parse_header(const uint8_t *p, MSMpaHeader *h)
+{
+    uint32_t header = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    int version_bits = (header >> 19) & 3;
+    int layer_bits = (header >> 17) & 3;
+    int bitrate_index = (header >> 12) & 15;
+    int sample_rate_index = (header >> 10) & 3;
+    int padding = (header >> 9) & 1;
+
+    if ((header & 0xffe00000) != 0xffe00000 || version_bits == 1 || layer_bits == 0
+        || bitrate_index == 15 || sample_rate_index == 3)
+    {
+        return -1;
+    }
+
+    memset(h, 0, sizeof(MSMpaHeader));
+    h->version = (version_bits == 3) ? 1 : (version_bits == 2 ? 2 : 25);
+    h->layer = 4 - layer_bits;
+    h->bitrate = mpa_bitrates[h->version != 1][h->layer - 1][bitrate_index] * 1000;
+    h->sample_rate = mpa_sample_rates[sample_rate_index] >> (h->version == 1 ? 0 : (h->version == 2 ? 1 : 2));
+    h->channels = (((header >> 6) & 3) == 3) ? 1 : 2;
+    if (h->layer == 1)              h->samples_per_frame = 384;
+    else if (h->layer == 2)         h->samples_per_frame = 1152;
+    else                            h->samples_per_frame = (h->version == 1) ? 1152 : 576;
+
+    if (h->bitrate == 0)            h->frame_size = 0;
+    else if (h->layer == 1)         h->frame_size = (12 * h->bitrate / h->sample_rate + padding) * 4;
+    else                            h->frame_size = h->samples_per_frame / 8 * h->bitrate / h->sample_rate + padding;
+    return 0;
+}
@@ -23,6 +23,20 @@ void ms_filter_destroy(MSFilter *f)
 }
 
 
+void ms_filter_preprocess(MSFilter *f, struct _MSTicker *t)
+{
+    f->last_tick = 0;
+    f->ticker = t;
+    if (f->desc->preprocess != NULL) f->desc->preprocess(f);
+}
+
+void ms_filter_postprocess(MSFilter *f)
+{
+    if (f->desc->postprocess != NULL) f->desc->postprocess(f);
+    f->ticker = NULL;
+}
+
+
 void ms_connection_helper_start(MSConnectionHelper *h)
 {
     h->last.filter=0;
@@ -68,15 +82,19 @@ int ms_connection_helper_unlink(MSConnectionHelper *h, MSFilter *f, int inpin, i
 }
 
 int ms_filter_link(MSFilter *f1, int pin1, MSFilter *f2, int pin2)
+{
+    return ms_filter_link_with_type(f1, pin1, f2, pin2, MS_QUEUE_DEFAULT);
+}
+int ms_filter_link_with_type(MSFilter *f1, int pin1, MSFilter *f2, int pin2, MSQueueType type)
 {
     MSQueue *q;
-    printf("ms_filter_link: %s:%p,%i-->%s:%p,%i\n",f1->desc->name,f1,pin1,f2->desc->name,f2,pin2);
+    printf("ms_filter_link: %s:%p,%i-->%s:%p,%i%s\n",f1->desc->name,f1,pin1,f2->desc->name,f2,pin2,type == MS_QUEUE_SPSC ? " (spsc)" : "");
 //    ms_return_val_if_fail(pin1<f1->desc->noutputs, -1);
 //    ms_return_val_if_fail(pin2<f2->desc->ninputs, -1);
 //    ms_return_val_if_fail(f1->outputs[pin1]==NULL,-1);
 //    ms_return_val_if_fail(f2->inputs[pin2]==NULL,-1);
 
-    q = ms_queue_new(f1, pin1, f2, pin2);
+    q = ms_queue_new_with_type(f1, pin1, f2, pin2, type);
     f1->outputs[pin1] = q;
     f2->inputs[pin2] = q;
     return 0;
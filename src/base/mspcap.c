@@ -0,0 +1,875 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <base/mspcap.h>
+#include <base/mscodecutils.h>
+
+
+#define PCAP_FILE_HDR_LEN   24
+#define PCAP_RECORD_HDR_LEN 16
+#define PCAPNG_BLOCK_MIN    12      /* type, length, length */
+#define ETHERNET_HDR_LEN    14
+#define VLAN_TAG_LEN        4
+#define SLL_HDR_LEN         16
+#define SLL2_HDR_LEN        20
+#define NULL_HDR_LEN        4
+#define IP_HDR_LEN          20
+#define IPV6_HDR_LEN        40
+#define UDP_HDR_LEN         8
+#define RTP_HDR_LEN         12
+#define RTP_VERSION         2
+#define RFC2250_HDR_LEN     4
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NS       0xa1b23c4d
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+#define PCAPNG_IDB          1
+#define PCAPNG_PB           2       /* obsolete packet block */
+#define PCAPNG_SPB          3
+#define PCAPNG_EPB          6
+#define PCAPNG_OPT_TSRESOL  9
+
+#define ETHERTYPE_IPV4      0x0800
+#define ETHERTYPE_IPV6      0x86dd
+#define ETHERTYPE_VLAN      0x8100
+#define ETHERTYPE_QINQ      0x88a8
+#define ETHERTYPE_QINQ_OLD  0x9100
+
+#define INDEX_MAGIC         0x5850534d      /* "MSPX" */
+#define INDEX_VERSION       1
+
+#define PROBE_H264_MAX_ERRORS 20    /* percent of the packets of a dynamic flow which may not look like H.264 */
+#define PROBE_H264_MIN_KEYS   2     /* IDR, SPS or PPS NAL units a dynamic flow without a parsed SPS must show */
+
+
+typedef struct _MSPcapIndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint64_t count;
+}MSPcapIndexHeader;
+
+
+static uint16_t read_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t fmt_get32(const MSPcapFormat *fmt, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return fmt->swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t fmt_get16(const MSPcapFormat *fmt, const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return fmt->swapped ? __builtin_bswap16(v) : v;
+}
+
+int ms_pcap_format_init(MSPcapFormat *fmt, const uint8_t *data, uint32_t size)
+{
+    uint32_t magic = 0;
+
+    memset(fmt, 0, sizeof(MSPcapFormat));
+    if (size < MS_PCAP_FILE_HDR_PEEK)   return -1;
+    memcpy(&magic, data, 4);
+
+    if (magic == PCAPNG_SHB)
+    {
+        uint32_t len = 0;
+        memcpy(&magic, data + 8, 4);
+        if (magic != PCAPNG_BYTE_ORDER && magic != __builtin_bswap32(PCAPNG_BYTE_ORDER))    return -1;
+        fmt->ng = TRUE;
+        fmt->swapped = (magic != PCAPNG_BYTE_ORDER);
+        /*the interfaces come in the blocks after the section header*/
+        len = fmt_get32(fmt, data + 4);
+        return (len >= MS_PCAP_FILE_HDR_PEEK && len % 4 == 0) ? (int)len : -1;
+    }
+
+    if (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS))
+    {
+        fmt->swapped = TRUE;
+        magic = __builtin_bswap32(magic);
+    }
+    if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS)  return -1;
+    fmt->nanosecond = (magic == PCAP_MAGIC_NS);
+    /*the upper bits carry the FCS length*/
+    fmt->link_type = fmt_get32(fmt, data + 20) & 0x0fffffff;
+    return PCAP_FILE_HDR_LEN;
+}
+
+int ms_pcap_record_peek_size(const MSPcapFormat *fmt)
+{
+    return fmt->ng ? PCAPNG_BLOCK_MIN : PCAP_RECORD_HDR_LEN;
+}
+
+uint32_t ms_pcap_record_size(const MSPcapFormat *fmt, const uint8_t *hdr)
+{
+    uint32_t len = 0;
+
+    if (!fmt->ng)
+    {
+        len = fmt_get32(fmt, hdr + 8);
+        return (len <= 0x7fffffff - PCAP_RECORD_HDR_LEN) ? PCAP_RECORD_HDR_LEN + len : 0;
+    }
+    if (read_be32(hdr) == PCAPNG_SHB)
+    {
+        /*a new section, whose length is written in its own byte order, maybe not the one of the last*/
+        uint32_t bom;
+        memcpy(&bom, hdr + 8, 4);
+        memcpy(&len, hdr + 4, 4);
+        if (bom != PCAPNG_BYTE_ORDER)   len = __builtin_bswap32(len);
+    }
+    else
+    {
+        len = fmt_get32(fmt, hdr + 4);
+    }
+    return (len >= PCAPNG_BLOCK_MIN && len % 4 == 0) ? len : 0;
+}
+
+/*pcapng timestamp in units of 10^-tsresol (or 2^-tsresol with the high bit) seconds*/
+static uint64_t ng_time_us(uint64_t ts, uint8_t tsresol)
+{
+    uint64_t units = 1;
+    int i;
+
+    if (tsresol & 0x80)
+    {
+        int shift = tsresol & 0x7f;
+        if (shift >= 64)    return 0;
+        return (ts >> shift) * 1000000 + (((ts & ((1ull << shift) - 1)) * 1000000) >> shift);
+    }
+    if (tsresol == 6)   return ts;
+    for (i = 0; i < tsresol && i < 19; i++)     units *= 10;
+    return (tsresol > 6) ? ts / (units / 1000000) : ts * (1000000 / units);
+}
+
+/*read an interface description block: its link type and timestamp resolution*/
+static void ng_add_interface(MSPcapFormat *fmt, const uint8_t *block, uint32_t len)
+{
+    uint32_t pos = 16;
+
+    if (fmt->ninterfaces == MS_PCAP_MAX_INTERFACES || len < 20)  return;
+    fmt->interfaces[fmt->ninterfaces].link_type = fmt_get16(fmt, block + 8);
+    fmt->interfaces[fmt->ninterfaces].tsresol = 6;
+    while (pos + 4 <= len - 4)
+    {
+        uint16_t code = fmt_get16(fmt, block + pos);
+        uint16_t opt_len = fmt_get16(fmt, block + pos + 2);
+        if (code == 0 || pos + 4 + opt_len > len - 4)   break;
+        if (code == PCAPNG_OPT_TSRESOL && opt_len >= 1)     fmt->interfaces[fmt->ninterfaces].tsresol = block[pos + 4];
+        pos += 4 + ((opt_len + 3) & ~3);
+    }
+    fmt->ninterfaces++;
+}
+
+/*a pcapng block: 0 if it holds a packet, rec filled, 1 if it is an other block*/
+static int ng_read_block(MSPcapFormat *fmt, const uint8_t *block, uint32_t len, MSPcapRecord *rec)
+{
+    uint32_t type = fmt_get32(fmt, block);
+    uint32_t interface = 0;
+    uint32_t cap_len = 0;
+    uint32_t hdr_len = 0;
+    uint64_t ts = 0;
+
+    switch (type)
+    {
+        case PCAPNG_SHB:
+        {
+            /*a new section, maybe in the other byte order, with its own interfaces*/
+            uint32_t bom;
+            memcpy(&bom, block + 8, 4);
+            fmt->swapped = (bom != PCAPNG_BYTE_ORDER);
+            fmt->ninterfaces = 0;
+            return 1;
+        }
+        case PCAPNG_IDB:
+        {
+            ng_add_interface(fmt, block, len);
+            return 1;
+        }
+        case PCAPNG_EPB:
+        {
+            if (len < 32)   return 1;
+            interface = fmt_get32(fmt, block + 8);
+            ts = ((uint64_t)fmt_get32(fmt, block + 12) << 32) | fmt_get32(fmt, block + 16);
+            cap_len = fmt_get32(fmt, block + 20);
+            hdr_len = 28;
+            break;
+        }
+        case PCAPNG_PB:
+        {
+            if (len < 32)   return 1;
+            interface = fmt_get16(fmt, block + 8);
+            ts = ((uint64_t)fmt_get32(fmt, block + 12) << 32) | fmt_get32(fmt, block + 16);
+            cap_len = fmt_get32(fmt, block + 20);
+            hdr_len = 28;
+            break;
+        }
+        case PCAPNG_SPB:
+        {
+            /*no timestamp nor captured length: the packet, cut to the block*/
+            if (len < 16)   return 1;
+            cap_len = fmt_get32(fmt, block + 8);
+            if (cap_len > len - 16)     cap_len = len - 16;
+            hdr_len = 12;
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    if (interface >= (uint32_t)fmt->ninterfaces || cap_len > len - hdr_len - 4)    return 1;
+    rec->link_type = fmt->interfaces[interface].link_type;
+    rec->time_us = (type == PCAPNG_SPB) ? fmt->last_time_us : ng_time_us(ts, fmt->interfaces[interface].tsresol);
+    rec->data = block + hdr_len;
+    rec->cap_len = cap_len;
+    return 0;
+}
+
+int ms_pcap_next_record(MSPcapFormat *fmt, const uint8_t *data, uint64_t size, uint64_t *pos, MSPcapRecord *rec)
+{
+    uint64_t p = *pos;
+
+    while (p + ms_pcap_record_peek_size(fmt) <= size)
+    {
+        uint32_t len = ms_pcap_record_size(fmt, data + p);
+        if (len == 0 || p + len > size)     return -1;
+
+        rec->offset = p;
+        if (!fmt->ng)
+        {
+            uint32_t frac = fmt_get32(fmt, data + p + 4);
+            rec->time_us = (uint64_t)fmt_get32(fmt, data + p) * 1000000 + (fmt->nanosecond ? frac / 1000 : frac);
+            rec->link_type = fmt->link_type;
+            rec->data = data + p + PCAP_RECORD_HDR_LEN;
+            rec->cap_len = len - PCAP_RECORD_HDR_LEN;
+            *pos = p + len;
+            return 0;
+        }
+        p += len;
+        if (ng_read_block(fmt, data + rec->offset, len, rec) == 0)
+        {
+            fmt->last_time_us = rec->time_us;
+            *pos = p;
+            return 0;
+        }
+    }
+    *pos = p;
+    return -1;
+}
+
+
+static uint32_t addr6_key(const uint8_t *addr)
+{
+    uint32_t h = 0x811c9dc5;
+    int i;
+    for (i = 0; i < 16; i++)    h = (h ^ addr[i]) * 0x01000193;
+    return h;
+}
+
+uint32_t ms_pcap_addr_key(const char *addr)
+{
+    struct in_addr a4;
+    struct in6_addr a6;
+
+    if (addr == NULL)   return INADDR_NONE;
+    if (inet_pton(AF_INET, addr, &a4) == 1)     return a4.s_addr;
+    if (inet_pton(AF_INET6, addr, &a6) == 1)    return addr6_key(a6.s6_addr);
+    return INADDR_NONE;
+}
+
+/*find the IP header behind the link layer header, *ethertype tells IPv4 or IPv6*/
+static const uint8_t *skip_link_header(int link_type, const uint8_t *data, uint32_t len, uint16_t *ethertype)
+{
+    uint32_t pos = 0;
+
+    switch (link_type)
+    {
+        case MS_PCAP_LINKTYPE_ETHERNET:
+        {
+            if (len < ETHERNET_HDR_LEN)     return NULL;
+            *ethertype = read_be16(data + 12);
+            pos = ETHERNET_HDR_LEN;
+            /*802.1Q tags, stacked for QinQ*/
+            while ((*ethertype == ETHERTYPE_VLAN || *ethertype == ETHERTYPE_QINQ || *ethertype == ETHERTYPE_QINQ_OLD)
+                && pos + VLAN_TAG_LEN <= len)
+            {
+                *ethertype = read_be16(data + pos + 2);
+                pos += VLAN_TAG_LEN;
+            }
+            break;
+        }
+        case MS_PCAP_LINKTYPE_LINUX_SLL:
+        {
+            if (len < SLL_HDR_LEN)  return NULL;
+            *ethertype = read_be16(data + 14);
+            pos = SLL_HDR_LEN;
+            break;
+        }
+        case MS_PCAP_LINKTYPE_LINUX_SLL2:
+        {
+            if (len < SLL2_HDR_LEN)     return NULL;
+            *ethertype = read_be16(data);
+            pos = SLL2_HDR_LEN;
+            break;
+        }
+        case MS_PCAP_LINKTYPE_NULL:
+        {
+            /*AF_ value in the byte order of the capturing host: 2 for IPv4, 24, 28 or 30 for IPv6*/
+            uint32_t family = 0;
+            if (len < NULL_HDR_LEN)     return NULL;
+            memcpy(&family, data, 4);
+            if (family > 0xffff)    family = __builtin_bswap32(family);
+            *ethertype = (family == 2) ? ETHERTYPE_IPV4 : ETHERTYPE_IPV6;
+            pos = NULL_HDR_LEN;
+            break;
+        }
+        case MS_PCAP_LINKTYPE_RAW:
+        case 12:    /*DLT_RAW of some systems*/
+        case 14:
+        {
+            if (len < 1)    return NULL;
+            *ethertype = ((data[0] >> 4) == 6) ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+            break;
+        }
+        default:
+            return NULL;
+    }
+    return (pos < len) ? data + pos : NULL;
+}
+
+int ms_pcap_dissect(int link_type, const uint8_t *data, uint32_t len, MSPcapPacket *pkt)
+{
+    const uint8_t *end = data + len;
+    const uint8_t *ip = NULL;
+    const uint8_t *udp = NULL;
+    const uint8_t *rtp = NULL;
+    uint16_t ethertype = 0;
+    uint32_t udp_len = 0;
+    uint32_t rtp_hdr_len = 0;
+
+    memset(pkt, 0, sizeof(MSPcapPacket));
+    pkt->payload_type = MS_PCAP_NO_RTP;
+    if ((ip = skip_link_header(link_type, data, len, &ethertype)) == NULL)  return -1;
+
+    if (ethertype == ETHERTYPE_IPV4)
+    {
+        uint32_t ihl = 4 * (ip[0] & 0x0f);
+        if (end - ip < IP_HDR_LEN || (ip[0] >> 4) != 4 || ihl < IP_HDR_LEN)    return -1;
+        pkt->ip_version = 4;
+        pkt->protocol = ip[9];
+        memcpy(pkt->src_ip, ip + 12, 4);
+        memcpy(pkt->dst_ip, ip + 16, 4);
+        memcpy(&pkt->src_addr, ip + 12, 4);
+        memcpy(&pkt->dst_addr, ip + 16, 4);
+        /*only the first fragment carries the UDP header*/
+        if ((read_be16(ip + 6) & 0x1fff) != 0)  return -1;
+        udp = ip + ihl;
+    }
+    else if (ethertype == ETHERTYPE_IPV6)
+    {
+        uint8_t next = 0;
+        if (end - ip < IPV6_HDR_LEN || (ip[0] >> 4) != 6)  return -1;
+        pkt->ip_version = 6;
+        memcpy(pkt->src_ip, ip + 8, 16);
+        memcpy(pkt->dst_ip, ip + 24, 16);
+        pkt->src_addr = addr6_key(pkt->src_ip);
+        pkt->dst_addr = addr6_key(pkt->dst_ip);
+        next = ip[6];
+        udp = ip + IPV6_HDR_LEN;
+        /*hop-by-hop, routing, fragment and destination options extension headers*/
+        while (next == 0 || next == 43 || next == 44 || next == 60)
+        {
+            if (end - udp < 8)  return -1;
+            uint8_t type = next;
+            if (type == 44 && (read_be16(udp + 2) & 0xfff8) != 0)    return -1;
+            next = udp[0];
+            udp += (type == 44) ? 8 : 8 * (udp[1] + 1);
+        }
+        pkt->protocol = next;
+    }
+    else
+    {
+        return -1;
+    }
+    if (pkt->protocol != 17 || udp > end || end - udp < UDP_HDR_LEN)    return -1;
+
+    udp_len = read_be16(udp + 4);
+    if (udp_len < UDP_HDR_LEN || udp_len > end - udp)   return -1;
+    pkt->src_port = read_be16(udp);
+    pkt->dst_port = read_be16(udp + 2);
+    pkt->payload_offset = udp + UDP_HDR_LEN - data;
+    pkt->payload_size = udp_len - UDP_HDR_LEN;
+
+    rtp = udp + UDP_HDR_LEN;
+    if (pkt->payload_size < RTP_HDR_LEN || (rtp[0] >> 6) != RTP_VERSION)    return 0;
+    rtp_hdr_len = RTP_HDR_LEN + 4 * (rtp[0] & 0x0f);
+    if (rtp_hdr_len > pkt->payload_size)    return 0;
+
+    pkt->payload_type = rtp[1] & 0x7f;
+    pkt->marker = rtp[1] >> 7;
+    pkt->seq = read_be16(rtp + 2);
+    pkt->timestamp = read_be32(rtp + 4);
+    pkt->ssrc = read_be32(rtp + 8);
+    pkt->payload_offset += rtp_hdr_len;
+    pkt->payload_size -= rtp_hdr_len;
+    return 0;
+}
+
+
+MSPcapIndex *ms_pcap_index_build(const char *pcap_file)
+{
+    MSPcapIndex *index = NULL;
+    MSPcapFormat fmt;
+    MSPcapRecord rec;
+    struct stat st;
+    uint8_t *base = NULL;
+    uint64_t pos = 0;
+    int hdr_len = -1;
+    int capacity = 0;
+    int fd = -1;
+
+    if ((fd = open(pcap_file, O_RDONLY)) < 0)
+    {
+        printf("%s : open %s failed.\n", __func__, pcap_file);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < MS_PCAP_FILE_HDR_PEEK
+        || (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        printf("%s : cannot map %s.\n", __func__, pcap_file);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    if ((hdr_len = ms_pcap_format_init(&fmt, base, st.st_size)) < 0)
+    {
+        printf("%s : %s is not a capture.\n", __func__, pcap_file);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    index = ms_new0(MSPcapIndex, 1);
+    index->file_size = st.st_size;
+    index->file_mtime = st.st_mtime;
+
+    pos = hdr_len;
+    while (ms_pcap_next_record(&fmt, base, st.st_size, &pos, &rec) == 0)
+    {
+        MSPcapIndexEntry *e = NULL;
+        MSPcapPacket pkt;
+
+        if (index->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            index->entries = ms_realloc(index->entries, capacity * sizeof(MSPcapIndexEntry));
+        }
+        e = &index->entries[index->count++];
+        memset(e, 0, sizeof(MSPcapIndexEntry));
+        e->offset = rec.offset;
+        e->time_us = rec.time_us;
+        if (ms_pcap_dissect(rec.link_type, rec.data, rec.cap_len, &pkt) == 0)
+        {
+            e->src_addr = pkt.src_addr;
+            e->dst_addr = pkt.dst_addr;
+            e->src_port = pkt.src_port;
+            e->dst_port = pkt.dst_port;
+        }
+        e->protocol = pkt.protocol;
+        e->payload_type = pkt.payload_type;
+        e->seq = pkt.seq;
+        if (pkt.marker) e->flags |= MS_PCAP_FLAG_MARKER;
+    }
+    munmap(base, st.st_size);
+    return index;
+}
+
+char *ms_pcap_index_file_name(const char *pcap_file)
+{
+    size_t len = strlen(pcap_file) + sizeof(".idx");
+    char *name = ms_malloc(len);
+    snprintf(name, len, "%s.idx", pcap_file);
+    return name;
+}
+
+int ms_pcap_index_save(const MSPcapIndex *index, const char *index_file)
+{
+    MSPcapIndexHeader hdr;
+    FILE *fp = NULL;
+    int ret = 0;
+
+    if ((fp = fopen(index_file, "wb")) == NULL)
+    {
+        printf("%s : fopen %s failed.\n", __func__, index_file);
+        return -1;
+    }
+    hdr.magic = INDEX_MAGIC;
+    hdr.version = INDEX_VERSION;
+    hdr.file_size = index->file_size;
+    hdr.file_mtime = index->file_mtime;
+    hdr.count = index->count;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+        || fwrite(index->entries, sizeof(MSPcapIndexEntry), index->count, fp) != (size_t)index->count)
+    {
+        printf("%s : fwrite %s failed.\n", __func__, index_file);
+        ret = -1;
+    }
+    if (fclose(fp) != 0)    ret = -1;
+    if (ret < 0)    unlink(index_file);
+    return ret;
+}
+
+MSPcapIndex *ms_pcap_index_load(const char *index_file, const char *pcap_file)
+{
+    MSPcapIndex *index = NULL;
+    MSPcapIndexHeader hdr;
+    struct stat st;
+    struct stat index_st;
+    FILE *fp = NULL;
+
+    if (stat(pcap_file, &st) < 0 || stat(index_file, &index_st) < 0 || (fp = fopen(index_file, "rb")) == NULL)
+    {
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != INDEX_MAGIC || hdr.version != INDEX_VERSION
+        || hdr.file_size != (uint64_t)st.st_size || hdr.file_mtime != st.st_mtime
+        || (uint64_t)index_st.st_size != sizeof(hdr) + hdr.count * sizeof(MSPcapIndexEntry))
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    index = ms_new0(MSPcapIndex, 1);
+    index->file_size = hdr.file_size;
+    index->file_mtime = hdr.file_mtime;
+    index->count = hdr.count;
+    index->entries = ms_malloc(index->count * sizeof(MSPcapIndexEntry) + 1);
+    if (fread(index->entries, sizeof(MSPcapIndexEntry), index->count, fp) != (size_t)index->count)
+    {
+        ms_pcap_index_free(index);
+        index = NULL;
+    }
+    fclose(fp);
+    return index;
+}
+
+MSPcapIndex *ms_pcap_index_open(const char *pcap_file)
+{
+    char *index_file = ms_pcap_index_file_name(pcap_file);
+    MSPcapIndex *index = ms_pcap_index_load(index_file, pcap_file);
+
+    if (index == NULL && (index = ms_pcap_index_build(pcap_file)) != NULL)
+    {
+        /*still usable for this run if the sidecar cannot be written*/
+        ms_pcap_index_save(index, index_file);
+    }
+    ms_free(index_file);
+    return index;
+}
+
+int ms_pcap_index_find(const MSPcapIndex *index, int64_t time_us)
+{
+    int lo = 0;
+    int hi = index->count;
+    uint64_t t = 0;
+
+    if (index->count == 0)  return 0;
+    t = index->entries[0].time_us + (time_us > 0 ? time_us : 0);
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].time_us < t)    lo = mid + 1;
+        else                                    hi = mid;
+    }
+    return lo;
+}
+
+int ms_pcap_index_split(const MSPcapIndex *index, int n, MSPcapTimeRange *ranges)
+{
+    uint64_t t0 = 0;
+    int filled = 0;
+    int i;
+
+    if (index->count == 0 || n <= 0)    return 0;
+    t0 = index->entries[0].time_us;
+    for (i = 0; i < n; i++)
+    {
+        int first = (int)((int64_t)index->count * i / n);
+        int64_t start = index->entries[first].time_us - t0;
+
+        /*packets of the same time go to the same range*/
+        if (filled > 0 && start <= ranges[filled - 1].start_us)     continue;
+        if (filled > 0) ranges[filled - 1].end_us = start;
+        ranges[filled].start_us = start;
+        ranges[filled].end_us = -1;
+        ranges[filled].rebase = FALSE;
+        filled++;
+    }
+    return filled;
+}
+
+void ms_pcap_index_free(MSPcapIndex *index)
+{
+    if (index->entries != NULL) ms_free(index->entries);
+    ms_free(index);
+}
+
+
+static MSPcapFlowInfo *probe_lookup(MSPcapProbe *probe, const MSPcapPacket *pkt, int *capacity)
+{
+    MSPcapFlowInfo *info = NULL;
+    int i;
+
+    for (i = probe->count - 1; i >= 0; i--)
+    {
+        info = &probe->flows[i];
+        if (info->ssrc == pkt->ssrc && info->payload_type == pkt->payload_type
+            && info->src_addr == pkt->src_addr && info->dst_addr == pkt->dst_addr
+            && info->src_port == pkt->src_port && info->dst_port == pkt->dst_port)
+        {
+            return info;
+        }
+    }
+
+    if (probe->count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        probe->flows = ms_realloc(probe->flows, *capacity * sizeof(MSPcapFlowInfo));
+    }
+    info = &probe->flows[probe->count++];
+    memset(info, 0, sizeof(MSPcapFlowInfo));
+    info->src_addr = pkt->src_addr;
+    info->dst_addr = pkt->dst_addr;
+    info->src_port = pkt->src_port;
+    info->dst_port = pkt->dst_port;
+    info->ssrc = pkt->ssrc;
+    info->payload_type = pkt->payload_type;
+    inet_ntop(pkt->ip_version == 6 ? AF_INET6 : AF_INET, pkt->src_ip, info->src, sizeof(info->src));
+    inet_ntop(pkt->ip_version == 6 ? AF_INET6 : AF_INET, pkt->dst_ip, info->dst, sizeof(info->dst));
+    switch (pkt->payload_type)
+    {
+        case 0:
+        {
+            info->encoding = "PCMU";
+            info->mime_type = "G711";
+            info->clock_rate = info->sample_rate = 8000;
+            info->channels = 1;
+            break;
+        }
+        case 8:
+        {
+            info->encoding = "PCMA";
+            info->clock_rate = info->sample_rate = 8000;
+            info->channels = 1;
+            break;
+        }
+        case 14:
+        {
+            info->encoding = "MPA";
+            info->clock_rate = 90000;
+            break;
+        }
+        default:
+            break;
+    }
+    return info;
+}
+
+/*a NAL unit of a dynamic flow: IDR, SPS and PPS are evidence of H.264, the SPS tells the size*/
+static void probe_h264_nal(MSPcapFlowInfo *info, const uint8_t *nal, uint32_t size)
+{
+    MSH264SpsInfo sps;
+    int type = nal[0] & 0x1f;
+
+    if (type != 5 && type != 7 && type != 8)    return;
+    info->h264_key_nals++;
+    if (type == 7 && ms_h264_parse_sps(nal, size, &sps) == 0)
+    {
+        info->width = sps.width;
+        info->height = sps.height;
+    }
+}
+
+static void probe_h264(MSPcapFlowInfo *info, const uint8_t *payload, uint32_t size)
+{
+    int type = 0;
+
+    if (size < 2 || (payload[0] & 0x80))
+    {
+        info->h264_errors++;
+        return;
+    }
+    type = payload[0] & 0x1f;
+    if (type >= 1 && type <= 23)
+    {
+        probe_h264_nal(info, payload, size);
+    }
+    else if (type == 24)
+    {
+        /*STAP-A: 16 bits size before each NAL unit*/
+        uint32_t pos = 1;
+        while (pos + 2 < size)
+        {
+            uint32_t nal_size = read_be16(payload + pos);
+            pos += 2;
+            if (nal_size == 0 || pos + nal_size > size)     break;
+            probe_h264_nal(info, payload + pos, nal_size);
+            pos += nal_size;
+        }
+    }
+    else if (type == 28)
+    {
+        /*FU-A: the first fragment tells the type of the NAL unit*/
+        if ((payload[1] & 0x80) && ((payload[1] & 0x1f) == 5 || (payload[1] & 0x1f) == 7 || (payload[1] & 0x1f) == 8))
+            info->h264_key_nals++;
+    }
+    else
+    {
+        /*0 and 30/31 are undefined; STAP-B, MTAP16/24 and FU-B (interleaved mode) are not supported*/
+        info->h264_errors++;
+    }
+}
+
+static void probe_packet(MSPcapFlowInfo *info, const uint8_t *payload, uint32_t size, uint64_t time_us)
+{
+    if (info->packets == 0) info->first_us = time_us;
+    info->last_us = time_us;
+    info->packets++;
+    info->bytes += size;
+
+    if (info->payload_type == 14)
+    {
+        MSMpaHeader head;
+        if (info->sample_rate == 0 && size >= RFC2250_HDR_LEN + 4
+            && ms_mpa_parse_header(payload + RFC2250_HDR_LEN, &head) == 0)
+        {
+            info->sample_rate = head.sample_rate;
+            info->channels = head.channels;
+            info->mime_type = (head.layer == 3) ? "MP3" : (head.layer == 2 ? "MP2" : NULL);
+        }
+    }
+    else if (info->payload_type >= 96)
+    {
+        probe_h264(info, payload, size);
+    }
+}
+
+int ms_pcap_probe(const char *pcap_file, uint64_t max_bytes, MSPcapProbe *probe)
+{
+    MSPcapFormat fmt;
+    MSPcapRecord rec;
+    struct stat st;
+    uint8_t *base = NULL;
+    uint64_t size = 0;
+    uint64_t pos = 0;
+    int hdr_len = -1;
+    int capacity = 0;
+    int fd = -1;
+    int i;
+
+    memset(probe, 0, sizeof(MSPcapProbe));
+    if ((fd = open(pcap_file, O_RDONLY)) < 0)
+    {
+        printf("%s : open %s failed.\n", __func__, pcap_file);
+        return -1;
+    }
+    size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    if (max_bytes > 0 && size > max_bytes)  size = max_bytes;
+    if (!S_ISREG(st.st_mode) || size < MS_PCAP_FILE_HDR_PEEK
+        || (base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        printf("%s : cannot map %s.\n", __func__, pcap_file);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if ((hdr_len = ms_pcap_format_init(&fmt, base, size)) < 0)
+    {
+        printf("%s : %s is not a capture.\n", __func__, pcap_file);
+        munmap(base, size);
+        return -1;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    pos = hdr_len;
+    while (ms_pcap_next_record(&fmt, base, size, &pos, &rec) == 0)
+    {
+        MSPcapPacket pkt;
+
+        if (ms_pcap_dissect(rec.link_type, rec.data, rec.cap_len, &pkt) == 0 && pkt.payload_type != MS_PCAP_NO_RTP)
+        {
+            probe_packet(probe_lookup(probe, &pkt, &capacity), rec.data + pkt.payload_offset, pkt.payload_size, rec.time_us);
+        }
+    }
+    munmap(base, size);
+    probe->bytes_scanned = pos;
+    probe->complete = (pos == (uint64_t)st.st_size);
+
+    for (i = 0; i < probe->count; i++)
+    {
+        MSPcapFlowInfo *info = &probe->flows[i];
+        uint64_t duration = info->last_us - info->first_us;
+
+        /*
+         * many payloads would pass for H.264 by their first byte: it takes a SPS, or a few IDR and
+         * parameter sets, while a few corrupted packets do not make it an other codec
+         */
+        if (info->payload_type >= 96 && info->packets > 0
+            && (info->width > 0 || info->h264_key_nals >= PROBE_H264_MIN_KEYS)
+            && (uint64_t)info->h264_errors * 100 <= (uint64_t)info->packets * PROBE_H264_MAX_ERRORS)
+        {
+            info->encoding = info->mime_type = "H264";
+            info->clock_rate = 90000;
+            info->video = TRUE;
+        }
+        if (duration > 0)
+        {
+            /*the last packet closes the measured duration*/
+            info->packet_rate = (info->packets - 1) * 1000000.0 / duration;
+            info->bitrate = (int)((info->bytes - info->bytes / info->packets) * 8000000 / duration);
+        }
+    }
+    return 0;
+}
+
+void ms_pcap_probe_print(const MSPcapProbe *probe)
+{
+    int i;
+
+    printf("%d RTP stream(s) in the first %llu bytes%s:\n", probe->count,
+        (unsigned long long)probe->bytes_scanned, probe->complete ? " (whole capture)" : "");
+    for (i = 0; i < probe->count; i++)
+    {
+        const MSPcapFlowInfo *info = &probe->flows[i];
+
+        printf("  %s:%u -> %s:%u ssrc=0x%08x pt=%u %s", info->src, info->src_port, info->dst, info->dst_port,
+            info->ssrc, info->payload_type, info->encoding ? info->encoding : "unknown");
+        if (info->video)                printf(" %dx%d", info->width, info->height);
+        else if (info->sample_rate)     printf(" %d Hz %d ch", info->sample_rate, info->channels);
+        printf(", %u packets, %.1f pkt/s, %d kbit/s\n", info->packets, info->packet_rate, info->bitrate / 1000);
+    }
+}
+
+void ms_pcap_probe_uninit(MSPcapProbe *probe)
+{
+    if (probe->flows != NULL)   ms_free(probe->flows);
+    probe->flows = NULL;
+    probe->count = 0;
+}
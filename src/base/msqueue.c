@@ -21,22 +21,124 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <base/msqueue.h>
 #include <string.h>
 
-MSQueue * ms_queue_new(){
+static void ms_queue_spsc_init(MSQueue *q){
+	mblk_init(&q->spsc_stub);
+	q->spsc_head=q->spsc_tail=&q->spsc_stub;
+	q->spsc_count=0;
+}
+
+MSQueue * ms_queue_new_with_type(struct _MSFilter *f1, int pin1, struct _MSFilter *f2, int pin2, MSQueueType type){
 	MSQueue *q=(MSQueue*)ms_new0(MSQueue,1);
 	qinit(&q->q);
+	q->prev.filter=f1;
+	q->prev.pin=pin1;
+	q->next.filter=f2;
+	q->next.pin=pin2;
+	q->type=type;
+	ms_queue_spsc_init(q);
 	return q;
 }
 
+MSQueue * ms_queue_new(struct _MSFilter *f1, int pin1, struct _MSFilter *f2, int pin2){
+	return ms_queue_new_with_type(f1,pin1,f2,pin2,MS_QUEUE_DEFAULT);
+}
+
 void ms_queue_init(MSQueue *q){
 	qinit(&q->q);
+	q->prev.filter=q->next.filter=NULL;
+	q->prev.pin=q->next.pin=-1;
+	q->type=MS_QUEUE_DEFAULT;
+	ms_queue_spsc_init(q);
+}
+
+/*
+ * The SPSC link is an intrusive node-based queue (D. Vyukov's): the producer appends after the
+ * current tail with a single atomic exchange, the consumer walks from the head. The stub node lets
+ * the consumer hand out the last real node without ever leaving the list empty; when it re-inserts
+ * the stub it competes with the producer for the tail, hence the exchange. Nothing is allocated
+ * and a put never waits for the consumer.
+ */
+static void spsc_push(MSQueue *q, mblk_t *m){
+	mblk_t *prev;
+	__atomic_store_n(&m->b_next,NULL,__ATOMIC_RELAXED);
+	prev=__atomic_exchange_n(&q->spsc_tail,m,__ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->b_next,m,__ATOMIC_RELEASE);
+}
+
+void ms_queue_spsc_put(MSQueue *q, mblk_t *m){
+	m->b_prev=NULL;
+	spsc_push(q,m);
+	__atomic_add_fetch(&q->spsc_count,1,__ATOMIC_RELEASE);
+}
+
+static mblk_t *spsc_pop(MSQueue *q){
+	mblk_t *head=q->spsc_head;
+	mblk_t *next=__atomic_load_n(&head->b_next,__ATOMIC_ACQUIRE);
+	if (head==&q->spsc_stub){
+		if (next==NULL) return NULL;
+		q->spsc_head=head=next;
+		next=__atomic_load_n(&head->b_next,__ATOMIC_ACQUIRE);
+	}
+	if (next==NULL){
+		/*head is the last node: it can only go once the stub is queued behind it*/
+		if (head!=__atomic_load_n(&q->spsc_tail,__ATOMIC_ACQUIRE)) return NULL; /*a put is in progress*/
+		spsc_push(q,&q->spsc_stub);
+		next=__atomic_load_n(&head->b_next,__ATOMIC_ACQUIRE);
+		if (next==NULL) return NULL;
+	}
+	q->spsc_head=next;
+	head->b_next=NULL;
+	return head;
+}
+
+/*spsc_count covers q->q too, it only goes down once the consumer really takes a mblk_t*/
+mblk_t *ms_queue_spsc_get(MSQueue *q){
+	mblk_t *m;
+	/*what was peeked at and left by the consumer comes first*/
+	if (!qempty(&q->q)) m=getq(&q->q);
+	else m=spsc_pop(q);
+	if (m!=NULL) __atomic_sub_fetch(&q->spsc_count,1,__ATOMIC_RELEASE);
+	return m;
+}
+
+void ms_queue_spsc_remove(MSQueue *q, mblk_t *m){
+	remq(&q->q,m);
+	__atomic_sub_fetch(&q->spsc_count,1,__ATOMIC_RELEASE);
+}
+
+void ms_queue_spsc_fetch(MSQueue *q){
+	mblk_t *m;
+	while((m=spsc_pop(q))!=NULL){
+		putq(&q->q,m);
+	}
+}
+
+void ms_queue_set_type(MSQueue *q, MSQueueType type){
+	if (q->type==type) return;
+	if (q->type==MS_QUEUE_SPSC){
+		ms_queue_spsc_fetch(q);
+		q->spsc_count=0;
+	}else{
+		/*anything already in q->q is returned first by the SPSC get*/
+		q->spsc_count=q->q.q_mcount;
+	}
+	q->type=type;
+}
+
+void ms_queue_set_max_size(MSQueue *q, int max_size){
+	q->max_size=max_size;
 }
 
 void ms_queue_destroy(MSQueue *q){
-	flushq(&q->q,0);
+	ms_queue_flush(q);
 	ms_free(q);
 }
 
 void ms_queue_flush(MSQueue *q){
+	if (q->type==MS_QUEUE_SPSC){
+		ms_queue_spsc_fetch(q);
+		__atomic_sub_fetch(&q->spsc_count,q->q.q_mcount,__ATOMIC_RELEASE);
+	}
 	flushq(&q->q,0);
 }
 
@@ -1,29 +1,580 @@
 #include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 #include <base/mscommon.h>
 #include <base/msticker.h>
 #include <base/msfilter.h>
 
 
 #define TICKER_INTERVAL 10
+#define TICKER_LOAD_SMOOTH_COEF 0.9
+#define TICKER_RESYNC_THRESHOLD 1000    /*beyond this late (ms), stop trying to catch up and move the time reference*/
+#define PIPELINE_QUEUE_SIZE 64          /*bound of the links of a pipelined graph, in mblk_t (mostly packets)*/
+#define PIPELINE_THREAD_QUEUE_SIZE 8    /*bound of the links of a threaded filter, in mblk_t (access units, pictures)*/
 
 
-static void run_graph(MSFilter *f, MSTicker *s)
+uint64_t ms_get_cur_time_ms(void)
 {
-    if (f->last_tick != s->ticks )
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000LL + (ts.tv_nsec + 500000LL) / 1000000LL;
+}
+
+static void sleep_until_ms(uint64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000LL;
+    ts.tv_nsec = (deadline % 1000LL) * 1000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+
+static int queues_count(MSQueue **queues, int nqueues)
+{
+    int i, count = 0;
+    for (i = 0; i < nqueues; i++)
+    {
+        if (queues[i] != NULL) count += ms_queue_size(queues[i]);
+    }
+    return count;
+}
+
+/*a source that can tell it has not reached its end yet always counts as progress*/
+static bool_t source_running(MSFilter *f)
+{
+    bool_t eof = FALSE;
+    if (f->desc->ninputs > 0) return FALSE;
+    if (ms_filter_call_method(f, MS_GET_EOF, &eof) != 0) return FALSE;
+    return !eof;
+}
+
+/*
+ * A filter with inputs has nothing to do while all of them are empty, unless it is a pump
+ * that must be called every tick. Sources (no inputs) are always scheduled.
+ * A filter with a full output is held back until its consumer catches up, which in turn fills
+ * the filter's own inputs: that is how backpressure climbs up to the sources.
+ */
+static bool_t filter_can_process(MSFilter *f)
+{
+    int i;
+    for (i = 0; i < f->desc->noutputs; i++)
+    {
+        if (f->outputs[i] != NULL && ms_queue_full(f->outputs[i])) return FALSE;
+    }
+    if (f->desc->ninputs == 0 || (f->desc->flags & MS_FILTER_IS_PUMP)) return TRUE;
+    for (i = 0; i < f->desc->ninputs; i++)
+    {
+        if (f->inputs[i] != NULL && !ms_queue_empty(f->inputs[i])) return TRUE;
+    }
+    return FALSE;
+}
+
+/* returns TRUE if the filter consumed or produced something (only measured in offline mode) */
+static bool_t run_graph(MSFilter *f, MSTicker *s)
+{
+    bool_t progress = FALSE;
+    if (f->thread != NULL) return FALSE;    /*runs on its own, see filter_threads_progress()*/
+    if (f->last_tick != s->ticks && filter_can_process(f))
     {
+        int nin = 0, nout = 0;
         f->last_tick = s->ticks;
+        if (s->mode == MS_TICKER_MODE_OFFLINE)
+        {
+            nin = queues_count(f->inputs, f->desc->ninputs);
+            nout = queues_count(f->outputs, f->desc->noutputs);
+        }
         f->desc->process(f);
+        if (s->mode == MS_TICKER_MODE_OFFLINE)
+        {
+            progress = queues_count(f->inputs, f->desc->ninputs) < nin
+                || queues_count(f->outputs, f->desc->noutputs) > nout
+                || source_running(f);
+        }
     }
+    return progress;
 }
 
-static void run_graphs(MSTicker *s, bctbx_list_t *execution_list)
+static bool_t run_graphs(MSTicker *s, bctbx_list_t *execution_list)
 {
     bctbx_list_t *it;
+    bool_t progress = FALSE;
     for(it = execution_list; it != NULL; it = it->next)
     {
-        run_graph((MSFilter*)it->data, s);
+        progress |= run_graph((MSFilter*)it->data, s);
+    }
+    return progress;
+}
+
+/*
+ * Pipelined ticker: every MS_FILTER_IS_THREADED filter gets a thread of its own, woken at each
+ * tick, and all its links become MS_QUEUE_SPSC. The ticker thread does not wait for it, so a slow
+ * encoder no longer delays the rest of the graph; the bounded queues keep it from falling behind
+ * without limit.
+ */
+typedef struct _MSFilterThread
+{
+    MSTicker *ticker;
+    MSFilter *f;
+    pthread_t thread;
+    ms_mutex_t lock;
+    ms_cond_t cond;
+    uint32_t ticks;     /* last tick signaled by the ticker */
+    bool_t busy;
+    bool_t progress;    /* processed something since the ticker last asked */
+    bool_t run;
+}MSFilterThread;
+
+static void *ms_filter_thread_run(void *arg)
+{
+    MSFilterThread *th = (MSFilterThread*)arg;
+    uint32_t last = 0;
+
+    ms_mutex_lock(&th->lock);
+    while (th->run)
+    {
+        bool_t done = FALSE;
+        if (th->ticks == last)
+        {
+            ms_cond_wait(&th->cond, &th->lock);
+            continue;
+        }
+        last = th->ticks;
+        th->busy = TRUE;
+        ms_mutex_unlock(&th->lock);
+
+        if (filter_can_process(th->f))
+        {
+            th->f->desc->process(th->f);
+            done = TRUE;
+        }
+
+        ms_mutex_lock(&th->lock);
+        th->busy = FALSE;
+        th->progress |= done;
+    }
+    ms_mutex_unlock(&th->lock);
+    return NULL;
+}
+
+static void set_queues(MSQueue **queues, int nqueues, MSQueueType type, int max_size)
+{
+    int i;
+    for (i = 0; i < nqueues; i++)
+    {
+        if (queues[i] == NULL) continue;
+        if (type == MS_QUEUE_SPSC) ms_queue_set_type(queues[i], type);
+        if (queues[i]->max_size == 0 || max_size < queues[i]->max_size) ms_queue_set_max_size(queues[i], max_size);
+    }
+}
+
+/* bound every link of f, and give it a thread if it is a heavy one; f is not running yet */
+static void pipeline_filter(MSTicker *s, MSFilter *f)
+{
+    MSFilterThread *th;
+
+    if (!(f->desc->flags & MS_FILTER_IS_THREADED))
+    {
+        set_queues(f->inputs, f->desc->ninputs, MS_QUEUE_DEFAULT, PIPELINE_QUEUE_SIZE);
+        set_queues(f->outputs, f->desc->noutputs, MS_QUEUE_DEFAULT, PIPELINE_QUEUE_SIZE);
+        return;
+    }
+    set_queues(f->inputs, f->desc->ninputs, MS_QUEUE_SPSC, PIPELINE_THREAD_QUEUE_SIZE);
+    set_queues(f->outputs, f->desc->noutputs, MS_QUEUE_SPSC, PIPELINE_THREAD_QUEUE_SIZE);
+
+    th = (MSFilterThread *)ms_new0(MSFilterThread,1);
+    th->ticker = s;
+    th->f = f;
+    th->run = TRUE;
+    ms_mutex_init(&th->lock, NULL);
+    ms_cond_init(&th->cond, NULL);
+    f->thread = th;
+    s->filter_threads = bctbx_list_append(s->filter_threads, th);
+    pthread_create(&th->thread, NULL, ms_filter_thread_run, th);
+}
+
+/* join the thread of f, which is then processed by the ticker thread again */
+static void unpipeline_filter(MSTicker *s, MSFilter *f)
+{
+    MSFilterThread *th = f->thread;
+    if (th == NULL) return;
+
+    ms_mutex_lock(&th->lock);
+    th->run = FALSE;
+    ms_cond_signal(&th->cond);
+    ms_mutex_unlock(&th->lock);
+    pthread_join(th->thread, NULL);
+
+    f->thread = NULL;
+    s->filter_threads = bctbx_list_remove(s->filter_threads, th);
+    ms_cond_destroy(&th->cond);
+    ms_mutex_destroy(&th->lock);
+    ms_free(th);
+}
+
+static void wake_filter_threads(MSTicker *s)
+{
+    bctbx_list_t *it;
+    for (it = s->filter_threads; it != NULL; it = it->next)
+    {
+        MSFilterThread *th = (MSFilterThread*)it->data;
+        ms_mutex_lock(&th->lock);
+        th->ticks = s->ticks;
+        ms_cond_signal(&th->cond);
+        ms_mutex_unlock(&th->lock);
+    }
+}
+
+/* offline mode: a threaded filter that is working, worked, or has work waiting is progress */
+static bool_t filter_threads_progress(MSTicker *s)
+{
+    bctbx_list_t *it;
+    bool_t progress = FALSE;
+    for (it = s->filter_threads; it != NULL; it = it->next)
+    {
+        MSFilterThread *th = (MSFilterThread*)it->data;
+        ms_mutex_lock(&th->lock);
+        progress |= th->busy || th->progress || queues_count(th->f->inputs, th->f->desc->ninputs) > 0;
+        th->progress = FALSE;
+        ms_mutex_unlock(&th->lock);
+    }
+    return progress;
+}
+
+static void stop_filter_threads(MSTicker *s)
+{
+    while (s->filter_threads != NULL)
+    {
+        unpipeline_filter(s, ((MSFilterThread*)s->filter_threads->data)->f);
+    }
+}
+
+
+/*
+ * Parallel ticker: the sources are run first on the ticker thread, then the graph without its
+ * sources and sinks falls apart into independent branches (eg. the audio and the video paths
+ * of a session), which the workers process concurrently. The sinks, where the branches join,
+ * run last on the ticker thread. A queue is therefore never used by two threads at once.
+ */
+typedef struct _MSTickerPool
+{
+    MSTicker *ticker;
+    pthread_t *threads;
+    int nthreads;
+    ms_mutex_t lock;
+    ms_cond_t cond;         /* a tick is ready to be processed, or the pool is stopping */
+    ms_cond_t done;         /* the last branch of the tick has been processed */
+    bctbx_list_t *sources;
+    bctbx_list_t *branches; /* list of filter lists, each one in topological order */
+    bctbx_list_t *sinks;
+    bctbx_list_t *todo;     /* next branch to hand out during the current tick */
+    int pending;            /* branches of the current tick not finished yet */
+    bool_t progress;
+    bool_t run;
+}MSTickerPool;
+
+static bool_t is_branch_filter(MSFilter *f)
+{
+    return f->desc->ninputs > 0 && f->desc->noutputs > 0;
+}
+
+/* add f and the branch filters linked to it to members */
+static bctbx_list_t *get_branch_filters(MSFilter *f, bctbx_list_t *members)
+{
+    int i;
+    if (!is_branch_filter(f) || bctbx_list_find(members, f) != NULL) return members;
+    members = bctbx_list_append(members, f);
+    for (i = 0; i < f->desc->ninputs; i++)
+    {
+        if (f->inputs[i] != NULL) members = get_branch_filters(f->inputs[i]->prev.filter, members);
+    }
+    for (i = 0; i < f->desc->noutputs; i++)
+    {
+        if (f->outputs[i] != NULL) members = get_branch_filters(f->outputs[i]->next.filter, members);
+    }
+    return members;
+}
+
+static void pool_clear_branches(MSTickerPool *pool)
+{
+    bctbx_list_t *it;
+    for (it = pool->branches; it != NULL; it = it->next)
+    {
+        bctbx_list_free((bctbx_list_t*)it->data);
+    }
+    pool->branches = bctbx_list_free(pool->branches);
+    pool->sources = bctbx_list_free(pool->sources);
+    pool->sinks = bctbx_list_free(pool->sinks);
+}
+
+/* split the (topologically sorted) execution list, must be called with the ticker locked */
+static void pool_update_branches(MSTickerPool *pool, bctbx_list_t *execution_list)
+{
+    bctbx_list_t *it, *b;
+    bctbx_list_t *assigned = NULL;
+
+    pool_clear_branches(pool);
+    for (it = execution_list; it != NULL; it = it->next)
+    {
+        MSFilter *f = (MSFilter*)it->data;
+        if (f->desc->ninputs == 0) pool->sources = bctbx_list_append(pool->sources, f);
+        else if (f->desc->noutputs == 0) pool->sinks = bctbx_list_append(pool->sinks, f);
+        else if (bctbx_list_find(assigned, f) == NULL)
+        {
+            bctbx_list_t *members = get_branch_filters(f, NULL);
+            bctbx_list_t *branch = NULL;
+            for (b = it; b != NULL; b = b->next)
+            {
+                if (bctbx_list_find(members, b->data) != NULL) branch = bctbx_list_append(branch, b->data);
+            }
+            assigned = bctbx_list_concat(assigned, members);
+            pool->branches = bctbx_list_append(pool->branches, branch);
+        }
+    }
+    bctbx_list_free(assigned);
+}
+
+static void *ms_ticker_worker(void *arg)
+{
+    MSTickerPool *pool = (MSTickerPool*)arg;
+
+    ms_mutex_lock(&pool->lock);
+    while (1)
+    {
+        bctbx_list_t *branch;
+        bool_t progress;
+
+        while (pool->run && pool->todo == NULL) ms_cond_wait(&pool->cond, &pool->lock);
+        if (!pool->run) break;
+        branch = (bctbx_list_t*)pool->todo->data;
+        pool->todo = pool->todo->next;
+        ms_mutex_unlock(&pool->lock);
+
+        progress = run_graphs(pool->ticker, branch);
+
+        ms_mutex_lock(&pool->lock);
+        pool->progress |= progress;
+        if (--pool->pending == 0) ms_cond_signal(&pool->done);
+    }
+    ms_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static bool_t run_graphs_parallel(MSTicker *s)
+{
+    MSTickerPool *pool = s->pool;
+    bool_t progress;
+
+    progress = run_graphs(s, pool->sources);
+
+    ms_mutex_lock(&pool->lock);
+    pool->progress = FALSE;
+    pool->pending = (int)bctbx_list_size(pool->branches);
+    pool->todo = pool->branches;
+    if (pool->pending > 0) ms_cond_broadcast(&pool->cond);
+    while (pool->pending > 0) ms_cond_wait(&pool->done, &pool->lock);
+    progress |= pool->progress;
+    ms_mutex_unlock(&pool->lock);
+
+    progress |= run_graphs(s, pool->sinks);
+    return progress;
+}
+
+static MSTickerPool *ms_ticker_pool_new(MSTicker *ticker, int nthreads)
+{
+    int i;
+    MSTickerPool *pool = (MSTickerPool *)ms_new0(MSTickerPool,1);
+    pool->ticker = ticker;
+    pool->nthreads = nthreads;
+    pool->run = TRUE;
+    ms_mutex_init(&pool->lock, NULL);
+    ms_cond_init(&pool->cond, NULL);
+    ms_cond_init(&pool->done, NULL);
+    pool->threads = (pthread_t *)ms_new0(pthread_t, nthreads);
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_create(&pool->threads[i], NULL, ms_ticker_worker, pool);
+    }
+    return pool;
+}
+
+static void ms_ticker_pool_destroy(MSTickerPool *pool)
+{
+    int i;
+    ms_mutex_lock(&pool->lock);
+    pool->run = FALSE;
+    ms_cond_broadcast(&pool->cond);
+    ms_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool_clear_branches(pool);
+    ms_free(pool->threads);
+    ms_cond_destroy(&pool->done);
+    ms_cond_destroy(&pool->cond);
+    ms_mutex_destroy(&pool->lock);
+    ms_free(pool);
+}
+
+/* add f and every filter linked to it, directly or not, to filters */
+static bctbx_list_t *get_graph_filters(MSFilter *f, bctbx_list_t *filters)
+{
+    int i;
+    if (bctbx_list_find(filters, f) != NULL) return filters;
+    filters = bctbx_list_append(filters, f);
+    for (i = 0; i < f->desc->ninputs; i++)
+    {
+        if (f->inputs[i] != NULL) filters = get_graph_filters(f->inputs[i]->prev.filter, filters);
+    }
+    for (i = 0; i < f->desc->noutputs; i++)
+    {
+        if (f->outputs[i] != NULL) filters = get_graph_filters(f->outputs[i]->next.filter, filters);
+    }
+    return filters;
+}
+
+static bool_t inputs_scheduled(MSFilter *f, bctbx_list_t *sorted)
+{
+    int i;
+    for (i = 0; i < f->desc->ninputs; i++)
+    {
+        if (f->inputs[i] != NULL && bctbx_list_find(sorted, f->inputs[i]->prev.filter) == NULL) return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Order the filters so that every filter comes after all the filters feeding its inputs:
+ * the sources (nothing linked on input) first, then whatever they unlock, and so on.
+ * Takes ownership of the filters list and returns the sorted one.
+ */
+static bctbx_list_t *sort_graph(MSTicker *s, bctbx_list_t *filters)
+{
+    bctbx_list_t *sorted = NULL;
+    while (filters != NULL)
+    {
+        bctbx_list_t *it, *next;
+        bool_t found = FALSE;
+        for (it = filters; it != NULL; it = next)
+        {
+            MSFilter *f = (MSFilter*)it->data;
+            next = it->next;
+            if (inputs_scheduled(f, sorted))
+            {
+                sorted = bctbx_list_append(sorted, f);
+                filters = bctbx_list_erase_link(filters, it);
+                found = TRUE;
+            }
+        }
+        if (found == FALSE)
+        {
+            printf("%s: the graph has a loop, scheduling the remaining filters in attach order.\n", s->name);
+            sorted = bctbx_list_concat(sorted, filters);
+            break;
+        }
     }
+    return sorted;
+}
+
+int ms_ticker_attach(MSTicker *ticker, MSFilter *f)
+{
+    bctbx_list_t *it;
+    bctbx_list_t *filters = NULL;
+    bctbx_list_t *added = NULL;
+
+    if (f->ticker != NULL)
+    {
+        printf("%s: filter %s is already scheduled.\n", ticker->name, f->desc->name);
+        return 0;
+    }
+    filters = get_graph_filters(f, NULL);
+    for (it = filters; it != NULL; it = it->next)
+    {
+        MSFilter *g = (MSFilter*)it->data;
+        if (g->ticker != NULL) continue;
+        ms_filter_preprocess(g, ticker);
+        added = bctbx_list_append(added, g);
+    }
+    bctbx_list_free(filters);
+
+    ms_mutex_lock(&ticker->lock);
+    for (it = added; it != NULL && ticker->pipeline; it = it->next)
+    {
+        pipeline_filter(ticker, (MSFilter*)it->data);
+    }
+    ticker->execution_list = sort_graph(ticker, bctbx_list_concat(ticker->execution_list, added));
+    if (ticker->pool != NULL) pool_update_branches(ticker->pool, ticker->execution_list);
+    ms_mutex_unlock(&ticker->lock);
+    return 0;
+}
+
+int ms_ticker_detach(MSTicker *ticker, MSFilter *f)
+{
+    bctbx_list_t *it;
+    bctbx_list_t *filters = NULL;
+
+    if (f->ticker == NULL)
+    {
+        printf("%s: filter %s is not scheduled.\n", ticker->name, f->desc->name);
+        return 0;
+    }
+    filters = get_graph_filters(f, NULL);
+    ms_mutex_lock(&ticker->lock);
+    for (it = ticker->execution_list; it != NULL; )
+    {
+        MSFilter *g = (MSFilter*)it->data;
+        bctbx_list_t *next = it->next;
+        if (bctbx_list_find(filters, g) != NULL)
+        {
+            unpipeline_filter(ticker, g);
+            ms_filter_postprocess(g);
+            ticker->execution_list = bctbx_list_erase_link(ticker->execution_list, it);
+        }
+        it = next;
+    }
+    if (ticker->pool != NULL) pool_update_branches(ticker->pool, ticker->execution_list);
+    ms_mutex_unlock(&ticker->lock);
+    bctbx_list_free(filters);
+    return 0;
+}
+
+/*
+ * End of stream of an offline ticker: the execution list is in topological order,
+ * so running each filter one last time before its postprocess() pushes whatever the upstream
+ * filters flushed in their own postprocess() down to the sinks.
+ */
+static void drain_graphs(MSTicker *s)
+{
+    bctbx_list_t *it;
+    stop_filter_threads(s);
+    for(it = s->execution_list; it != NULL; it = it->next)
+    {
+        MSFilter *f = (MSFilter*)it->data;
+        f->desc->process(f);
+        ms_filter_postprocess(f);
+    }
+    s->execution_list = bctbx_list_free(s->execution_list);
+    if (s->pool != NULL) pool_clear_branches(s->pool);
+}
+
+/*
+ * Wait until the ticker time (s->time, already advanced to the next tick) is reached.
+ * The deadline is always computed from s->orig, so that the sleep granularity never accumulates
+ * into a drift. Returns how late we are, in miliseconds.
+ */
+static int wait_next_tick(MSTicker *s)
+{
+    int64_t diff;
+    uint64_t realtime = ms_get_cur_time_ms() - s->orig;
+
+    diff = (int64_t)s->time - (int64_t)realtime;
+    if (diff > 0)
+    {
+        sleep_until_ms(s->orig + s->time);
+        return 0;
+    }
+    return (int)-diff;
 }
 
 
@@ -31,22 +582,77 @@ static void run_graphs(MSTicker *s, bctbx_list_t *execution_list)
 void * ms_ticker_run(void *arg)
 {
     MSTicker *s = (MSTicker*)arg;
+    int late = 0;
+    int lastlate = 0;
     s->thread_id = (unsigned long)pthread_self();
     s->ticks = 1;
+    s->time = 0;
+    s->orig = ms_get_cur_time_ms();
 
     while(s->run)
     {
+        uint64_t realtime;
+        int iload;
+        bool_t progress;
+        bool_t idle;
+
         s->ticks++;
         /*Step 1: run the graphs*/
-        run_graphs(s, s->execution_list);
+        ms_mutex_lock(&s->lock);
+        idle = (s->execution_list == NULL);
+        wake_filter_threads(s);
+        if (s->pool != NULL)    progress = run_graphs_parallel(s);
+        else                    progress = run_graphs(s, s->execution_list);
+        if (s->mode == MS_TICKER_MODE_OFFLINE && s->filter_threads != NULL) progress |= filter_threads_progress(s);
+        if (s->mode == MS_TICKER_MODE_OFFLINE && !idle && progress == FALSE)
+        {
+            printf("%s: graph drained after %u ticks\n", s->name, s->ticks);
+            drain_graphs(s);
+            s->run = FALSE;
+        }
+        ms_mutex_unlock(&s->lock);
+
+        if (s->mode == MS_TICKER_MODE_OFFLINE)
+        {
+            if (idle)
+            {
+                /*nothing attached yet: don't spin, and don't let the virtual time run ahead of the sources*/
+                sleep_until_ms(ms_get_cur_time_ms() + s->interval);
+                continue;
+            }
+            /*no wall-clock pacing, the time only advances with the ticks*/
+            s->time += s->interval;
+            continue;
+        }
+
+        realtime = ms_get_cur_time_ms() - s->orig;
+        iload = 100 * (int)((int64_t)realtime - (int64_t)s->time) / s->interval;
+        s->av_load = (TICKER_LOAD_SMOOTH_COEF * s->av_load) + ((1.0 - TICKER_LOAD_SMOOTH_COEF) * (double)iload);
 
         /*Step 2: wait for next tick*/
-//        usleep(10*1000);
+        s->time += s->interval;
+        lastlate = late;
+        late = wait_next_tick(s);
+        ms_mutex_lock(&s->lock);
+        s->late_event.current_late_ms = late;
+        if (late > s->interval * 5 && late > lastlate)
+        {
+            printf("%s: We are late of %d miliseconds.\n", s->name, late);
+            s->late_event.lateMs = late;
+            s->late_event.time = s->time;
+        }
+        ms_mutex_unlock(&s->lock);
+        if (late > TICKER_RESYNC_THRESHOLD)
+        {
+            printf("%s: too late, resetting time reference.\n", s->name);
+            s->orig += late;
+            late = 0;
+        }
     }
     printf("%s thread exiting\n", s->name);
 
-    pthread_exit(NULL);
     s->thread_id = 0;
+    pthread_exit(NULL);
     return NULL;
 }
 
@@ -60,27 +666,33 @@ static void ms_ticker_start(MSTicker *s)
     pthread_create(&s->thread, NULL, ms_ticker_run, s);
 }
 
-static void ms_ticker_init(MSTicker *ticker)
+static void ms_ticker_init(MSTicker *ticker, const MSTickerParams *params)
 {
-//  ms_mutex_init(&ticker->lock,NULL);
+    ms_mutex_init(&ticker->lock,NULL);
 //  ms_mutex_init(&ticker->cur_time_lock, NULL);
     ticker->execution_list = NULL;
 //  ticker->task_list=NULL;
     ticker->ticks = 1;
     ticker->time = 0;
+    ticker->orig = 0;
     ticker->interval = TICKER_INTERVAL;
     ticker->run = FALSE;
     ticker->exec_id = 0;
 //  ticker->get_cur_time_ptr=&get_cur_time_ms;
 //  ticker->get_cur_time_data=NULL;
-    ticker->name = "MSTicker";
-//    ticker->av_load=0;
+    ticker->name = (char *)params->name;
+    ticker->mode = params->mode;
+    ticker->av_load = 0;
 //    ticker->prio=params->prio;
 //    ticker->wait_next_tick=wait_next_tick;
 //    ticker->wait_next_tick_data=ticker;
-//    ticker->late_event.lateMs = 0;
-//    ticker->late_event.time = 0;
-//    ticker->late_event.current_late_ms = 0;
+    ticker->late_event.lateMs = 0;
+    ticker->late_event.time = 0;
+    ticker->late_event.current_late_ms = 0;
+    ticker->pool = NULL;
+    ticker->pipeline = params->pipeline;
+    ticker->filter_threads = NULL;
+    if (params->nthreads > 1) ticker->pool = ms_ticker_pool_new(ticker, params->nthreads);
     ms_ticker_start(ticker);
 }
 
@@ -89,22 +701,50 @@ static void ms_ticker_init(MSTicker *ticker)
 
 
 MSTicker *ms_ticker_new()
+{
+    MSTickerParams params;
+    params.name = "MSTicker";
+    params.mode = MS_TICKER_MODE_REALTIME;
+    params.nthreads = 0;
+    params.pipeline = FALSE;
+    return ms_ticker_new_with_params(&params);
+}
+
+MSTicker *ms_ticker_new_with_params(const MSTickerParams *params)
 {
     MSTicker *obj = (MSTicker *)ms_new0(MSTicker,1);
-    ms_ticker_init(obj);
+    ms_ticker_init(obj, params);
     return obj;
 }
 
+void ms_ticker_wait(MSTicker *ticker)
+{
+    if (ticker->mode != MS_TICKER_MODE_OFFLINE)
+    {
+        printf("%s: ms_ticker_wait() on a realtime ticker would never return.\n", ticker->name);
+        return;
+    }
+    if (ticker->thread)
+    {
+        pthread_join(ticker->thread, NULL);
+        ticker->thread = 0;
+    }
+}
+
 static void ms_ticker_stop(MSTicker *s)
 {
     s->run = FALSE;
     if(s->thread) pthread_join(s->thread, NULL);
+    s->thread = 0;
 }
 
 
 static void ms_ticker_uninit(MSTicker *ticker)
 {
     ms_ticker_stop(ticker);
+    stop_filter_threads(ticker);
+    if (ticker->pool != NULL) ms_ticker_pool_destroy(ticker->pool);
+    ms_mutex_destroy(&ticker->lock);
 }
 
 void ms_ticker_destroy(MSTicker *ticker)
@@ -113,4 +753,16 @@ void ms_ticker_destroy(MSTicker *ticker)
     ms_free(ticker);
 }
 
+float ms_ticker_get_average_load(MSTicker *ticker)
+{
+    return (float)ticker->av_load;
+}
+
+void ms_ticker_get_last_late_tick(MSTicker *ticker, MSTickerLateEvent *ev)
+{
+    ms_mutex_lock(&ticker->lock);
+    *ev = ticker->late_event;
+    ms_mutex_unlock(&ticker->lock);
+}
+
 
@@ -0,0 +1,152 @@
+#include <base/msvideo.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixfmt.h>
+
+
+#define YUV_BUF_POOL_MAX_FRAMES 32  /*beyond this many frames in flight, frames are not pooled*/
+
+#define PICTURE_ALIGN(x) (((x) + MS_PICTURE_ALIGN - 1) & ~(MS_PICTURE_ALIGN - 1))
+
+
+typedef struct _MSWrappedPicture
+{
+    MSPicture pic;
+    void (*freefn)(void*);
+    void *arg;
+}MSWrappedPicture;
+
+struct _MSYuvBufAllocator
+{
+    msgb_allocator_t allocator;
+    int w;
+    int h;
+};
+
+
+int ms_yuv_buf_size(int w, int h)
+{
+    return w * h * 3 / 2;
+}
+
+void ms_yuv_buf_init(MSPicture *buf, int w, int h, uint8_t *ptr)
+{
+    int ysize = w * h;
+    buf->w = w;
+    buf->h = h;
+    buf->pix_fmt = AV_PIX_FMT_YUV420P;
+    buf->planes[0] = ptr;
+    buf->planes[1] = ptr + ysize;
+    buf->planes[2] = ptr + ysize * 5 / 4;
+    buf->planes[3] = NULL;
+    buf->strides[0] = w;
+    buf->strides[1] = w / 2;
+    buf->strides[2] = w / 2;
+    buf->strides[3] = 0;
+}
+
+void ms_yuv_buf_init_from_mblk(MSPicture *buf, mblk_t *m, int w, int h)
+{
+    if (m->b_datap->db_meta != NULL)
+    {
+        *buf = *(MSPicture *)m->b_datap->db_meta;
+        return;
+    }
+    ms_yuv_buf_init(buf, w, h, m->b_rptr);
+}
+
+void ms_picture_copy(MSPicture *dst, const MSPicture *src)
+{
+    av_image_copy(dst->planes, dst->strides, (const uint8_t **)src->planes, src->strides, src->pix_fmt, src->w, src->h);
+}
+
+static void wrapped_picture_free(void *arg)
+{
+    MSWrappedPicture *wp = (MSWrappedPicture *)arg;
+    wp->freefn(wp->arg);
+    ms_free(wp);
+}
+
+mblk_t *ms_yuv_buf_wrap(const MSPicture *pic, void (*freefn)(void*), void *arg)
+{
+    mblk_t *m = NULL;
+    MSWrappedPicture *wp = ms_new0(MSWrappedPicture, 1);
+    int size = pic->strides[0] * pic->h;
+
+    wp->pic = *pic;
+    wp->freefn = freefn;
+    wp->arg = arg;
+    m = esballoc_with_arg(pic->planes[0], size, 0, wrapped_picture_free, wp);
+    m->b_datap->db_meta = &wp->pic;
+    m->b_wptr += size;
+    return m;
+}
+
+
+MSYuvBufAllocator *ms_yuv_buf_allocator_new(void)
+{
+    MSYuvBufAllocator *obj = ms_new0(MSYuvBufAllocator, 1);
+    msgb_allocator_init(&obj->allocator);
+    msgb_allocator_set_max_blocks(&obj->allocator, YUV_BUF_POOL_MAX_FRAMES);
+    return obj;
+}
+
+/*
+ * A pooled frame starts with its own MSPicture, followed by the planes: each row aligned on
+ * MS_PICTURE_ALIGN bytes, so the pool always hands out blocks of the same size for a resolution.
+ */
+static int yuv_buf_padded_size(int w, int h)
+{
+    int ystride = PICTURE_ALIGN(w);
+    int cstride = PICTURE_ALIGN((w + 1) / 2);
+    return ystride * h + 2 * cstride * ((h + 1) / 2);
+}
+
+static void yuv_buf_layout(MSPicture *pic, int w, int h, uint8_t *ptr)
+{
+    int ystride = PICTURE_ALIGN(w);
+    int cstride = PICTURE_ALIGN((w + 1) / 2);
+    pic->w = w;
+    pic->h = h;
+    pic->pix_fmt = AV_PIX_FMT_YUV420P;
+    pic->planes[0] = ptr;
+    pic->planes[1] = ptr + ystride * h;
+    pic->planes[2] = pic->planes[1] + cstride * ((h + 1) / 2);
+    pic->planes[3] = NULL;
+    pic->strides[0] = ystride;
+    pic->strides[1] = cstride;
+    pic->strides[2] = cstride;
+    pic->strides[3] = 0;
+}
+
+mblk_t *ms_yuv_buf_allocator_get(MSYuvBufAllocator *obj, MSPicture *buf, int w, int h)
+{
+    mblk_t *m = NULL;
+    MSPicture *pic = NULL;
+    uint8_t *ptr = NULL;
+    int size = yuv_buf_padded_size(w, h);
+
+    if (w != obj->w || h != obj->h)
+    {
+        /*the frames of the previous size still in use are freed by their last user*/
+        msgb_allocator_uninit(&obj->allocator);
+        msgb_allocator_init(&obj->allocator);
+        msgb_allocator_set_max_blocks(&obj->allocator, YUV_BUF_POOL_MAX_FRAMES);
+        obj->w = w;
+        obj->h = h;
+    }
+    m = msgb_allocator_alloc(&obj->allocator, sizeof(MSPicture) + MS_PICTURE_ALIGN + size);
+    pic = (MSPicture *)m->b_datap->db_base;
+    ptr = (uint8_t *)PICTURE_ALIGN((uintptr_t)(m->b_datap->db_base + sizeof(MSPicture)));
+    yuv_buf_layout(pic, w, h, ptr);
+    m->b_datap->db_meta = pic;
+    m->b_rptr = ptr;
+    m->b_wptr = ptr + size;
+    if (buf != NULL) *buf = *pic;
+    return m;
+}
+
+void ms_yuv_buf_allocator_free(MSYuvBufAllocator *obj)
+{
+    msgb_allocator_uninit(&obj->allocator);
+    ms_free(obj);
+}
@@ -91,6 +91,30 @@ bctbx_list_t * bctbx_list_erase_link(bctbx_list_t* list, bctbx_list_t* elem)
 }
 
 
+size_t bctbx_list_size(const bctbx_list_t* list)
+{
+    size_t n = 0;
+    for(; list != NULL; list = list->next) n++;
+    return n;
+}
+
+bctbx_list_t* bctbx_list_find(bctbx_list_t* list, const void *data)
+{
+    for(; list != NULL; list = list->next)
+    {
+        if (list->data == data) return list;
+    }
+    return NULL;
+}
+
+bctbx_list_t* bctbx_list_remove(bctbx_list_t* list, void *data)
+{
+    bctbx_list_t* elem = bctbx_list_find(list, data);
+    if (elem != NULL) return bctbx_list_erase_link(list, elem);
+    return list;
+}
+
+
 bctbx_list_t*  bctbx_list_free(bctbx_list_t* list)
 {
     bctbx_list_t* elem = list;
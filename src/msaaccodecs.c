@@ -79,6 +79,7 @@ typedef struct
     int frame_size;
     int bit_rate;
     MSBufferizer encoder;
+    msgb_allocator_t allocator;
 }AacEncoder;
 
 
@@ -135,6 +136,7 @@ void aac_enc_init(struct _MSFilter *f)
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
     d = ms_new0(AacEncoder, 1);
+    msgb_allocator_init(&d->allocator);
     d->sample_rate = 48000;
     d->channels = 1;
     d->sample_fmt = AV_SAMPLE_FMT_FLTP;
@@ -165,11 +167,23 @@ void aac_enc_preprocess(struct _MSFilter *f)
 }
 
 
+static void encoder_receive_packets(MSFilter *f, AacEncoder *d)
+{
+    mblk_t *om = NULL;
+
+    while (avcodec_receive_packet(d->codec_ctx, d->pkt) >= 0)
+    {
+        om = msgb_from_avbuffer(&d->allocator, d->pkt->buf, d->pkt->data, d->pkt->size);
+        ms_queue_put(f->outputs[0], om);
+
+        av_packet_unref(d->pkt);
+    }
+}
+
 void aac_enc_process(struct _MSFilter *f)
 {
     AacEncoder *d = NULL;
     mblk_t *im = NULL;
-    mblk_t *om = NULL;
     int data_size = 0;
 
     if (f == NULL)
@@ -198,23 +212,33 @@ void aac_enc_process(struct _MSFilter *f)
                 return;
             }
             
-            while ((ret = avcodec_receive_packet(d->codec_ctx, d->pkt)) >= 0)
-            {
-                om = allocb(d->pkt->size, 0);
-                memcpy(om->b_wptr, d->pkt->data, d->pkt->size);
-                om->b_wptr += d->pkt->size;
-                ms_queue_put(f->outputs[0], om);
-
-                av_packet_unref(d->pkt);
-            }
+            encoder_receive_packets(f, d);
         }
     }
 }
 
 void aac_enc_postprocess(struct _MSFilter *f)
 {
+    AacEncoder *d = NULL;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (AacEncoder *)f->data;
+    if (d == NULL || d->codec_ctx == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    /*the last incomplete frame in the bufferizer is dropped, flush the encoder delay*/
+    if (avcodec_send_frame(d->codec_ctx, NULL) >= 0)
+    {
+        encoder_receive_packets(f, d);
+    }
 }
 
 
@@ -257,6 +281,7 @@ void aac_enc_uninit(struct _MSFilter *f)
 
     ms_bufferizer_flush(&d->encoder);
     encoder_uninit(d);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
 }
 
@@ -16,6 +16,7 @@ typedef struct
     AVFrame *frame;
     int sample_rate;
     int channels;
+    msgb_allocator_t allocator;
 }G711Decoder;
 
 
@@ -64,6 +65,7 @@ void g711_dec_init(struct _MSFilter *f)
 
     d = ms_new0(G711Decoder, 1);
     memset(d, 0, sizeof(G711Decoder));
+    msgb_allocator_init(&d->allocator);
     d->sample_rate = 8000;
     d->channels = 1;
     decoder_init(d);
@@ -112,9 +114,7 @@ void g711_dec_process(struct _MSFilter *f)
         
         while ((ret = avcodec_receive_frame(d->codec_ctx, frame)) >= 0)
         {
-            om = allocb(frame->nb_samples*2, 0);
-            memcpy(om->b_wptr, frame->data[0], frame->nb_samples*2);
-            om->b_wptr += frame->nb_samples*2;
+            om = msgb_from_avbuffer(&d->allocator, frame->buf[0], frame->data[0], frame->nb_samples*2);
             ms_queue_put(f->outputs[0], om);
             av_frame_unref(d->frame);
         }
@@ -167,6 +167,7 @@ void g711_dec_uninit(struct _MSFilter *f)
     }
 
     decoder_uninit(d);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
 }
 
@@ -3,6 +3,7 @@
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
+#include <base/msvideo.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libavformat/avformat.h>
@@ -14,6 +15,7 @@ typedef struct
     AVCodecContext *codec_ctx;
     AVPacket *pkt;
     AVFrame *frame;
+    MSYuvBufAllocator *pool;
 }H264Decoder;
 
 
@@ -56,6 +58,7 @@ void h264_dec_init(struct _MSFilter *f)
 
     d = ms_new0(H264Decoder, 1);
     memset(d, 0, sizeof(H264Decoder));
+    d->pool = ms_yuv_buf_allocator_new();
     f->data = (void *)d;
 }
 
@@ -80,11 +83,86 @@ void h264_dec_preprocess(struct _MSFilter *f)
 }
 
 
+static void av_frame_release(void *arg)
+{
+    AVFrame *frame = (AVFrame *)arg;
+    av_frame_free(&frame);
+}
+
+/*
+ * Hand the planes of a refcounted frame downstream as they are: the new message holds a
+ * reference on the frame buffers until the last consumer frees it.
+ */
+static mblk_t *decoder_wrap_frame(AVFrame *frame)
+{
+    MSPicture pic;
+    AVFrame *ref = NULL;
+    int i;
+
+    if (frame->buf[0] == NULL)
+    {
+        return NULL;
+    }
+    if ((ref = av_frame_clone(frame)) == NULL)
+    {
+        return NULL;
+    }
+    memset(&pic, 0, sizeof(pic));
+    pic.w = ref->width;
+    pic.h = ref->height;
+    pic.pix_fmt = ref->format;
+    for (i = 0; i < 4; i++)
+    {
+        pic.planes[i] = ref->data[i];
+        pic.strides[i] = ref->linesize[i];
+    }
+    return ms_yuv_buf_wrap(&pic, av_frame_release, ref);
+}
+
+static void decoder_receive_frames(MSFilter *f, H264Decoder *d)
+{
+    AVFrame *frame = d->frame;
+    mblk_t *om = NULL;
+
+    while (avcodec_receive_frame(d->codec_ctx, frame) >= 0)
+    {
+        MSPicture src, dst;
+
+        if ((om = decoder_wrap_frame(frame)) != NULL)
+        {
+            mblk_set_timestamp_info(om, frame->pts);
+            ms_queue_put(f->outputs[0], om);
+            av_frame_unref(d->frame);
+            continue;
+        }
+
+        if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P)
+        {
+            printf("%s : unsupported pix_fmt [%d] of a frame not refcounted, dropped.\n", __func__, frame->format);
+            av_frame_unref(d->frame);
+            continue;
+        }
+
+        /*frame not refcounted, copy it into a frame of the pool*/
+        om = ms_yuv_buf_allocator_get(d->pool, &dst, frame->width, frame->height);
+        src.w = frame->width;
+        src.h = frame->height;
+        src.pix_fmt = AV_PIX_FMT_YUV420P;
+        memcpy(src.planes, frame->data, sizeof(src.planes));
+        memcpy(src.strides, frame->linesize, sizeof(src.strides));
+        ms_picture_copy(&dst, &src);
+//        printf("%s : frame pts = [%d]\n", __func__, frame->pts);
+
+        mblk_set_timestamp_info(om, frame->pts);
+        ms_queue_put(f->outputs[0], om);
+        av_frame_unref(d->frame);
+    }
+}
+
 void h264_dec_process(struct _MSFilter *f)
 {
     H264Decoder *d = NULL;
     mblk_t *im = NULL;
-    mblk_t *om = NULL;
 
     if (f == NULL)
     {
@@ -102,7 +180,6 @@ void h264_dec_process(struct _MSFilter *f)
     {
         int ret = -1;
         AVPacket *pkt = d->pkt;
-        AVFrame *frame = d->frame;
 
         pkt->data = im->b_rptr;
         pkt->size = im->b_wptr - im->b_rptr;
@@ -114,43 +191,33 @@ void h264_dec_process(struct _MSFilter *f)
             return;
         }
 
-        while ((ret = avcodec_receive_frame(d->codec_ctx, frame)) >= 0)
-        {
-            int y,u,v;
-            int frame_len = frame->height * frame->width * 3 / 2;
-            om = allocb(frame_len, 0);
-
-            for (y = 0; y < frame->height; y++)
-            {
-                memcpy(om->b_wptr+y*frame->width, frame->data[0]+y*frame->linesize[0], frame->width);
-            }
-            om->b_wptr += frame->height * frame->width;
-
-            for (u = 0; u < frame->height / 2; u++)
-            {
-                memcpy(om->b_wptr+u*frame->width/2, frame->data[1]+u*frame->linesize[1], frame->width/2);
-            }
-            om->b_wptr += frame->height/2 * frame->width/2;
-
-            for (v = 0; v < frame->height / 2; v++)
-            {
-                memcpy(om->b_wptr+v*frame->width/2, frame->data[2]+v*frame->linesize[2], frame->width/2);
-            }
-            om->b_wptr += frame->height/2 * frame->width/2;
-//            printf("%s : frame pts = [%d]\n", __func__, frame->pts);
-
-            mblk_set_timestamp_info(om, frame->pts);
-            ms_queue_put(f->outputs[0], om);
-            av_frame_unref(d->frame);
-        }
+        decoder_receive_frames(f, d);
         freemsg(im);
     }
 }
 
 void h264_dec_postprocess(struct _MSFilter *f)
 {
+    H264Decoder *d = NULL;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (H264Decoder *)f->data;
+    if (d == NULL || d->codec_ctx == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    /*flush the frames still delayed in the decoder*/
+    if (avcodec_send_packet(d->codec_ctx, NULL) >= 0)
+    {
+        decoder_receive_frames(f, d);
+    }
 }
 
 static int decoder_uninit(H264Decoder *d)
@@ -190,6 +257,7 @@ void h264_dec_uninit(struct _MSFilter *f)
     }
 
     decoder_uninit(d);
+    ms_yuv_buf_allocator_free(d->pool);
     ms_free(d);
 }
 
@@ -213,7 +281,7 @@ MSFilterDesc ms_h264_dec_desc = {
     .postprocess = h264_dec_postprocess,
     .uninit = h264_dec_uninit,
     .methods = NULL,
-    .flags = MS_FILTER_IS_ENABLED
+    .flags = MS_FILTER_IS_ENABLED | MS_FILTER_IS_THREADED
 };
 
 
@@ -226,6 +294,7 @@ typedef struct
     int height;
     int width;
     int pix_fmt;
+    msgb_allocator_t allocator;
 }H264Encoder;
 
 static int encoder_init(H264Encoder *d)
@@ -266,16 +335,8 @@ static int encoder_init(H264Encoder *d)
     d->codec = codec;
     d->codec_ctx = cdc_ctx;
     d->pkt = av_packet_alloc();
+    /*no buffer of its own, the frame points at the planes of each input message*/
     d->frame = av_frame_alloc();
-    d->frame->format = cdc_ctx->pix_fmt;
-    d->frame->width = cdc_ctx->width;
-    d->frame->height = cdc_ctx->height;
-
-    if ((ret = av_frame_get_buffer(d->frame, 0)) < 0)
-    {
-        fprintf(stderr, "av_frame_get_buffer failed.\n");
-        return -1;
-    }
     return 0;
 }
 
@@ -287,6 +348,7 @@ void h264_enc_init(struct _MSFilter *f)
 
     d = ms_new0(H264Encoder, 1);
     memset(d, 0, sizeof(H264Encoder));
+    msgb_allocator_init(&d->allocator);
     d->width = 1920;
     d->height = 1080;
     d->pix_fmt = AV_PIX_FMT_YUV420P;
@@ -313,12 +375,61 @@ void h264_enc_preprocess(struct _MSFilter *f)
 }
 
 
+static void encoder_receive_packets(MSFilter *f, H264Encoder *d)
+{
+    mblk_t *om = NULL;
+
+    while (avcodec_receive_packet(d->codec_ctx, d->pkt) >= 0)
+    {
+        om = msgb_from_avbuffer(&d->allocator, d->pkt->buf, d->pkt->data, d->pkt->size);
+//        printf("%s : pkt->pts = [%d]\n", __func__, d->pkt->pts);
+        mblk_set_timestamp_info(om, d->pkt->pts);
+        mblk_set_key_frame_flag(om, d->pkt->flags & AV_PKT_FLAG_KEY);
+        ms_queue_put(f->outputs[0], om);
+
+        av_packet_unref(d->pkt);
+    }
+}
+
+static void encoder_release_input(void *opaque, uint8_t *data)
+{
+    freemsg((mblk_t *)opaque);
+}
+
+/*
+ * Point d->frame at the planes of im, without any copy. The frame buffer holds a dupb() of im,
+ * so the planes stay valid for as long as the encoder keeps a reference on the frame.
+ */
+static int encoder_ref_input(H264Encoder *d, mblk_t *im, const MSPicture *pic)
+{
+    mblk_t *ref = dupb(im);
+
+    d->frame->buf[0] = av_buffer_create(im->b_rptr, im->b_wptr - im->b_rptr, encoder_release_input, ref, AV_BUFFER_FLAG_READONLY);
+    if (d->frame->buf[0] == NULL)
+    {
+        freemsg(ref);
+        return -1;
+    }
+    memcpy(d->frame->data, pic->planes, sizeof(pic->planes));
+    memcpy(d->frame->linesize, pic->strides, sizeof(pic->strides));
+    d->frame->format = d->pix_fmt;
+    d->frame->width = pic->w;
+    d->frame->height = pic->h;
+    return 0;
+}
+
+/* full range YUVJ420P frames are laid out as YUV420P ones */
+static int same_pix_layout(int a, int b)
+{
+    if (a == AV_PIX_FMT_YUVJ420P) a = AV_PIX_FMT_YUV420P;
+    if (b == AV_PIX_FMT_YUVJ420P) b = AV_PIX_FMT_YUV420P;
+    return a == b;
+}
+
 void h264_enc_process(struct _MSFilter *f)
 {
     H264Encoder *d = NULL;
     mblk_t *im = NULL;
-    mblk_t *om = NULL;
-    int size = 0;
 
     if (f == NULL)
     {
@@ -331,46 +442,64 @@ void h264_enc_process(struct _MSFilter *f)
         printf("%s failed.\n", __func__);
         return;
     }
-    size = d->width*d->height;
 
     while ((im = ms_queue_get(f->inputs[0])) != NULL)
     {
         int ret = -1;
+        MSPicture pic;
 
-        memcpy(d->frame->data[0], im->b_rptr, size);
-        im->b_rptr += size;
-        memcpy(d->frame->data[1], im->b_rptr, size/4);
-        im->b_rptr += size/4;
-        memcpy(d->frame->data[2], im->b_rptr, size/4);
-        im->b_rptr += size/4;
+        ms_yuv_buf_init_from_mblk(&pic, im, d->width, d->height);
+        if (pic.w != d->width || pic.h != d->height || !same_pix_layout(pic.pix_fmt, d->pix_fmt))
+        {
+            printf("%s : input frame %dx%d pix_fmt [%d] does not match the encoder, dropped.\n", __func__, pic.w, pic.h, pic.pix_fmt);
+            freemsg(im);
+            continue;
+        }
+        if (encoder_ref_input(d, im, &pic) < 0)
+        {
+            fprintf(stderr, "av_buffer_create failed.\n");
+            freemsg(im);
+            continue;
+        }
 
         d->frame->pts = mblk_get_timestamp_info(im);
 //        printf("%s : frame->pts = [%d]\n", __func__, d->frame->pts);
-        if ((ret = avcodec_send_frame(d->codec_ctx, d->frame)) < 0)
+        ret = avcodec_send_frame(d->codec_ctx, d->frame);
+        av_frame_unref(d->frame);
+        if (ret < 0)
         {
             fprintf(stderr, "avcodec_send_frame failed.\n");
+            freemsg(im);
             return;
         }
-        
-        while ((ret = avcodec_receive_packet(d->codec_ctx, d->pkt)) >= 0)
-        {
-            om = allocb(d->pkt->size, 0);
-            memcpy(om->b_wptr, d->pkt->data, d->pkt->size);
-            om->b_wptr += d->pkt->size;
-//            printf("%s : pkt->pts = [%d]\n", __func__, d->pkt->pts);
-            mblk_set_timestamp_info(om, d->pkt->pts);
-            ms_queue_put(f->outputs[0], om);
 
-            av_packet_unref(d->pkt);
-        }
+        encoder_receive_packets(f, d);
         freemsg(im);
     }
 }
 
 void h264_enc_postprocess(struct _MSFilter *f)
 {
+    H264Encoder *d = NULL;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (H264Encoder *)f->data;
+    if (d == NULL || d->codec_ctx == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    /*flush the packets still delayed in the encoder (lookahead)*/
+    if (avcodec_send_frame(d->codec_ctx, NULL) >= 0)
+    {
+        encoder_receive_packets(f, d);
+    }
 }
 
 static int encoder_uninit(H264Encoder *d)
@@ -409,6 +538,7 @@ void h264_enc_uninit(struct _MSFilter *f)
     }
 
     encoder_uninit(d);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
 }
 
@@ -553,7 +683,7 @@ MSFilterDesc ms_h264_enc_desc = {
     .postprocess = h264_enc_postprocess,
     .uninit = h264_enc_uninit,
     .methods = h264_enc_methods,
-    .flags = MS_FILTER_IS_ENABLED
+    .flags = MS_FILTER_IS_ENABLED | MS_FILTER_IS_THREADED
 };
 
 
@@ -3,18 +3,62 @@
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
+#include <base/mscodecutils.h>
 
 
 
+#define FRAME_PADDING       64      /*zeroed bytes after a frame, the decoder reads ahead (AV_INPUT_BUFFER_PADDING_SIZE)*/
+#define FRAME_MIN_SIZE      4096
+#define RTP_TS_JUMP         (10 * 90000)    /*a timestamp jump of more than 10s restarts the clock from the capture time*/
+
+#define NAL_IDR             5
+#define NAL_SPS             7
+#define NAL_PPS             8
+#define NAL_STAP_A          24
+#define NAL_STAP_B          25
+#define NAL_MTAP16          26
+#define NAL_MTAP24          27
+#define NAL_FU_A            28
+#define NAL_FU_B            29
+
+static uint8_t start_code_1[] = {0x00, 0x00, 0x00, 0x01};
+
+/*
+ * RFC 6184 depacketizer. The access unit being regrouped is written in a single block, each NAL
+ * unit copied once. The block is sized from the largest recent frames, so that it hardly ever has
+ * to be grown. An access unit which misses a packet or a fragment is dropped whole, the decoder
+ * could only conceal it. The interleaved mode (STAP-B, MTAPs, FU-B) is not supported.
+ * Nothing leaves before the first IDR access unit whose parameter sets are known: the last SPS
+ * and PPS seen are kept, and put before each IDR which does not carry its own.
+ */
 typedef struct
 {
     mblk_t *frame;
+    int size_estimate;          /*decaying maximum of the frame sizes*/
+    msgb_allocator_t allocator;
+    uint32_t frame_rtp_ts;      /*RTP timestamp of the access unit*/
+    uint32_t frame_pts;         /*90 kHz*/
+    bool_t has_pts;
+    uint32_t last_rtp_ts;       /*of the last access unit started*/
+    uint32_t last_pts;
+    bool_t frame_broken;        /*a packet or a fragment of the access unit is missing*/
+    bool_t in_fu;               /*between the start and the end fragments of a FU*/
+    bool_t has_seq;
+    uint16_t last_seq;
+    uint32_t ssrc;              /*of the last packet*/
+    int dropped;                /*incomplete access units*/
+    uint32_t nal_start;         /*offset in the frame of the start code of the NAL unit being fragmented*/
+    bool_t frame_idr;           /*NAL units found in the access unit*/
+    bool_t frame_sps;
+    bool_t frame_pps;
+    bool_t started;             /*an IDR went out, the next frames can be decoded*/
+    int skipped;                /*access units before the first IDR*/
+    mblk_t *sps;                /*last parameter sets, without start code*/
+    mblk_t *pps;
+    int width;                  /*from the SPS, 0 until one is seen*/
+    int height;
 }H264Regroup_t;
 
-static uint8_t start_code_1[] = {0x00, 0x00, 0x00, 0x01};
-static uint8_t start_code_2[] = {0x00, 0x00, 0x01};
-
-
 void h264_regroup_init(struct _MSFilter *f)
 {
     H264Regroup_t *d = NULL;
@@ -22,6 +66,8 @@ void h264_regroup_init(struct _MSFilter *f)
 
     d = ms_new0(H264Regroup_t, 1);
     memset(d, 0, sizeof(H264Regroup_t));
+    d->size_estimate = FRAME_MIN_SIZE;
+    msgb_allocator_init(&d->allocator);
 
     f->data = (void *)d;
 }
@@ -34,44 +80,264 @@ void h264_regroup_preprocess(struct _MSFilter *f)
 
 
 
-static int h264_packet_fu_a(uint8_t *nal, uint32_t nal_len, mblk_t **om)
+/*room for size more bytes in the frame, which is started if needed*/
+static uint8_t *frame_reserve(H264Regroup_t *d, uint32_t size)
 {
     mblk_t *m = NULL;
-    uint32_t total_len = 0;
-    uint8_t fu_indicator, fu_header, start_bit, nal_type, nal_header;
+    uint32_t used = 0;
+    uint32_t needed = 0;
+
+    if (d->frame != NULL && d->frame->b_wptr + size + FRAME_PADDING <= d->frame->b_datap->db_lim)
+    {
+        return d->frame->b_wptr;
+    }
+
+    used = d->frame ? d->frame->b_wptr - d->frame->b_rptr : 0;
+    needed = used + size + FRAME_PADDING;
+    /*a quarter more than the largest recent frames, for the next keyframe to fit*/
+    if (needed < (uint32_t)d->size_estimate * 5 / 4)   needed = d->size_estimate * 5 / 4;
+    /*bigger than any recent frame: grow geometrically*/
+    if (d->frame != NULL && needed < 2 * used)  needed = 2 * used;
+
+    m = msgb_allocator_alloc(&d->allocator, needed);
+    if (d->frame != NULL)
+    {
+        memcpy(m->b_wptr, d->frame->b_rptr, used);
+        m->b_wptr += used;
+        mblk_meta_copy(d->frame, m);
+        freemsg(d->frame);
+    }
+    d->frame = m;
+    return m->b_wptr;
+}
+
+static void frame_append(H264Regroup_t *d, const uint8_t *data, uint32_t size)
+{
+    memcpy(frame_reserve(d, size), data, size);
+    d->frame->b_wptr += size;
+}
+
+static void cache_parameter_set(mblk_t **cache, const uint8_t *nal, uint32_t nal_len)
+{
+    if (*cache != NULL && msgdsize(*cache) == nal_len && memcmp((*cache)->b_rptr, nal, nal_len) == 0)  return;
+    if (*cache != NULL)     freemsg(*cache);
+    *cache = allocb(nal_len, 0);
+    memcpy((*cache)->b_wptr, nal, nal_len);
+    (*cache)->b_wptr += nal_len;
+}
+
+/*the NAL unit from the start code at offset start to the end of the frame is complete*/
+static void frame_nal_done(H264Regroup_t *d, uint32_t start)
+{
+    uint8_t *nal = d->frame->b_rptr + start + sizeof(start_code_1);
+    uint32_t nal_len = d->frame->b_wptr - nal;
+    MSH264SpsInfo info;
+
+    switch (nal[0] & 0x1f)
+    {
+        case NAL_IDR:
+            d->frame_idr = TRUE;
+            break;
+        case NAL_SPS:
+            d->frame_sps = TRUE;
+            cache_parameter_set(&d->sps, nal, nal_len);
+            if (ms_h264_parse_sps(nal, nal_len, &info) == 0 && (info.width != d->width || info.height != d->height))
+            {
+                printf("%s : resolution [%dx%d]\n", __func__, info.width, info.height);
+                d->width = info.width;
+                d->height = info.height;
+            }
+            break;
+        case NAL_PPS:
+            d->frame_pps = TRUE;
+            cache_parameter_set(&d->pps, nal, nal_len);
+            break;
+        default:
+            break;
+    }
+}
+
+/*a NAL unit, whole: start code, then the NAL unit*/
+static void frame_append_nal(H264Regroup_t *d, const uint8_t *nal, uint32_t nal_len)
+{
+    uint8_t *p = NULL;
+    uint32_t start = 0;
+
+    if (nal_len == 0)   return;
+    p = frame_reserve(d, sizeof(start_code_1) + nal_len);
+    start = p - d->frame->b_rptr;
+    memcpy(p, start_code_1, sizeof(start_code_1));
+    memcpy(p + sizeof(start_code_1), nal, nal_len);
+    d->frame->b_wptr += sizeof(start_code_1) + nal_len;
+    frame_nal_done(d, start);
+}
+
+/*put the cached parameter sets the IDR access unit lacks in front of it*/
+static void frame_prepend_parameter_sets(H264Regroup_t *d)
+{
+    uint32_t size = d->frame->b_wptr - d->frame->b_rptr;
+    uint32_t extra = 0;
+    uint8_t *p = NULL;
+
+    if (!d->frame_sps)  extra += sizeof(start_code_1) + msgdsize(d->sps);
+    if (!d->frame_pps)  extra += sizeof(start_code_1) + msgdsize(d->pps);
+    if (extra == 0)     return;
+
+    frame_reserve(d, extra);
+    p = d->frame->b_rptr;
+    memmove(p + extra, p, size);
+    if (!d->frame_sps)
+    {
+        memcpy(p, start_code_1, sizeof(start_code_1));
+        memcpy(p + sizeof(start_code_1), d->sps->b_rptr, msgdsize(d->sps));
+        p += sizeof(start_code_1) + msgdsize(d->sps);
+    }
+    if (!d->frame_pps)
+    {
+        memcpy(p, start_code_1, sizeof(start_code_1));
+        memcpy(p + sizeof(start_code_1), d->pps->b_rptr, msgdsize(d->pps));
+    }
+    d->frame->b_wptr += extra;
+}
+
+/*STAP-A: the aggregated NAL units, each after its 16 bits size. -1 if a unit overruns the packet.*/
+static int h264_packet_stap_a(H264Regroup_t *d, const uint8_t *p, uint32_t len)
+{
+    uint32_t pos = 1;
 
-    if (nal_len < 3)
+    while (pos + 2 <= len)
     {
-        printf("Too short data for FU-A H.264 RTP packet\n");
+        uint32_t nal_len = (p[pos] << 8) | p[pos + 1];
+        pos += 2;
+        if (nal_len == 0 || pos + nal_len > len)
+        {
+            printf("%s : bad aggregation unit of [%u] bytes\n", __func__, nal_len);
+            return -1;
+        }
+        frame_append_nal(d, p + pos, nal_len);
+        pos += nal_len;
+    }
+    return 0;
+}
+
+/*FU-A: -1 if the fragment does not follow the previous one*/
+static int h264_packet_fu_a(H264Regroup_t *d, uint8_t *nal, uint32_t nal_len)
+{
+    uint8_t fu_indicator, fu_header, start_bit, end_bit, nal_type, nal_header;
+    uint32_t hdr_len = 2;
+
+    if (nal_len <= hdr_len)
+    {
+        printf("Too short data for FU H.264 RTP packet\n");
         return -1;
     }
 
     fu_indicator = nal[0];
     fu_header    = nal[1];
     start_bit    = fu_header >> 7;
+    end_bit      = (fu_header >> 6) & 1;
     nal_type     = fu_header & 0x1f;
     nal_header   = fu_indicator & 0xe0 | nal_type;
 
-    nal += 2;
-    nal_len -= 2;
+    if (start_bit == d->in_fu)
+    {
+        /*a start without the end of the previous FU, or the rest of a FU whose start was lost*/
+        d->in_fu = start_bit;
+        return -1;
+    }
+
+    nal += hdr_len;
+    nal_len -= hdr_len;
 
-    total_len = nal_len;
-    if (start_bit) total_len += sizeof(start_code_1) + 1;
-    m = allocb(total_len, 0);
     if (start_bit)
     {
-        memcpy(m->b_wptr, start_code_1, sizeof(start_code_1));
-        m->b_wptr += sizeof(start_code_1);
-        memcpy(m->b_wptr, &nal_header, 1);
-        m->b_wptr += 1;
+        uint8_t *p = frame_reserve(d, sizeof(start_code_1) + 1);
+        d->nal_start = p - d->frame->b_rptr;
+        memcpy(p, start_code_1, sizeof(start_code_1));
+        p[sizeof(start_code_1)] = nal_header;
+        d->frame->b_wptr += sizeof(start_code_1) + 1;
+        /*known from now on, should the rest of the IDR be lost*/
+        if (nal_type == NAL_IDR)    d->frame_idr = TRUE;
     }
-    memcpy(m->b_wptr, nal, nal_len);
-    m->b_wptr += nal_len;
-
-    *om = m;
+    frame_append(d, nal, nal_len);
+    d->in_fu = !end_bit;
+    if (end_bit)    frame_nal_done(d, d->nal_start);
     return 0;
 }
 
+static void frame_discard(H264Regroup_t *d)
+{
+    if (d->frame != NULL)   freemsg(d->frame);
+    d->frame = NULL;
+    d->frame_broken = FALSE;
+    d->in_fu = FALSE;
+    d->frame_idr = d->frame_sps = d->frame_pps = FALSE;
+}
+
+/*
+ * pts of the access unit starting with im, in 90 kHz: its RTP timestamp, so that the frames are
+ * spaced as the sender timed them, counted from the capture time of the first one
+ */
+static uint32_t frame_pts(H264Regroup_t *d, mblk_t *im)
+{
+    uint32_t rtp_ts = mblk_get_rtp_timestamp_info(im);
+    int32_t diff = (int32_t)(rtp_ts - d->last_rtp_ts);
+
+    if (!d->has_pts || diff > RTP_TS_JUMP || diff < -RTP_TS_JUMP)
+    {
+        /*capture time in microseconds*/
+        d->last_pts = (uint64_t)mblk_get_timestamp_info(im) * 9 / 100;
+        d->has_pts = TRUE;
+    }
+    else
+    {
+        d->last_pts += diff;
+    }
+    d->last_rtp_ts = rtp_ts;
+    return d->last_pts;
+}
+
+/*hand the regrouped access unit downstream, unless it is incomplete or cannot be decoded yet*/
+static void frame_output(MSFilter *f, H264Regroup_t *d)
+{
+    uint32_t size = 0;
+
+    if (d->frame_broken || d->in_fu)
+    {
+        /*the frames after a lost IDR refer to it: wait for the next one*/
+        if (d->frame_idr)   d->started = FALSE;
+        d->dropped++;
+        frame_discard(d);
+        return;
+    }
+    if (d->frame == NULL)   return;
+    if (!d->started && (!d->frame_idr || d->sps == NULL || d->pps == NULL))
+    {
+        d->skipped++;
+        frame_discard(d);
+        return;
+    }
+    if (d->frame_idr)
+    {
+        frame_prepend_parameter_sets(d);
+        d->started = TRUE;
+    }
+
+    size = d->frame->b_wptr - d->frame->b_rptr;
+    memset(d->frame->b_wptr, 0, FRAME_PADDING);
+    /*follow the large frames at once, forget them over a few GOPs*/
+    if ((int)size > d->size_estimate)   d->size_estimate = size;
+    else                                d->size_estimate -= (d->size_estimate - size) / 256;
+    if (d->size_estimate < FRAME_MIN_SIZE)  d->size_estimate = FRAME_MIN_SIZE;
+
+    mblk_set_timestamp_info(d->frame, d->frame_pts);
+    mblk_set_rtp_timestamp_info(d->frame, d->frame_rtp_ts);
+    mblk_set_key_frame_flag(d->frame, d->frame_idr);
+    ms_queue_put(f->outputs[0], d->frame);
+    d->frame = NULL;
+    d->frame_idr = d->frame_sps = d->frame_pps = FALSE;
+}
+
 
 
 void h264_regroup_process(struct _MSFilter *f)
@@ -96,73 +362,83 @@ void h264_regroup_process(struct _MSFilter *f)
     {
         uint32_t nal_len = im->b_wptr - im->b_rptr;
         uint8_t *nal = im->b_rptr;
-        uint8_t type = nal[0] & 0x1F;
-        uint8_t marker = mblk_get_marker_info(im);
-        uint32_t timestamp = 0;
-
-        if (type >= 1 && type <= 23) type = 1;
-        switch (type)
+        uint8_t type = nal_len > 0 ? nal[0] & 0x1F : 0;
+        uint16_t seq = mblk_get_cseq(im);
+        uint32_t rtp_ts = mblk_get_rtp_timestamp_info(im);
+        uint32_t ssrc = mblk_get_ssrc_info(im);
+        int ret = 0;
+        bool_t lost = FALSE;
+
+        if (d->has_seq && ssrc != d->ssrc)
         {
-            case 1:
-            {
-                mblk_t *om = NULL;
-                om = allocb(nal_len + sizeof(start_code_1), 0);
-                memcpy(om->b_wptr, start_code_1, sizeof(start_code_1));
-                om->b_wptr += sizeof(start_code_1);
-                memcpy(om->b_wptr, nal, nal_len);
-                om->b_wptr += nal_len;
-
-                if (d->frame == NULL)
-                {
-                    d->frame = om;
-                }
-                else
-                {
-                    mblk_t *m = NULL;
-                    for (m = d->frame; m->b_cont != NULL; m = m->b_cont);
-                    m->b_cont = om;
-                }
-                break;
-            }
-            case 28:
-            {
-
-                mblk_t *om = NULL;
-                h264_packet_fu_a(nal, nal_len, &om);
-
-                if (d->frame == NULL)
-                {
-                    d->frame = om;
-                }
-                else
-                {
-                    mblk_t *m = NULL;
-                    for (m = d->frame; m->b_cont != NULL; m = m->b_cont);
-                    m->b_cont = om;
-                }
-                break;
-            }
-            default:
-            {
-                printf("%s : Undefined type [%d]\n", __func__, type);
-            }
+            /*
+             * the sender restarted: what it had begun cannot be completed, its numbering and its
+             * clock start over, and its frames need an IDR of their own
+             */
+            if (d->frame != NULL || d->in_fu)   d->frame_broken = TRUE;
+            frame_output(f, d);
+            d->in_fu = FALSE;
+            d->has_seq = FALSE;
+            d->has_pts = FALSE;
+            d->started = FALSE;
         }
+        d->ssrc = ssrc;
 
-        if (marker)
-        {
-            if (d->frame != NULL)
-            {
-                msgpullup(d->frame, -1);
+        /*
+         * a lost packet: it ended the access unit in progress or started this one, neither of
+         * them can be decoded
+         */
+        lost = d->has_seq && seq != (uint16_t)(d->last_seq + 1);
 
-                timestamp = mblk_get_timestamp_info(im);
-                timestamp = timestamp * 9 / 100;
-//                printf("%s : timestamp = [%d]\n", __func__, timestamp);
-                mblk_set_timestamp_info(d->frame, timestamp);
+        d->has_seq = TRUE;
+        d->last_seq = seq;
+        if (lost && d->frame != NULL)   d->frame_broken = TRUE;
 
-                ms_queue_put(f->outputs[0], d->frame);
-                d->frame = NULL;
-            }
+        /*a new timestamp starts a new access unit, even if the marker of the previous one was lost*/
+        if ((d->frame != NULL || d->frame_broken) && rtp_ts != d->frame_rtp_ts)     frame_output(f, d);
+        if (lost)
+        {
+            d->frame_broken = TRUE;
+            d->in_fu = FALSE;
+        }
+        if (d->frame == NULL)
+        {
+            d->frame_rtp_ts = rtp_ts;
+            d->frame_pts = frame_pts(d, im);
+        }
+
+        if (nal_len == 0 || (nal[0] & 0x80))
+        {
+            ret = -1;   /*forbidden_zero_bit*/
+        }
+        else if (type >= 1 && type <= 23)
+        {
+            if (d->in_fu)   ret = -1;
+            else            frame_append_nal(d, nal, nal_len);
+        }
+        else if (type == NAL_STAP_A)
+        {
+            if (d->in_fu)   ret = -1;
+            else            ret = h264_packet_stap_a(d, nal, nal_len);
         }
+        else if (type == NAL_FU_A)
+        {
+            ret = h264_packet_fu_a(d, nal, nal_len);
+        }
+        else if (type == NAL_STAP_B || type == NAL_MTAP16 || type == NAL_MTAP24 || type == NAL_FU_B)
+        {
+            /*interleaved mode: the NAL units would have to be reordered by their DON*/
+            printf("%s : interleaved packet type [%d] not supported\n", __func__, type);
+            ret = -1;
+        }
+        else
+        {
+            printf("%s : Undefined type [%d]\n", __func__, type);
+            ret = -1;
+        }
+        if (ret < 0)    d->frame_broken = TRUE;
+
+        if (mblk_get_marker_info(im))   frame_output(f, d);
 
         freemsg(im);
     }
@@ -170,8 +446,17 @@ void h264_regroup_process(struct _MSFilter *f)
 
 void h264_regroup_postprocess(struct _MSFilter *f)
 {
+    H264Regroup_t *d = NULL;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL || (d = (H264Regroup_t *)f->data) == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    /*the last access unit, its marker may never come*/
+    frame_output(f, d);
+    printf("%s : dropped = [%d] incomplete access units, skipped = [%d] before the first IDR\n", __func__, d->dropped, d->skipped);
 }
 
 void h264_regroup_uninit(struct _MSFilter *f)
@@ -192,10 +477,60 @@ void h264_regroup_uninit(struct _MSFilter *f)
     }
 
     if (d->frame) freemsg(d->frame);
+    if (d->sps != NULL)     freemsg(d->sps);
+    if (d->pps != NULL)     freemsg(d->pps);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
 }
 
 
+
+static int h264_regroup_get_width(MSFilter *f, void *arg)
+{
+    H264Regroup_t *d = NULL;
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (H264Regroup_t *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    *((int *)arg) = d->width;
+    return 0;
+}
+
+static int h264_regroup_get_height(MSFilter *f, void *arg)
+{
+    H264Regroup_t *d = NULL;
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (H264Regroup_t *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    *((int *)arg) = d->height;
+    return 0;
+}
+
+
+MSFilterMethod h264_regroup_methods[] = {
+    {MS_GET_WIDTH, h264_regroup_get_width},
+    {MS_GET_HEIGTH, h264_regroup_get_height},
+    {-1, NULL},
+};
+
+
 MSFilterDesc ms_h264_regroup_desc = {
     .id = MS_H264_REGROUP_ID,
     .name = "H264Regroup",
@@ -209,7 +544,7 @@ MSFilterDesc ms_h264_regroup_desc = {
     .process = h264_regroup_process,
     .postprocess = h264_regroup_postprocess,
     .uninit = h264_regroup_uninit,
-    .methods = NULL,
+    .methods = h264_regroup_methods,
 };
 
 
@@ -3,11 +3,35 @@
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
+#include <base/mscodecutils.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libavformat/avformat.h>
 
 
+#define MPA_MAX_FRAME_SIZE  2881    /*layer 2, MPEG 2.5 at 160 kbps and 8 kHz, padded*/
+
+/*
+ * Stream of MPEG audio frames cut out of the RTP payloads (RFC 2250 header removed). A frame
+ * lying in one payload leaves as a dupb() of it, without any copy; only one spanning several
+ * payloads is gathered in a block of its own. A payload which does not start on a frame is
+ * searched for the next valid header.
+ */
+typedef struct
+{
+    msgb_allocator_t *allocator;
+    mblk_t *payload;            /*being cut, from pos*/
+    uint8_t *pos;
+    mblk_t *partial;            /*first bytes of a frame continued in the next payload*/
+    int partial_size;           /*its whole size, 0 while its header is incomplete*/
+    MSMpaHeader partial_header;
+    bool_t has_seq;
+    uint16_t last_seq;
+    uint32_t ssrc;              /*of the last payload*/
+    int skipped;                /*bytes which were not part of a frame*/
+    int lost;                   /*partial frames given up*/
+}MP3Splitter;
+
 typedef struct
 {
     AVCodec *codec;
@@ -17,44 +41,11 @@ typedef struct
     int sample_rate;
     int channels;
     int sample_fmt;
-    MSQueue split_before;
-    MSQueue split_after;
+    MP3Splitter splitter;
     FILE *fp;
+    msgb_allocator_t allocator;
 }MP3Decoder;
 
-#define FF_ARRAY_ELEMS(a) (sizeof(a) / sizeof((a)[0]))
-#define MPA_STEREO  0
-#define MPA_JSTEREO 1
-#define MPA_DUAL    2
-#define MPA_MONO    3
-
-typedef struct MPADecodeHeader
-{
-    int frame_size;
-    int error_protection;
-    int layer;
-    int sample_rate;
-    int sample_rate_index; /* between 0 and 8 */
-    int bit_rate;
-    int nb_channels;
-    int mode;
-    int mode_ext;
-    int lsf;
-}MPADecodeHeader;
-
-const uint16_t avpriv_mpa_bitrate_tab[2][3][15] = {
-    { {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
-      {0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
-      {0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 } },
-    { {0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256},
-      {0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160},
-      {0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160}
-    }
-};
-
-const uint16_t avpriv_mpa_freq_tab[3] = { 44100, 48000, 32000 };
-
-
 static int decoder_init(MP3Decoder *d)
 {
     int ret = -1;
@@ -86,6 +77,9 @@ static int decoder_init(MP3Decoder *d)
     return 0;
 }
 
+static void mp3_splitter_init(MP3Splitter *s, msgb_allocator_t *allocator);
+static void mp3_splitter_uninit(MP3Splitter *s);
+
 void mp3_dec_init(struct _MSFilter *f)
 {
     MP3Decoder *d = NULL;
@@ -93,11 +87,11 @@ void mp3_dec_init(struct _MSFilter *f)
 
     d = ms_new0(MP3Decoder, 1);
     memset(d, 0, sizeof(MP3Decoder));
+    msgb_allocator_init(&d->allocator);
     d->sample_rate = 44100;
     d->channels = 1;
     d->sample_fmt = AV_SAMPLE_FMT_FLTP;
-    ms_queue_init(&d->split_before);
-    ms_queue_init(&d->split_after);
+    mp3_splitter_init(&d->splitter, &d->allocator);
     d->fp = fopen("audio.mp3", "wb");
     f->data = (void *)d;
 }
@@ -123,121 +117,137 @@ void mp3_dec_preprocess(struct _MSFilter *f)
 }
 
 
-/* fast header check for resync */
-static inline int ff_mpa_check_header(uint32_t header){
-    /* header */
-    if ((header & 0xffe00000) != 0xffe00000)
-        return -1;
-    /* version check */
-    if ((header & (3<<19)) == 1<<19)
-        return -1;
-    /* layer check */
-    if ((header & (3<<17)) == 0)
-        return -1;
-    /* bit rate */
-    if ((header & (0xf<<12)) == 0xf<<12)
-        return -1;
-    /* frequency */
-    if ((header & (3<<10)) == 3<<10)
-        return -1;
-    return 0;
+static void mp3_splitter_init(MP3Splitter *s, msgb_allocator_t *allocator)
+{
+    memset(s, 0, sizeof(MP3Splitter));
+    s->allocator = allocator;
 }
 
-static int avpriv_mpegaudio_decode_header(MPADecodeHeader *s, uint32_t header)
-{
-    int sample_rate, frame_size, mpeg25, padding;
-    int sample_rate_index, bitrate_index;
-    int ret;
-    unsigned char *abc = (unsigned char *)&header;
-
-    ret = ff_mpa_check_header(header);
-    if (ret < 0)
-        return ret;
-
-    if (header & (1<<20)) {
-        s->lsf = (header & (1<<19)) ? 0 : 1;
-        mpeg25 = 0;
-    } else {
-        s->lsf = 1;
-        mpeg25 = 1;
-    }
-
-    s->layer = 4 - ((header >> 17) & 3);
-    /* extract frequency */
-    sample_rate_index = (header >> 10) & 3;
-    if (sample_rate_index >= FF_ARRAY_ELEMS(avpriv_mpa_freq_tab))
-        sample_rate_index = 0;
-    sample_rate = avpriv_mpa_freq_tab[sample_rate_index] >> (s->lsf + mpeg25);
-    sample_rate_index += 3 * (s->lsf + mpeg25);
-    s->sample_rate_index = sample_rate_index;
-    s->error_protection = ((header >> 16) & 1) ^ 1;
-    s->sample_rate = sample_rate;
-
-    bitrate_index = (header >> 12) & 0xf;
-    padding = (header >> 9) & 1;
-    //extension = (header >> 8) & 1;
-    s->mode = (header >> 6) & 3;
-    s->mode_ext = (header >> 4) & 3;
-    //copyright = (header >> 3) & 1;
-    //original = (header >> 2) & 1;
-    //emphasis = header & 3;
-
-    if (s->mode == MPA_MONO)
-        s->nb_channels = 1;
-    else
-        s->nb_channels = 2;
-
-    if (bitrate_index != 0) {
-        frame_size = avpriv_mpa_bitrate_tab[s->lsf][s->layer - 1][bitrate_index];
-        s->bit_rate = frame_size * 1000;
-        switch(s->layer) {
-        case 1:
-            frame_size = (frame_size * 12000) / sample_rate;
-            frame_size = (frame_size + padding) * 4;
-            break;
-        case 2:
-            frame_size = (frame_size * 144000) / sample_rate;
-            frame_size += padding;
-            break;
-        default:
-        case 3:
-            frame_size = (frame_size * 144000) / (sample_rate << s->lsf);
-            frame_size += padding;
-            break;
+static void mp3_splitter_uninit(MP3Splitter *s)
+{
+    if (s->payload != NULL)     freemsg(s->payload);
+    if (s->partial != NULL)     freemsg(s->partial);
+    s->payload = s->partial = NULL;
+}
+
+static void mp3_splitter_drop_partial(MP3Splitter *s)
+{
+    if (s->partial == NULL)     return;
+    freemsg(s->partial);
+    s->partial = NULL;
+    s->lost++;
+}
+
+/*
+ * Next RTP payload to cut, which the splitter takes. Return TRUE if it starts a new stream (new
+ * SSRC), whose timestamps have nothing to do with those of the last one.
+ */
+static bool_t mp3_splitter_put(MP3Splitter *s, mblk_t *im)
+{
+    uint16_t seq = mblk_get_cseq(im);
+    uint32_t ssrc = mblk_get_ssrc_info(im);
+    bool_t restarted = s->has_seq && ssrc != s->ssrc;
+
+    if (s->payload != NULL)     freemsg(s->payload);
+    /*the sender restarted: its numbering starts over*/
+    if (restarted)  s->has_seq = FALSE;
+    s->ssrc = ssrc;
+    /*a payload is missing, or the stream restarted: the frame it continued cannot be completed*/
+    if (restarted || (s->has_seq && seq != (uint16_t)(s->last_seq + 1)))   mp3_splitter_drop_partial(s);
+    s->has_seq = TRUE;
+    s->last_seq = seq;
+    s->payload = im;
+    s->pos = im->b_rptr;
+    return restarted;
+}
+
+/*go on with the frame begun in the previous payloads: return it once whole, its header in h*/
+static mblk_t *mp3_splitter_continue(MP3Splitter *s, MSMpaHeader *h)
+{
+    mblk_t *m = s->partial;
+    int size = s->payload->b_wptr - s->pos;
+    int n = 0;
+
+    if (s->partial_size == 0)
+    {
+        /*the header first*/
+        n = MIN(4 - (int)(m->b_wptr - m->b_rptr), size);
+        memcpy(m->b_wptr, s->pos, n);
+        m->b_wptr += n;
+        if (m->b_wptr - m->b_rptr < 4)
+        {
+            s->pos += n;
+            return NULL;
+        }
+        if (ms_mpa_parse_header(m->b_rptr, &s->partial_header) < 0 || s->partial_header.frame_size == 0)
+        {
+            /*not a frame after all: look for one in this payload from its start*/
+            s->skipped += 4 - n;
+            mp3_splitter_drop_partial(s);
+            return NULL;
         }
-        s->frame_size = frame_size;
-    } else {
-        /* if no frame size computed, signal it */
-        return 1;
+        s->partial_size = s->partial_header.frame_size;
+        s->pos += n;
+        size -= n;
     }
-    return 0;
+
+    n = MIN(s->partial_size - (int)(m->b_wptr - m->b_rptr), size);
+    memcpy(m->b_wptr, s->pos, n);
+    m->b_wptr += n;
+    s->pos += n;
+    if (m->b_wptr - m->b_rptr < s->partial_size)    return NULL;
+
+    *h = s->partial_header;
+    s->partial = NULL;
+    return m;
 }
 
-static void mp3_split_frame(MP3Decoder *d)
+/*
+ * Next whole frame of the payload, which keeps the timestamps of the payload it starts in, its
+ * header parsed in h; NULL once the payload is used up.
+ */
+static mblk_t *mp3_splitter_get(MP3Splitter *s, MSMpaHeader *h)
 {
-    MPADecodeHeader head;
-    mblk_t *im = NULL;
+    mblk_t *im = s->payload;
     mblk_t *om = NULL;
+    uint8_t *end = NULL;
+    int avail = 0;
+
+    if (im == NULL)     return NULL;
+    if (s->partial != NULL && (om = mp3_splitter_continue(s, h)) != NULL)   return om;
 
-    while ((im = ms_queue_get(&d->split_before)) != NULL)
+    end = im->b_wptr;
+    while (s->pos < end)
     {
-        int len = im->b_wptr - im->b_rptr;
-        memset(&head, 0, sizeof(MPADecodeHeader));
-        while (len)
+        avail = end - s->pos;
+        if (avail >= 4 && (ms_mpa_parse_header(s->pos, h) < 0 || h->frame_size == 0))
         {
-            avpriv_mpegaudio_decode_header(&head, ntohl(*(uint32_t *)im->b_rptr));
-            if (head.frame_size > 0)
-            {
-                om = allocb(head.frame_size, 0);
-                memcpy(om->b_wptr, im->b_rptr, head.frame_size);
-                om->b_wptr += head.frame_size;
-                ms_queue_put(&d->split_after, om);
-                len -= head.frame_size;
-                im->b_rptr += head.frame_size;
-            }
+            /*lost sync (or a free format stream, whose frame size cannot be known): next byte*/
+            s->pos++;
+            s->skipped++;
+            continue;
         }
-        freemsg(im);
-    }
+        if (avail >= 4 && h->frame_size <= avail)
+        {
+            om = dupb(im);
+            om->b_rptr = s->pos;
+            om->b_wptr = s->pos + h->frame_size;
+            s->pos += h->frame_size;
+            return om;
+        }
+
+        /*the frame, or its header, goes on in the next payload*/
+        s->partial = msgb_allocator_alloc(s->allocator, MPA_MAX_FRAME_SIZE);
+        s->partial_size = (avail >= 4) ? h->frame_size : 0;
+        if (avail >= 4)     s->partial_header = *h;
+        memcpy(s->partial->b_wptr, s->pos, avail);
+        s->partial->b_wptr += avail;
+        mblk_meta_copy(im, s->partial);
+        s->pos = end;
+    }
+    freemsg(im);
+    s->payload = NULL;
+    return NULL;
 }
 
 void mp3_dec_process(struct _MSFilter *f)
@@ -245,6 +255,7 @@ void mp3_dec_process(struct _MSFilter *f)
     MP3Decoder *d = NULL;
     mblk_t *im = NULL;
     mblk_t *om = NULL;
+    MSMpaHeader h;
 
     if (f == NULL)
     {
@@ -270,9 +281,8 @@ void mp3_dec_process(struct _MSFilter *f)
             fwrite(im->b_rptr, 1, im->b_wptr - im->b_rptr, d->fp);
         }
 
-        ms_queue_put(&d->split_before, im);
-        mp3_split_frame(d);
-        while ((im = ms_queue_get(&d->split_after)) != NULL)
+        mp3_splitter_put(&d->splitter, im);
+        while ((im = mp3_splitter_get(&d->splitter, &h)) != NULL)
         {
             pkt->data = im->b_rptr;
             pkt->size = im->b_wptr - im->b_rptr;
@@ -286,9 +296,7 @@ void mp3_dec_process(struct _MSFilter *f)
             while ((ret = avcodec_receive_frame(d->codec_ctx, frame)) >= 0)
             {
                 int frame_len = frame->nb_samples * bytes_per_sample;
-                om = allocb(frame_len, 0);
-                memcpy(om->b_wptr, frame->data[0], frame_len);
-                om->b_wptr += frame_len;
+                om = msgb_from_avbuffer(&d->allocator, frame->buf[0], frame->data[0], frame_len);
                 ms_queue_put(f->outputs[0], om);
                 av_frame_unref(d->frame);
             }
@@ -341,8 +349,8 @@ void mp3_dec_uninit(struct _MSFilter *f)
     }
 
     decoder_uninit(d);
-    ms_queue_flush(&d->split_before);
-    ms_queue_flush(&d->split_after);
+    mp3_splitter_uninit(&d->splitter);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
 }
 
@@ -431,6 +439,207 @@ MSFilterDesc ms_mp3_dec_desc = {
 };
 
 
+
+#define MPA_CLOCK_RATE  90000               /*RTP clock of MPA, whatever the sample rate (RFC 3551)*/
+#define RTP_TS_JUMP     (10 * MPA_CLOCK_RATE)
+
+/*
+ * MP3 frames for the muxer, as they come: the RTP payloads are cut into frames, each stamped
+ * with its pts in 90 kHz, from the RTP timestamp of its packet and its rank in it.
+ */
+typedef struct
+{
+    MP3Splitter splitter;
+    msgb_allocator_t allocator;
+    bool_t has_pts;
+    uint32_t last_rtp_ts;       /*of the last packet*/
+    uint32_t packet_pts;        /*of the first frame of the last packet*/
+    uint32_t next_pts;          /*of the frame following the last one*/
+    int sample_rate;            /*of the last frame*/
+    int channels;
+}MP3Parser;
+
+void mp3_parser_init(struct _MSFilter *f)
+{
+    MP3Parser *d = NULL;
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+    d = ms_new0(MP3Parser, 1);
+    msgb_allocator_init(&d->allocator);
+    mp3_splitter_init(&d->splitter, &d->allocator);
+    f->data = (void *)d;
+}
+
+void mp3_parser_preprocess(struct _MSFilter *f)
+{
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+}
+
+static uint32_t mp3_parser_pts(MP3Parser *d, mblk_t *om, const MSMpaHeader *h)
+{
+    uint32_t rtp_ts = mblk_get_rtp_timestamp_info(om);
+    int32_t diff = (int32_t)(rtp_ts - d->last_rtp_ts);
+    uint32_t pts = 0;
+
+    if (!d->has_pts || diff > RTP_TS_JUMP || diff < -RTP_TS_JUMP)
+    {
+        /*capture time in microseconds*/
+        d->packet_pts = (uint64_t)mblk_get_timestamp_info(om) * 9 / 100;
+        d->has_pts = TRUE;
+        pts = d->packet_pts;
+    }
+    else if (diff != 0)
+    {
+        d->packet_pts += diff;
+        pts = d->packet_pts;
+    }
+    else
+    {
+        /*another frame of the same packet*/
+        pts = d->next_pts;
+    }
+    d->last_rtp_ts = rtp_ts;
+    d->next_pts = pts + (uint64_t)h->samples_per_frame * MPA_CLOCK_RATE / h->sample_rate;
+    return pts;
+}
+
+void mp3_parser_process(struct _MSFilter *f)
+{
+    MP3Parser *d = NULL;
+    mblk_t *im = NULL;
+    mblk_t *om = NULL;
+    MSMpaHeader h;
+
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (MP3Parser *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    while ((im = ms_queue_get(f->inputs[0])) != NULL)
+    {
+        /*a new stream: its pts are anchored on the capture time again*/
+        if (mp3_splitter_put(&d->splitter, im))     d->has_pts = FALSE;
+        while ((om = mp3_splitter_get(&d->splitter, &h)) != NULL)
+        {
+            if (h.sample_rate != d->sample_rate || h.channels != d->channels)
+            {
+                printf("%s : layer [%d] sample rate [%d] channels [%d] bitrate [%d]\n", __func__, h.layer, h.sample_rate, h.channels, h.bitrate);
+                d->sample_rate = h.sample_rate;
+                d->channels = h.channels;
+            }
+            mblk_set_timestamp_info(om, mp3_parser_pts(d, om, &h));
+            ms_queue_put(f->outputs[0], om);
+        }
+    }
+}
+
+void mp3_parser_postprocess(struct _MSFilter *f)
+{
+    MP3Parser *d = NULL;
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+    if (f == NULL || (d = (MP3Parser *)f->data) == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    printf("%s : skipped = [%d] bytes, lost = [%d] partial frames\n", __func__, d->splitter.skipped, d->splitter.lost);
+}
+
+void mp3_parser_uninit(struct _MSFilter *f)
+{
+    MP3Parser *d = NULL;
+
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (MP3Parser *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    mp3_splitter_uninit(&d->splitter);
+    msgb_allocator_uninit(&d->allocator);
+    ms_free(d);
+}
+
+
+static int mp3_parser_get_sr(MSFilter *f, void *arg)
+{
+    MP3Parser *d = NULL;
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (MP3Parser *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    *((int *)arg) = d->sample_rate;
+    return 0;
+}
+
+static int mp3_parser_get_channels(MSFilter *f, void *arg)
+{
+    MP3Parser *d = NULL;
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (MP3Parser *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    *((int *)arg) = d->channels;
+    return 0;
+}
+
+
+MSFilterMethod mp3_parser_methods[] = {
+    {MS_GET_SAMPLE_RATE, mp3_parser_get_sr},
+    {MS_GET_CHANNELS,    mp3_parser_get_channels},
+    {-1, NULL},
+};
+
+
+MSFilterDesc ms_mp3_parser_desc = {
+    .id = MS_MP3_PARSER_ID,
+    .name = "MP3Parser",
+    .text = "mp3 frames of rtp payloads",
+    .category = MS_FILTER_OTHER,
+    .enc_fmt = NULL,
+    .ninputs = 1,
+    .noutputs = 1,
+    .init = mp3_parser_init,
+    .preprocess = mp3_parser_preprocess,
+    .process = mp3_parser_process,
+    .postprocess = mp3_parser_postprocess,
+    .uninit = mp3_parser_uninit,
+    .methods = mp3_parser_methods,
+};
+
+
 typedef struct
 {
     AVCodec *codec;
@@ -443,6 +652,7 @@ typedef struct
     int frame_size;
     int bit_rate;
     MSBufferizer encoder;
+    msgb_allocator_t allocator;
 }Mp3Encoder;
 
 static int encoder_init(Mp3Encoder *d)
@@ -497,6 +707,7 @@ void mp3_enc_init(struct _MSFilter *f)
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
     d = ms_new0(Mp3Encoder, 1);
+    msgb_allocator_init(&d->allocator);
     d->sample_rate = 44100;
     d->channels = 1;
     d->sample_fmt = AV_SAMPLE_FMT_S16P;
@@ -527,11 +738,23 @@ void mp3_enc_preprocess(struct _MSFilter *f)
 }
 
 
+static void encoder_receive_packets(MSFilter *f, Mp3Encoder *d)
+{
+    mblk_t *om = NULL;
+
+    while (avcodec_receive_packet(d->codec_ctx, d->pkt) >= 0)
+    {
+        om = msgb_from_avbuffer(&d->allocator, d->pkt->buf, d->pkt->data, d->pkt->size);
+        ms_queue_put(f->outputs[0], om);
+
+        av_packet_unref(d->pkt);
+    }
+}
+
 void mp3_enc_process(struct _MSFilter *f)
 {
     Mp3Encoder *d = NULL;
     mblk_t *im = NULL;
-    mblk_t *om = NULL;
     int data_size = 0;
 
     if (f == NULL)
@@ -560,23 +783,33 @@ void mp3_enc_process(struct _MSFilter *f)
                 return;
             }
             
-            while ((ret = avcodec_receive_packet(d->codec_ctx, d->pkt)) >= 0)
-            {
-                om = allocb(d->pkt->size, 0);
-                memcpy(om->b_wptr, d->pkt->data, d->pkt->size);
-                om->b_wptr += d->pkt->size;
-                ms_queue_put(f->outputs[0], om);
-
-                av_packet_unref(d->pkt);
-            }
+            encoder_receive_packets(f, d);
         }
     }
 }
 
 void mp3_enc_postprocess(struct _MSFilter *f)
 {
+    Mp3Encoder *d = NULL;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (Mp3Encoder *)f->data;
+    if (d == NULL || d->codec_ctx == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    /*the last incomplete frame in the bufferizer is dropped, flush the encoder delay*/
+    if (avcodec_send_frame(d->codec_ctx, NULL) >= 0)
+    {
+        encoder_receive_packets(f, d);
+    }
 }
 
 static int encoder_uninit(Mp3Encoder *d)
@@ -616,6 +849,7 @@ void mp3_enc_uninit(struct _MSFilter *f)
 
     ms_bufferizer_flush(&d->encoder);
     encoder_uninit(d);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
 }
 
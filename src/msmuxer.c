@@ -3,11 +3,17 @@
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
+#include <base/mscodecutils.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libavformat/avformat.h>
 
 
+#define VIDEO_CLOCK_RATE    90000
+#define MPA_CLOCK_RATE      90000
+#define HEADER_WAIT         500     /*video frames held while waiting for the first audio frame passed through*/
+
+
 typedef struct
 {
     const char *file_name;
@@ -26,9 +32,73 @@ typedef struct
     int width;
     int64_t last_pts_video; 
     int packet_num_a;
+    int packet_num_v;
+    bool_t stream_created;
+    bool_t has_audio;           /*the audio input is linked*/
+    bool_t audio_passthrough;   /*compressed MPEG audio frames, pts in 90 kHz*/
+    int64_t last_pts_audio;
+    MSQueue held_audio;         /*what came before the header was written*/
+    MSQueue held_video;
 }MuxerData;
 
-static int create_new_stream(MuxerData *d)
+/*
+ * The SPS and PPS of the first video frame become the extradata of the stream (the format
+ * converts them to avcC if it needs to), and the SPS tells its size.
+ */
+static void set_video_extradata(MuxerData *d, AVCodecParameters *par, mblk_t *first_video)
+{
+    static const uint8_t start_code[] = {0x00, 0x00, 0x00, 0x01};
+    const uint8_t *data = first_video->b_rptr;
+    int size = first_video->b_wptr - first_video->b_rptr;
+    const uint8_t *nal = NULL;
+    int pos = 0, len = 0;
+    uint8_t *extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    int extradata_size = 0;
+
+    if (extradata == NULL)  return;
+    while ((nal = ms_h264_next_nal(data, size, &pos, &len)) != NULL)
+    {
+        MSH264SpsInfo info;
+        int type = len > 0 ? nal[0] & 0x1f : 0;
+
+        if (type != 7 && type != 8)     continue;
+        memcpy(extradata + extradata_size, start_code, sizeof(start_code));
+        memcpy(extradata + extradata_size + sizeof(start_code), nal, len);
+        extradata_size += sizeof(start_code) + len;
+        if (type == 7 && ms_h264_parse_sps(nal, len, &info) == 0)
+        {
+            printf("%s : video [%dx%d] profile [%d] level [%d]\n", __func__, info.width, info.height, info.profile_idc, info.level_idc);
+            d->width = info.width;
+            d->heigth = info.height;
+        }
+    }
+    if (extradata_size == 0)
+    {
+        av_free(extradata);
+        return;
+    }
+    par->extradata = extradata;
+    par->extradata_size = extradata_size;
+}
+
+/*the parameters of an audio stream passed through come from its first frame*/
+static void set_audio_params(MuxerData *d, mblk_t *first_audio)
+{
+    MSMpaHeader h;
+
+    if (first_audio->b_wptr - first_audio->b_rptr < 4 || ms_mpa_parse_header(first_audio->b_rptr, &h) < 0)
+    {
+        printf("%s : not an MPEG audio frame, [%d] Hz [%d] channels kept\n", __func__, d->sample_rate, d->channels);
+        return;
+    }
+    printf("%s : MPEG %d layer %d [%d] Hz [%d] channels [%d] bps\n", __func__, h.version, h.layer, h.sample_rate, h.channels, h.bitrate);
+    d->codec_id = (h.layer == 3) ? AV_CODEC_ID_MP3 : AV_CODEC_ID_MP2;
+    d->sample_rate = h.sample_rate;
+    d->channels = h.channels;
+    d->frame_size = h.samples_per_frame;
+}
+
+static int create_new_stream(MuxerData *d, mblk_t *first_audio, mblk_t *first_video)
 {
     int ret = -1;
     AVFormatContext *fmt_ctx = NULL;
@@ -51,23 +121,28 @@ static int create_new_stream(MuxerData *d)
     video_stream->codecpar->codec_id = AV_CODEC_ID_H264;
     video_stream->codecpar->codec_tag = 0;
     video_stream->codecpar->format = AV_PIX_FMT_YUV420P;
+    if (first_video != NULL)    set_video_extradata(d, video_stream->codecpar, first_video);
     video_stream->codecpar->width = d->width;
     video_stream->codecpar->height = d->heigth;
 
-    /*audio stream*/
-    if ((audio_stream = avformat_new_stream(fmt_ctx, NULL)) == NULL)
+    /*audio stream, unless the input has none*/
+    if (d->has_audio)
     {
-        fprintf(stderr, "avformat_new_stream for failed.\n");
-        return -1;
+        if (d->audio_passthrough && first_audio != NULL)    set_audio_params(d, first_audio);
+        if ((audio_stream = avformat_new_stream(fmt_ctx, NULL)) == NULL)
+        {
+            fprintf(stderr, "avformat_new_stream for failed.\n");
+            return -1;
+        }
+        audio_stream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+        audio_stream->codecpar->codec_id = d->codec_id;
+        audio_stream->codecpar->codec_tag = 0;
+        audio_stream->codecpar->format = d->sample_fmt;
+        audio_stream->codecpar->channel_layout = av_get_default_channel_layout(d->channels);
+        audio_stream->codecpar->channels = d->channels;
+        audio_stream->codecpar->sample_rate = d->sample_rate;
+        audio_stream->codecpar->frame_size = d->frame_size;
     }
-    audio_stream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
-    audio_stream->codecpar->codec_id = d->codec_id;
-    audio_stream->codecpar->codec_tag = 0;
-    audio_stream->codecpar->format = d->sample_fmt;
-    audio_stream->codecpar->channel_layout = av_get_default_channel_layout(d->channels);
-    audio_stream->codecpar->channels = d->channels;
-    audio_stream->codecpar->sample_rate = d->sample_rate;
-    audio_stream->codecpar->frame_size = d->frame_size;
 
     if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE))
     {
@@ -89,7 +164,7 @@ static int create_new_stream(MuxerData *d)
     d->fmt_ctx = fmt_ctx;
     d->audio_stream = audio_stream;
     d->video_stream = video_stream;
-    d->audio_stream_index = audio_stream->index;
+    d->audio_stream_index = audio_stream ? audio_stream->index : -1;
     d->video_stream_index = video_stream->index;
     return 0;
 }
@@ -109,6 +184,8 @@ void muxer_dec_init(struct _MSFilter *f)
     d->heigth = 1920;
     d->width = 1080;
     d->pkt = av_packet_alloc();
+    ms_queue_init(&d->held_audio);
+    ms_queue_init(&d->held_video);
     f->data = (void *)d;
 }
 
@@ -129,34 +206,65 @@ void muxer_dec_preprocess(struct _MSFilter *f)
         return;
     }
 
-    create_new_stream(d);
+    d->has_audio = (f->inputs[0] != NULL);
+    if (!d->has_audio)  printf("%s : no audio input, video only\n", __func__);
 }
 
-
-void muxer_dec_process(struct _MSFilter *f)
+/*
+ * Until the header is written, what comes in is moved to private lists: a bounded input (pipeline
+ * mode) would otherwise fill up and block its upstream, and maybe the other input with it.
+ */
+static void muxer_hold(MSFilter *f, MuxerData *d)
 {
-    MuxerData *d = NULL;
     mblk_t *im = NULL;
 
-    if (f == NULL)
-    {
-        printf("%s failed.\n", __func__);
-        return;
-    }
-    d = (MuxerData *)f->data;
-    if (d == NULL)
-    {
-        printf("%s failed.\n", __func__);
-        return;
-    }
+    while (d->has_audio && (im = ms_queue_get(f->inputs[0])) != NULL)      ms_queue_put(&d->held_audio, im);
+    while (f->inputs[1] != NULL && (im = ms_queue_get(f->inputs[1])) != NULL)  ms_queue_put(&d->held_video, im);
+}
+
+/*
+ * The header is written once the first video frame, the parameter sets of which describe the
+ * stream, is there, or at the end of the stream. The audio passed through takes its parameters
+ * from its first frame too, waited for during HEADER_WAIT video frames at most.
+ */
+static bool_t muxer_wait_first_frames(MSFilter *f, MuxerData *d)
+{
+    if (f->inputs[1] != NULL && ms_queue_empty(&d->held_video))     return TRUE;
+    if (d->has_audio && d->audio_passthrough && ms_queue_empty(&d->held_audio))
+        return ms_queue_size(&d->held_video) < HEADER_WAIT;
+    return FALSE;
+}
+
+static void muxer_start(MuxerData *d)
+{
+    d->stream_created = TRUE;
+    create_new_stream(d, ms_queue_empty(&d->held_audio) ? NULL : ms_queue_peek_first(&d->held_audio),
+        ms_queue_empty(&d->held_video) ? NULL : ms_queue_peek_first(&d->held_video));
+}
 
-    while ((im = ms_queue_get(f->inputs[0])) != NULL)
+static void muxer_write_audio(MuxerData *d, MSQueue *q)
+{
+    mblk_t *im = NULL;
+
+    while ((im = ms_queue_get(q)) != NULL)
     {
         d->pkt->data = im->b_rptr;
         d->pkt->size = im->b_wptr - im->b_rptr;
 
-        d->pkt->pts = d->packet_num_a++ * d->frame_size;
-        d->pkt->duration = d->frame_size;
+        if (d->audio_passthrough)
+        {
+            /*pts of the frame in 90 kHz, which must grow*/
+            int64_t pts = av_rescale_q(mblk_get_timestamp_info(im), (AVRational){1, MPA_CLOCK_RATE}, d->audio_stream->time_base);
+            if (d->packet_num_a++ > 0 && pts <= d->last_pts_audio)   pts = d->last_pts_audio + 1;
+            d->last_pts_audio = pts;
+            d->pkt->pts = pts;
+            d->pkt->duration = av_rescale_q(d->frame_size, (AVRational){1, d->sample_rate}, d->audio_stream->time_base);
+        }
+        else
+        {
+            d->pkt->pts = d->packet_num_a++ * d->frame_size;
+            d->pkt->duration = d->frame_size;
+        }
         d->pkt->dts = d->pkt->pts;
         d->pkt->pos = -1;
         d->pkt->stream_index = d->audio_stream_index;
@@ -169,17 +277,27 @@ void muxer_dec_process(struct _MSFilter *f)
 
         freemsg(im);
     }
+}
 
-    while ((im = ms_queue_get(f->inputs[1])) != NULL)
+static void muxer_write_video(MuxerData *d, MSQueue *q)
+{
+    mblk_t *im = NULL;
+
+    while ((im = ms_queue_get(q)) != NULL)
     {
         d->pkt->data = im->b_rptr;
         d->pkt->size = im->b_wptr - im->b_rptr;
 
+        /*90 kHz, without B frames (RTP streams seldom have any): dts = pts, which must grow*/
         d->pkt->pts = mblk_get_timestamp_info(im);
+        if (d->packet_num_v++ > 0 && d->pkt->pts <= d->last_pts_video)   d->pkt->pts = d->last_pts_video + 1;
+        d->last_pts_video = d->pkt->pts;
         d->pkt->duration = 3750;
         d->pkt->dts = d->pkt->pts;
+        d->pkt->flags = mblk_get_key_frame_flag(im) ? AV_PKT_FLAG_KEY : 0;
         d->pkt->pos = -1;
         d->pkt->stream_index = d->video_stream_index;
+        av_packet_rescale_ts(d->pkt, (AVRational){1, VIDEO_CLOCK_RATE}, d->video_stream->time_base);
 
         if (av_interleaved_write_frame(d->fmt_ctx, d->pkt) < 0)
         {
@@ -187,17 +305,68 @@ void muxer_dec_process(struct _MSFilter *f)
             return;
         }
 
-        d->last_pts_video = d->pkt->pts;
         freemsg(im);
     }
+}
+
+
+void muxer_dec_process(struct _MSFilter *f)
+{
+    MuxerData *d = NULL;
+
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (MuxerData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
 
+    if (!d->stream_created)
+    {
+        muxer_hold(f, d);
+        if (muxer_wait_first_frames(f, d))  return;
+        muxer_start(d);
+    }
+    if (d->fmt_ctx == NULL)
+    {
+        ms_queue_flush(&d->held_audio);
+        ms_queue_flush(&d->held_video);
+        if (d->has_audio)           ms_queue_flush(f->inputs[0]);
+        if (f->inputs[1] != NULL)   ms_queue_flush(f->inputs[1]);
+        return;
+    }
 
+    if (d->has_audio)
+    {
+        muxer_write_audio(d, &d->held_audio);
+        muxer_write_audio(d, f->inputs[0]);
+    }
+    muxer_write_video(d, &d->held_video);
+    if (f->inputs[1] != NULL)   muxer_write_video(d, f->inputs[1]);
 }
 
 void muxer_dec_postprocess(struct _MSFilter *f)
 {
+    MuxerData *d = NULL;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL || (d = (MuxerData *)f->data) == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    if (!d->stream_created)
+    {
+        /*the video never came, or the audio waited for: write what was held*/
+        muxer_hold(f, d);
+        muxer_start(d);
+        muxer_dec_process(f);
+    }
 }
 
 void muxer_dec_uninit(struct _MSFilter *f)
@@ -217,19 +386,20 @@ void muxer_dec_uninit(struct _MSFilter *f)
         return;
     }
 
-    av_write_trailer(d->fmt_ctx);
-
     if (d->pkt != NULL)
     {
         av_packet_free(&d->pkt);
     }
+    ms_queue_flush(&d->held_audio);
+    ms_queue_flush(&d->held_video);
 
-    if (!(d->fmt_ctx->oformat->flags & AVFMT_NOFILE))
-    {
-        avio_close(d->fmt_ctx->pb);
-    }
     if (d->fmt_ctx != NULL)
     {
+        av_write_trailer(d->fmt_ctx);
+        if (!(d->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+        {
+            avio_close(d->fmt_ctx->pb);
+        }
         avformat_free_context(d->fmt_ctx);
     }
 
@@ -422,6 +592,28 @@ static int muxer_set_heigth(MSFilter *f, void *arg)
     return 0;
 }
 
+/*non zero: the audio comes as compressed MPEG audio frames stamped in 90 kHz, to be muxed as they are*/
+static int muxer_set_passthrough(MSFilter *f, void *arg)
+{
+    MuxerData *d = NULL;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (MuxerData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    d->audio_passthrough = *((int *)arg) != 0;
+    printf("%s : audio passthrough = [%d]\n", __func__, d->audio_passthrough);
+    return 0;
+}
+
 MSFilterMethod muxer_methods[] = {
     {MS_SET_FILE_NAME, muxer_set_file},
     {MS_SET_SAMPLE_RATE, muxer_set_sr},
@@ -431,6 +623,7 @@ MSFilterMethod muxer_methods[] = {
     {MS_SET_MIME_TYPE, muxer_set_mime_type},
     {MS_SET_WIDTH, muxer_set_width},
     {MS_SET_HEIGTH, muxer_set_heigth},
+    {MS_SET_PASSTHROUGH, muxer_set_passthrough},
     {-1, NULL},
 };
 
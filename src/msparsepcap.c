@@ -1,21 +1,16 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <base/mscommon.h>
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
-
-typedef struct PcapHeader
-{
-    uint32_t magic;
-    uint16_t major;
-    uint16_t minor;
-    uint32_t time_zone;
-    uint32_t sig_figs;
-    uint32_t snap_len;
-    uint32_t link_type;
-}PcapHeader;
+#include <base/msticker.h>
+#include <base/mspcap.h>
 
 struct time_val
 {
@@ -23,85 +18,99 @@ struct time_val
     uint32_t tv_usec;
 };
 
-typedef struct PacketHeader
+typedef struct MediaPacket
 {
     struct time_val timestamp;
-    uint32_t cap_len;
-    uint32_t data_len;
-}PacketHeader;
-
-typedef struct EthernetHeader
-{
-    uint8_t dest_mac[6];
-    uint8_t src_mac[6];
-    uint16_t type;
-}EthernetHeader;
-
-typedef struct IPHeader
-{
-    uint8_t version : 4;
-    uint8_t header_len : 4;
-    uint8_t service_field;
-    uint16_t total_len;
-    uint16_t identifi;
-    uint16_t flags : 3;
-    uint16_t offset : 13;
-    uint8_t time2live;
-    uint8_t protocol;
-    uint16_t checksum;
+    char marker;
+    uint16_t seq;
+    uint32_t rtp_timestamp;
+    uint32_t ssrc;
+    int payload_type;
+    int flow;
+    mblk_t *payload;
+}MediaPacket;
+
+/*
+ * One participant of the capture, selected by its src/dst addresses: its audio leaves on output
+ * 2 * n and its video on output 2 * n + 1, n being its rank.
+ */
+typedef struct PcapFlow
+{
     uint32_t src_addr;
     uint32_t dest_addr;
-}IPHeader;
-
-typedef struct UdpHeader
+    MSPcapPayloadTypes pt;      /*what goes to its outputs, as probed*/
+    int other_pt;               /*packets of any other payload type, dropped*/
+}PcapFlow;
+
+/*
+ * RTP stream seen in the capture, by 5-tuple and SSRC: the flow table tells in O(1) which
+ * participant (if any) a packet belongs to, the addresses being matched once per stream.
+ */
+typedef struct PcapStreamKey
 {
+    uint32_t src_addr;
+    uint32_t dest_addr;
     uint16_t src_port;
     uint16_t dest_port;
-    uint16_t length;
-    uint16_t checksum;
-}UdpHeader;
-
-typedef struct RtpHeader
-{
-    uint8_t csrc_count : 4;
-    uint8_t extension : 1;
-    uint8_t padding : 1;
-    uint8_t version : 2;
-    uint8_t payload_type : 7;
-    uint8_t marker : 1;
-    uint16_t seq;
-    uint32_t timestamp;
     uint32_t ssrc;
-}RtpHeader;
+}PcapStreamKey;
 
-typedef struct MediaPacket
+typedef struct PcapStreamEntry
 {
-    struct time_val timestamp;
-    char marker;
-    int payload_type;
-    mblk_t *payload;
-    uint32_t need_skip_len;
-}MediaPacket;
+    PcapStreamKey key;
+    bool_t used;
+    int flow;               /*-1 for a stream of no selected participant*/
+    uint32_t last_seq;      /*-1 before the first packet*/
+}PcapStreamEntry;
+
+typedef struct PcapFlowTable
+{
+    PcapStreamEntry *entries;
+    int size;               /*power of two*/
+    int count;
+}PcapFlowTable;
+
+/*
+ * The whole capture mapped in memory: records are parsed in place and the RTP payloads are
+ * handed downstream as slices of the mapping, which lives until the last of them is freed.
+ */
+typedef struct PcapMap
+{
+    uint8_t *base;
+    size_t size;            /*size of the file*/
+    size_t map_size;        /*size of the mapping, padding included*/
+    int refs;               /*atomic, the parser and every payload pointing in the mapping*/
+}PcapMap;
+
+#define PARSE_PCAP_MAX_FLOWS 8
 
 typedef struct ParsePcapData
 {
-    FILE *fp;
+    char *file_name;
+    FILE *fp;               /*capture read with fread when it cannot be mapped*/
+    PcapMap *map;
+    size_t map_pos;         /*offset of the next record in the mapping*/
+    uint8_t *record;        /*current record, fread mode only*/
+    uint32_t record_size;
+    MSPcapFormat format;
+    MSPcapIndex *index;     /*sidecar index of the capture, mmap mode only, may be NULL*/
+    int index_pos;          /*entry of the next record to parse*/
+    MSPcapTimeRange range;  /*part of the capture to output*/
+    uint64_t capture_start; /*capture time of the first record of the file, in microseconds*/
+    bool_t has_capture_start;
     int packet_count;
     MSBufferizer pcap_data;
-    uint32_t src_addr;
-    uint32_t dest_addr;
-    struct time_val first_time_audio;    
-    struct time_val first_time_video;
-    uint32_t last_packet_seq;
+    PcapFlow flows[PARSE_PCAP_MAX_FLOWS];
+    int nflows;
+    PcapFlowTable streams;
+    struct time_val first_time;          /*capture time of the first packet, origin of the pacing*/
+    MediaPacket pending;                /*next packet to output, held until the ticker time reaches it*/
+    bool_t eof;
+    msgb_allocator_t allocator;
 }ParsePcapData;
 
 #define BUFFER_SIZE 1024000
-#define MIN_SIZE    2048
-#define RFC_1889_VERSION 2
-#define PACKET_HDR_LEN      sizeof(PacketHeader)
-#define ETHERNET_HDR_LEN    sizeof(EthernetHeader)
-#define IP_HDR_LEN          sizeof(IPHeader)
-#define UDP_HDR_LEN         sizeof(UdpHeader)
+#define PCAP_MAP_PADDING 4096   /*zeroes readable past the end of the file, decoders read a little beyond the end of a packet*/
 
 
 
@@ -150,8 +159,12 @@ static void parse_pcap_init(MSFilter *f)
 
     d = ms_new0(ParsePcapData, 1);
     memset(d, 0, sizeof(ParsePcapData));
+    msgb_allocator_init(&d->allocator);
     ms_bufferizer_init(&d->pcap_data);
-    d->last_packet_seq = -1;
+    d->nflows = 1;
+    d->range.start_us = 0;
+    d->range.end_us = -1;
+    d->range.rebase = FALSE;
     f->data = (void *)d;
     return;
 }
@@ -162,101 +175,362 @@ static void parse_pcap_preprocess(MSFilter *f)
 
 }
 
-static uint32_t find_udp_payload(ParsePcapData *d, MediaPacket *pkt)
+static PcapMap *pcap_map_open(const char *file_name)
 {
-    uint32_t payload_size = 0;
-    uint32_t skip_len = 0;    
-    PacketHeader pack_h;
-    IPHeader ip_h;
-    UdpHeader udp_h;
-    int total_header_len = PACKET_HDR_LEN + ETHERNET_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN;
+    PcapMap *map = NULL;
+    struct stat st;
+    uint8_t *base = NULL;
+    int fd = -1;
 
-    if (ms_bufferizer_get_avail(&d->pcap_data) >= total_header_len)
+    if ((fd = open(file_name, O_RDONLY)) < 0)
     {
-        memset(&pack_h, 0, sizeof(PacketHeader));
-        ms_bufferizer_read(&d->pcap_data, (uint8_t *)&pack_h, sizeof(PacketHeader));
-        skip_len = pack_h.cap_len;
-        d->packet_count++;
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
 
-        ms_bufferizer_skip_bytes(&d->pcap_data, sizeof(EthernetHeader));            /*跳过Ethernet header*/
-        skip_len -= sizeof(EthernetHeader);
+    /*reserve the padding first, then map the file over the start of it*/
+    base = mmap(NULL, st.st_size + PCAP_MAP_PADDING, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    /*private and writable: a filter may rewrite a payload in place, it gets its own copy of the page*/
+    if (mmap(base, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(base, st.st_size + PCAP_MAP_PADDING);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    map = ms_new0(PcapMap, 1);
+    map->base = base;
+    map->size = st.st_size;
+    map->map_size = st.st_size + PCAP_MAP_PADDING;
+    map->refs = 1;
+    return map;
+}
 
-        memset(&ip_h, 0, sizeof(IPHeader));
-        ms_bufferizer_read(&d->pcap_data, (uint8_t *)&ip_h, sizeof(IPHeader));
-        skip_len -= sizeof(IPHeader);
+static void pcap_map_unref(void *arg)
+{
+    PcapMap *map = (PcapMap *)arg;
 
-        if (ip_h.protocol == 17 && ip_h.src_addr == d->src_addr && ip_h.dest_addr == d->dest_addr)
-        {
-            memset(&udp_h, 0, sizeof(UdpHeader));
-            ms_bufferizer_read(&d->pcap_data, (uint8_t *)&udp_h, sizeof(UdpHeader));
-            skip_len -= sizeof(UdpHeader);
+    if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        munmap(map->base, map->map_size);
+        ms_free(map);
+    }
+}
 
-            pkt->timestamp.tv_sec = pack_h.timestamp.tv_sec;
-            pkt->timestamp.tv_usec = pack_h.timestamp.tv_usec;
-            payload_size = ntohs(udp_h.length) - sizeof(UdpHeader);
-        }
+/*payload of the current record: a slice of the mapping, or a copy of the record read with fread*/
+static mblk_t *payload_alloc(ParsePcapData *d, uint8_t *payload, uint32_t size)
+{
+    mblk_t *m = NULL;
+
+    if (d->map != NULL)
+    {
+        __atomic_add_fetch(&d->map->refs, 1, __ATOMIC_RELAXED);
+        m = esballoc_with_arg(payload, size, 0, pcap_map_unref, d->map);
     }
+    else
+    {
+        m = msgb_allocator_alloc(&d->allocator, size);
+        memcpy(m->b_wptr, payload, size);
+    }
+    m->b_wptr += size;
+    return m;
+}
 
-    pkt->need_skip_len = skip_len;
-    return payload_size;
+static int find_flow(ParsePcapData *d, uint32_t src_addr, uint32_t dest_addr)
+{
+    int i;
+    for (i = 0; i < d->nflows; i++)
+    {
+        if (d->flows[i].src_addr == src_addr && d->flows[i].dest_addr == dest_addr)    return i;
+    }
+    return -1;
 }
 
+static uint32_t stream_hash(const PcapStreamKey *k)
+{
+    uint32_t h = k->src_addr * 0x9e3779b1u;
+    h = (h ^ k->dest_addr) * 0x9e3779b1u;
+    h = (h ^ ((uint32_t)k->src_port << 16 | k->dest_port)) * 0x9e3779b1u;
+    h = (h ^ k->ssrc) * 0x9e3779b1u;
+    return h ^ (h >> 16);
+}
 
-static int read_one_rtp_packet(ParsePcapData *d, MediaPacket *pkt)
+static void flow_table_grow(PcapFlowTable *t)
 {
-    mblk_t *m = NULL;
-    int payload_type = -1;
-    uint32_t skip_len = 0;
-    uint32_t udp_payload_size = 0;
+    PcapStreamEntry *old = t->entries;
+    int old_size = t->size;
+    int i;
 
-    udp_payload_size = find_udp_payload(d, pkt);
-    skip_len = pkt->need_skip_len;
-    if (udp_payload_size > 0)
+    t->size = old_size ? old_size * 2 : 64;
+    t->entries = ms_new0(PcapStreamEntry, t->size);
+    for (i = 0; i < old_size; i++)
     {
-        if (ms_bufferizer_get_avail(&d->pcap_data) >= udp_payload_size)
+        uint32_t h;
+        if (!old[i].used)   continue;
+        for (h = stream_hash(&old[i].key) & (t->size - 1); t->entries[h].used; h = (h + 1) & (t->size - 1));
+        t->entries[h] = old[i];
+    }
+    if (old != NULL)    ms_free(old);
+}
+
+/*entry of the stream of the packet, added the first time the stream is seen*/
+static PcapStreamEntry *flow_table_lookup(ParsePcapData *d, const MSPcapPacket *info)
+{
+    PcapFlowTable *t = &d->streams;
+    PcapStreamKey k;
+    PcapStreamEntry *e = NULL;
+    uint32_t h;
+
+    memset(&k, 0, sizeof(k));
+    k.src_addr = info->src_addr;
+    k.dest_addr = info->dst_addr;
+    k.src_port = info->src_port;
+    k.dest_port = info->dst_port;
+    k.ssrc = info->ssrc;
+
+    if (2 * (t->count + 1) > t->size)   flow_table_grow(t);
+    for (h = stream_hash(&k) & (t->size - 1); t->entries[h].used; h = (h + 1) & (t->size - 1))
+    {
+        if (memcmp(&t->entries[h].key, &k, sizeof(k)) == 0)  return &t->entries[h];
+    }
+
+    e = &t->entries[h];
+    e->key = k;
+    e->used = TRUE;
+    e->flow = find_flow(d, k.src_addr, k.dest_addr);
+    e->last_seq = -1;
+    t->count++;
+    return e;
+}
+
+static bool_t index_entry_selected(ParsePcapData *d, const MSPcapIndexEntry *e)
+{
+    return e->protocol == 17 && e->payload_type != MS_PCAP_NO_RTP && find_flow(d, e->src_addr, e->dst_addr) >= 0;
+}
+
+/*next captured packet, pointing in the mapping or in d->record; -1 at the end of the capture*/
+static int next_record(ParsePcapData *d, MSPcapRecord *rec)
+{
+    int peek = ms_pcap_record_peek_size(&d->format);
+    uint64_t pos = 0;
+    uint32_t len = 0;
+
+    if (d->map != NULL)
+    {
+        if (d->index != NULL)
+        {
+            /*jump straight to the next record of the selected flow*/
+            while (d->index_pos < d->index->count && !index_entry_selected(d, &d->index->entries[d->index_pos]))
+            {
+                d->index_pos++;
+            }
+            if (d->index_pos == d->index->count)    return -1;
+            d->map_pos = d->index->entries[d->index_pos++].offset;
+        }
+        pos = d->map_pos;
+        if (ms_pcap_next_record(&d->format, d->map->base, d->map->size, &pos, rec) < 0)
         {
-            RtpHeader rtp_h;
-            memset(&rtp_h, 0, sizeof(RtpHeader));
-            ms_bufferizer_read(&d->pcap_data, (uint8_t *)&rtp_h, sizeof(RtpHeader));
-            skip_len -= sizeof(RtpHeader);
+            if (pos < d->map->size)     printf("%s : truncated record at offset [%llu]\n", __func__, (unsigned long long)pos);
+            return -1;
+        }
+        d->map_pos = pos;
+        return 0;
+    }
 
-            if (rtp_h.version == RFC_1889_VERSION && rtp_h.seq != d->last_packet_seq)
+    if (d->fp == NULL)  return -1;
+    do
+    {
+        /*the record header tells the size of the record, read it whole*/
+        while (ms_bufferizer_get_avail(&d->pcap_data) < peek)
+        {
+            if (fill_bufferizer(d->fp, &d->pcap_data, BUFFER_SIZE) <= 0)  return -1;
+        }
+        if (d->record_size < (uint32_t)peek)
+        {
+            d->record = ms_realloc(d->record, peek);
+            d->record_size = peek;
+        }
+        ms_bufferizer_read(&d->pcap_data, d->record, peek);
+        if ((len = ms_pcap_record_size(&d->format, d->record)) < (uint32_t)peek)
+        {
+            printf("%s : corrupted record\n", __func__);
+            return -1;
+        }
+        while (ms_bufferizer_get_avail(&d->pcap_data) < len - peek)
+        {
+            if (fill_bufferizer(d->fp, &d->pcap_data, BUFFER_SIZE) <= 0)
             {
-                uint32_t rtp_size = 0;
+                printf("%s : truncated record\n", __func__);
+                return -1;
+            }
+        }
+        if (len > d->record_size)
+        {
+            d->record = ms_realloc(d->record, len);
+            d->record_size = len;
+        }
+        ms_bufferizer_read(&d->pcap_data, d->record + peek, len - peek);
+        pos = 0;
+    }while (ms_pcap_next_record(&d->format, d->record, len, &pos, rec) < 0);   /*not a packet: a pcapng section or interface*/
+    return 0;
+}
+
+/*
+ * Find the RTP packet of a selected participant in a record.
+ * Return its payload type and the position of its payload in the record, -1 if it is not one.
+ */
+static int parse_record(ParsePcapData *d, const MSPcapRecord *rec, MediaPacket *pkt, uint32_t *offset, uint32_t *size)
+{
+    MSPcapPacket info;
+    PcapStreamEntry *stream = NULL;
+
+    d->packet_count++;
+    if (ms_pcap_dissect(rec->link_type, rec->data, rec->cap_len, &info) < 0 || info.payload_type == MS_PCAP_NO_RTP)  return -1;
+    stream = flow_table_lookup(d, &info);
+    if (stream->flow < 0)    return -1;
+    /*the same packet captured twice*/
+    if (info.seq == stream->last_seq)   return -1;
+    stream->last_seq = info.seq;
+
+    pkt->flow = stream->flow;
+
+    pkt->timestamp.tv_sec = rec->time_us / 1000000;
+    pkt->timestamp.tv_usec = rec->time_us % 1000000;
+    pkt->marker = info.marker;
+    pkt->seq = info.seq;
+    pkt->rtp_timestamp = info.timestamp;
+    pkt->ssrc = info.ssrc;
+    *offset = info.payload_offset;
+    *size = info.payload_size;
+    return info.payload_type;
+}
 
-                rtp_size = udp_payload_size;
-                rtp_size -= sizeof(RtpHeader);
-                rtp_size -= 4 * rtp_h.csrc_count;
+/*time of a record since the first record of the capture, in microseconds*/
+static int64_t record_time_us(ParsePcapData *d, const MSPcapRecord *rec)
+{
+    uint64_t t = rec->time_us;
+
+    if (d->has_capture_start == FALSE)
+    {
+        d->capture_start = t;
+        d->has_capture_start = TRUE;
+    }
+    return (int64_t)(t - d->capture_start);
+}
 
-                m = allocb(rtp_size, 0);
-                ms_bufferizer_read(&d->pcap_data, m->b_wptr, rtp_size);
-                m->b_wptr += rtp_size;
-                mblk_set_marker_info(m, rtp_h.marker);
+static int read_next_packet(ParsePcapData *d, MediaPacket *pkt)
+{
+    int payload_type = -1;
+    MSPcapRecord rec;
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    int64_t t = 0;
 
-                pkt->marker = rtp_h.marker;
-                payload_type = rtp_h.payload_type;
-                skip_len -= rtp_size;
-                d->last_packet_seq = rtp_h.seq;
+    while (1)
+    {
+        if (next_record(d, &rec) < 0)
+        {
+            if (d->eof == FALSE)
+            {
+                printf("%s : pcap file is in the end\n", __func__);
             }
+            d->eof = TRUE;
+            return -1;
+        }
+        t = record_time_us(d, &rec);
+        if (d->range.end_us >= 0 && t >= d->range.end_us)
+        {
+            /*the records after the end of the range are left to someone else*/
+            printf("%s : end of the range reached\n", __func__);
+            d->eof = TRUE;
+            return -1;
         }
+        if (t < d->range.start_us)  continue;
+        if ((payload_type = parse_record(d, &rec, pkt, &offset, &size)) >= 0)  break;
     }
 
-    if (skip_len > 0)
+    pkt->payload = payload_alloc(d, (uint8_t *)rec.data + offset, size);
+    mblk_set_marker_info(pkt->payload, pkt->marker);
+    mblk_set_cseq(pkt->payload, pkt->seq);
+    mblk_set_rtp_timestamp_info(pkt->payload, pkt->rtp_timestamp);
+    mblk_set_ssrc_info(pkt->payload, pkt->ssrc);
+    pkt->payload_type = payload_type;
+    return payload_type;
+}
+
+/*time of the packet since the first packet of the capture, in miliseconds*/
+static uint64_t packet_time_ms(ParsePcapData *d, MediaPacket *pkt)
+{
+    if (d->first_time.tv_sec == 0 && d->first_time.tv_usec == 0)
     {
-        ms_bufferizer_skip_bytes(&d->pcap_data, skip_len);
+        d->first_time = pkt->timestamp;
     }
+    return (int64_t)(pkt->timestamp.tv_sec - d->first_time.tv_sec) * 1000 + ((int64_t)pkt->timestamp.tv_usec - d->first_time.tv_usec) / 1000;
+}
 
-    pkt->payload = m;
-    return payload_type;
+static void output_packet(MSFilter *f, ParsePcapData *d, MediaPacket *pkt)
+{
+    int64_t pts = 0;
+    PcapFlow *flow = &d->flows[pkt->flow];
+    MSQueue *audio = f->outputs[2 * pkt->flow];
+    MSQueue *video = f->outputs[2 * pkt->flow + 1];
+    int pt = pkt->payload_type;
+    bool_t is_video = (pt == (flow->pt.video ? flow->pt.video : 96));
+    bool_t is_audio = !is_video && (flow->pt.audio ? pt == flow->pt.audio : (pt == 0 || pt == 14));
+    MSQueue *q = is_video ? video : (is_audio ? audio : NULL);
+
+    if (!is_video && !is_audio)     flow->other_pt++;
+    if (q == NULL)
+    {
+        /*nobody listens to this participant, or not to this payload type*/
+        freemsg(pkt->payload);
+        pkt->payload = NULL;
+        return;
+    }
+
+    /*
+     * capture time in microseconds, on every packet (each one may start an access unit or a frame)
+     * and since the first record of the file, the same origin for audio and video and for every
+     * ParsePcap given a range of the capture
+     */
+    pts = (int64_t)pkt->timestamp.tv_sec * 1000000 + pkt->timestamp.tv_usec - (int64_t)d->capture_start;
+    if (d->range.rebase)    pts -= d->range.start_us;
+    mblk_set_timestamp_info(pkt->payload, (uint32_t)pts);
+
+    /*MPA: the RFC 2250 header before the frames*/
+    if (is_audio && pt == 14)   pkt->payload->b_rptr += 4;
+    ms_queue_put(q, pkt->payload);
+    pkt->payload = NULL;
+}
+
+/*
+ * Output every packet whose capture time has been reached by the ticker time,
+ * so that the graph runs in step with the capture.
+ */
+static bool_t output_full(MSFilter *f)
+{
+    int i;
+    for (i = 0; i < f->desc->noutputs; i++)
+    {
+        if (f->outputs[i] != NULL && ms_queue_full(f->outputs[i]))  return TRUE;
+    }
+    return FALSE;
 }
 
 static void parse_pcap_process(MSFilter *f)
 {
     ParsePcapData *d = NULL;
-    int payload_type = -1;
-    uint32_t pts = 0;
-    MediaPacket pkt;
-    memset(&pkt, 0, sizeof(MediaPacket));
 
     if (f == NULL)
     {
@@ -270,73 +544,18 @@ static void parse_pcap_process(MSFilter *f)
         return;
     }
 
-    do
+    while (1)
     {
-        if (ms_bufferizer_get_avail(&d->pcap_data) <= MIN_SIZE)
+        if (d->pending.payload == NULL)
         {
-            fill_bufferizer(d->fp, &d->pcap_data, BUFFER_SIZE);
-        }
-
-        if (feof(d->fp) && ms_bufferizer_get_avail(&d->pcap_data)
-            < PACKET_HDR_LEN + ETHERNET_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN)
-        {
-            printf("%s : pcap file is in the end\n", __func__);
-//            ms_filter_notify_no_arg(f, 0);
-            break;
-        }
-    } while ((payload_type = read_one_rtp_packet(d, &pkt)) < 0);
-
-    switch (payload_type)
-    {
-        case 0:
-        {
-            if (d->first_time_audio.tv_sec == 0 && d->first_time_audio.tv_usec == 0)
-            {
-                d->first_time_audio = pkt.timestamp;
-            }
-
-            pts = (pkt.timestamp.tv_sec - d->first_time_audio.tv_sec) * 1000000 + (pkt.timestamp.tv_usec - d->first_time_audio.tv_usec);
-            mblk_set_timestamp_info(pkt.payload, pts);
-
-            ms_queue_put(f->outputs[0], pkt.payload);
-            break;
-        }
-        case 14:
-        {
-            if (d->first_time_audio.tv_sec == 0 && d->first_time_audio.tv_usec == 0)
-            {
-                d->first_time_audio = pkt.timestamp;
-            }
-
-            pts = (pkt.timestamp.tv_sec - d->first_time_audio.tv_sec) * 1000000 + (pkt.timestamp.tv_usec - d->first_time_audio.tv_usec);
-            mblk_set_timestamp_info(pkt.payload, pts);
-
-            pkt.payload->b_rptr += 4;
-
-            ms_queue_put(f->outputs[0], pkt.payload);
-            break;
+            if (d->eof || read_next_packet(d, &d->pending) < 0)    break;
         }
-        case 96:
-        {
-            if (pkt.marker)
-            {
-                if (d->first_time_video.tv_sec == 0 && d->first_time_video.tv_usec == 0)
-                {
-                    d->first_time_video = pkt.timestamp;
-                }
 
-                pts = (pkt.timestamp.tv_sec - d->first_time_video.tv_sec) * 1000000 + (pkt.timestamp.tv_usec - d->first_time_video.tv_usec);
-                mblk_set_timestamp_info(pkt.payload, pts);
-            }
+        if (packet_time_ms(d, &d->pending) > f->ticker->time)   break;
+        /*downstream is lagging behind: keep the packet for a later tick*/
+        if (output_full(f))     break;
 
-            ms_queue_put(f->outputs[1], pkt.payload);
-            break;
-        }
-        default:
-        {
-            if (pkt.payload) freemsg(pkt.payload);
-//            printf("%s : Unsurport this payload type [%d]\n", __func__, payload_type);
-        }
+        output_packet(f, d, &d->pending);
     }
 
     return;
@@ -344,8 +563,20 @@ static void parse_pcap_process(MSFilter *f)
 
 static void parse_pcap_postprocess(MSFilter *f)
 {
+    ParsePcapData *d = NULL;
+    int i;
     printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
 
+    if (f == NULL || (d = (ParsePcapData *)f->data) == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    for (i = 0; i < d->nflows; i++)
+    {
+        if (d->flows[i].other_pt > 0)
+            printf("%s : flow %d : [%d] packets of other payload types dropped\n", __func__, i, d->flows[i].other_pt);
+    }
 }
 
 static void parse_pcap_uninit(MSFilter *f)
@@ -371,18 +602,58 @@ static void parse_pcap_uninit(MSFilter *f)
     {
         fclose(d->fp);
     }
+    if (d->map != NULL)
+    {
+        /*the payloads still in flight keep the mapping alive*/
+        pcap_map_unref(d->map);
+    }
+    if (d->record != NULL)
+    {
+        ms_free(d->record);
+    }
+    if (d->index != NULL)
+    {
+        ms_pcap_index_free(d->index);
+    }
+    if (d->file_name != NULL)
+    {
+        ms_free(d->file_name);
+    }
+    if (d->streams.entries != NULL)
+    {
+        ms_free(d->streams.entries);
+    }
+    if (d->pending.payload != NULL)
+    {
+        freemsg(d->pending.payload);
+    }
     ms_bufferizer_flush(&d->pcap_data);
+    msgb_allocator_uninit(&d->allocator);
     ms_free(d);
     return;
 }
 
 
 
+/*
+ * Start from the first record of the range: found in the index, else reached by skipping the
+ * records before it.
+ */
+static void seek_to_range(ParsePcapData *d)
+{
+    if (d->index != NULL)
+    {
+        d->index_pos = ms_pcap_index_find(d->index, d->range.start_us);
+    }
+}
+
 static int open_pcap_file(MSFilter *f, void *arg)
 {
     ParsePcapData *d = NULL;
+    uint8_t header[MS_PCAP_FILE_HDR_PEEK];
+    char *index_file = NULL;
     const char *file_name = (const char *)arg;
-    printf("%s : file_name = [%s]\n", __func__, file_name);
+    int hdr_len = -1;
 
     if (f == NULL || arg == NULL)
     {
@@ -396,14 +667,61 @@ static int open_pcap_file(MSFilter *f, void *arg)
         return -1;
     }
 
+    printf("%s : file_name = [%s]\n", __func__, file_name);
+    d->file_name = ms_malloc(strlen(file_name) + 1);
+    strcpy(d->file_name, file_name);
+
+    if ((d->map = pcap_map_open(file_name)) != NULL)
+    {
+        MSPcapRecord rec;
+        uint64_t pos = 0;
+
+        if ((hdr_len = ms_pcap_format_init(&d->format, d->map->base, d->map->size)) < 0)
+        {
+            printf("%s : %s is not a pcap or pcapng capture.\n", __func__, file_name);
+            pcap_map_unref(d->map);
+            d->map = NULL;
+            return -1;
+        }
+        /*read the pcapng interfaces before the first packet, the origin of the time ranges*/
+        pos = hdr_len;
+        d->map_pos = hdr_len;
+        if (ms_pcap_next_record(&d->format, d->map->base, d->map->size, &pos, &rec) == 0)
+        {
+            record_time_us(d, &rec);
+            d->map_pos = rec.offset;
+        }
+        /*an up to date sidecar index (see ms_pcap_index_open()) makes the seek instant*/
+        index_file = ms_pcap_index_file_name(file_name);
+        d->index = ms_pcap_index_load(index_file, file_name);
+        ms_free(index_file);
+        seek_to_range(d);
+        return 0;
+    }
+
+    /*not a regular file (a pipe...) or mmap failed, fall back to fread*/
     d->fp = fopen(file_name, "rb");
     if (d->fp == NULL)
     {
         printf("%s : fopen %s failed.\n", __func__, file_name);
-        return;
+        return -1;
+    }
+    while (ms_bufferizer_get_avail(&d->pcap_data) < MS_PCAP_FILE_HDR_PEEK)
+    {
+        if (fill_bufferizer(d->fp, &d->pcap_data, BUFFER_SIZE) <= 0)     break;
     }
-    fseek(d->fp, sizeof(PcapHeader), SEEK_SET);      /*pcap header确定大小端,暂不处理*/
-    fill_bufferizer(d->fp, &d->pcap_data, BUFFER_SIZE);
+    if (ms_bufferizer_read(&d->pcap_data, header, MS_PCAP_FILE_HDR_PEEK) != MS_PCAP_FILE_HDR_PEEK
+        || (hdr_len = ms_pcap_format_init(&d->format, header, MS_PCAP_FILE_HDR_PEEK)) < 0)
+    {
+        printf("%s : %s is not a pcap or pcapng capture.\n", __func__, file_name);
+        return -1;
+    }
+    /*rest of the pcapng section header*/
+    while (ms_bufferizer_get_avail(&d->pcap_data) < hdr_len - MS_PCAP_FILE_HDR_PEEK)
+    {
+        if (fill_bufferizer(d->fp, &d->pcap_data, BUFFER_SIZE) <= 0)     break;
+    }
+    ms_bufferizer_skip_bytes(&d->pcap_data, hdr_len - MS_PCAP_FILE_HDR_PEEK);
     return 0;
 }
 
@@ -425,7 +743,7 @@ static int set_src_addr(MSFilter *f, void *arg)
     }
 
     printf("%s : src_addr = [%s]\n", __func__, src_addr);
-    d->src_addr = inet_addr(src_addr);
+    d->flows[0].src_addr = ms_pcap_addr_key(src_addr);
 }
 
 static int set_dest_addr(MSFilter *f, void *arg)
@@ -446,13 +764,145 @@ static int set_dest_addr(MSFilter *f, void *arg)
     }
 
     printf("%s : dest_addr = [%s]\n", __func__, dest_addr);
-    d->dest_addr = inet_addr(dest_addr);
+    d->flows[0].dest_addr = ms_pcap_addr_key(dest_addr);
+}
+
+
+/*
+ * Only output the records of a time range (MSPcapTimeRange), eg. one of those given by
+ * ms_pcap_index_split() to parse a capture with several ParsePcap at once. Set it before the
+ * first tick; the index of the capture is built and saved if there is none yet.
+ */
+static int set_time_range(MSFilter *f, void *arg)
+{
+    ParsePcapData *d = NULL;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (ParsePcapData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    d->range = *(MSPcapTimeRange *)arg;
+    printf("%s : start = [%lld us], end = [%lld us]\n", __func__, (long long)d->range.start_us, (long long)d->range.end_us);
+    if (d->map != NULL && d->index == NULL && d->range.start_us > 0 && d->file_name != NULL)
+    {
+        d->index = ms_pcap_index_open(d->file_name);
+    }
+    seek_to_range(d);
+    return 0;
 }
 
+/*
+ * Demux one more participant (MSPcapFlowSpec) in the same pass over the capture, the first one
+ * being given by MS_SET_SRC_ADDR / MS_SET_DEST_ADDR. Its first output is returned in spec->pin.
+ */
+static int add_flow(MSFilter *f, void *arg)
+{
+    ParsePcapData *d = NULL;
+    MSPcapFlowSpec *spec = (MSPcapFlowSpec *)arg;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (ParsePcapData *)f->data;
+    if (d == NULL || d->streams.count > 0)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    if (d->nflows == PARSE_PCAP_MAX_FLOWS)
+    {
+        printf("%s : at most %d flows.\n", __func__, PARSE_PCAP_MAX_FLOWS);
+        return -1;
+    }
+
+    printf("%s : flow %d : src_addr = [%s], dest_addr = [%s]\n", __func__, d->nflows, spec->src_addr, spec->dst_addr);
+    d->flows[d->nflows].src_addr = ms_pcap_addr_key(spec->src_addr);
+    d->flows[d->nflows].dest_addr = ms_pcap_addr_key(spec->dst_addr);
+    d->flows[d->nflows].pt = spec->pt;
+    spec->pin = 2 * d->nflows;
+    d->nflows++;
+    return 0;
+}
+
+/*MSPcapPayloadTypes of the first participant, those of the others being given by MS_ADD_FLOW*/
+static int set_payload_types(MSFilter *f, void *arg)
+{
+    ParsePcapData *d = NULL;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (ParsePcapData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
 
+    d->flows[0].pt = *(MSPcapPayloadTypes *)arg;
+    printf("%s : audio = [%d], video = [%d]\n", __func__, d->flows[0].pt.audio, d->flows[0].pt.video);
+    return 0;
+}
+
+static int parse_pcap_get_eof(MSFilter *f, void *arg)
+{
+    ParsePcapData *d = NULL;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (ParsePcapData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    *((bool_t *)arg) = (d->eof && d->pending.payload == NULL);
+    return 0;
+}
+
+
+/*
+ * arg: MSPcapProbe to fill (the caller frees it with ms_pcap_probe_uninit()), or NULL to only print
+ * the streams found in the first MS_PCAP_PROBE_SIZE bytes of the capture.
+ */
 static int probe_input_format(MSFilter *f, void *arg)
 {
-    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+    ParsePcapData *d = NULL;
+    MSPcapProbe probe;
+
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (ParsePcapData *)f->data;
+    if (d == NULL || d->file_name == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    if (ms_pcap_probe(d->file_name, MS_PCAP_PROBE_SIZE, &probe) < 0)   return -1;
+    ms_pcap_probe_print(&probe);
+    if (arg != NULL)    *((MSPcapProbe *)arg) = probe;
+    else                ms_pcap_probe_uninit(&probe);
+    return 0;
 }
 
 
@@ -461,6 +911,10 @@ MSFilterMethod parse_pcap_methods[] = {
     {MS_SET_SRC_ADDR, set_src_addr},
     {MS_SET_DEST_ADDR, set_dest_addr},
     {MS_PROBE_INPUT_FORMAT, probe_input_format},
+    {MS_GET_EOF, parse_pcap_get_eof},
+    {MS_SET_TIME_RANGE, set_time_range},
+    {MS_ADD_FLOW, add_flow},
+    {MS_SET_PAYLOAD_TYPES, set_payload_types},
     {-1, NULL},
 };
 
@@ -474,7 +928,7 @@ MSFilterDesc ms_parse_pcap_desc = {
     .category = MS_FILTER_OTHER,
     .enc_fmt = NULL,
     .ninputs = 0,
-    .noutputs = 2,
+    .noutputs = 2 * PARSE_PCAP_MAX_FLOWS,
     .init = parse_pcap_init,
     .preprocess = parse_pcap_preprocess,
     .process = parse_pcap_process,
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <string.h>
+#include <base/msfilter.h>
+#include <base/allfilter.h>
+#include <base/msqueue.h>
+#include <base/msticker.h>
+#include <base/msrtpjitter.h>
+
+
+#define RTP_JITTER_DEFAULT_DEPTH    64
+#define RTP_JITTER_DEFAULT_DELAY    200     /*miliseconds*/
+#define RTP_SEQ_JUMP                3000    /*a jump of more packets than this is a new stream, not a loss*/
+
+
+/*
+ * Reorder buffer of one RTP stream: the packets are kept in a ring indexed by their sequence
+ * number (mblk_get_cseq()) and leave in order. A missing packet is waited for until depth packets
+ * are held behind it or the oldest of them has waited delay miliseconds, then it is counted lost.
+ * A new SSRC (the sender restarted) numbers its packets afresh: the buffer is flushed and restarts.
+ */
+typedef struct RtpJitterSlot
+{
+    mblk_t *m;
+    uint64_t arrival;       /*ticker time*/
+}RtpJitterSlot;
+
+typedef struct RtpJitterData
+{
+    RtpJitterSlot *slots;   /*MS_RTP_JITTER_MAX_DEPTH*/
+    int depth;
+    int delay;
+    int count;              /*packets held*/
+    bool_t started;
+    uint32_t ssrc;          /*of the packets in the buffer*/
+    uint16_t next_seq;      /*next packet to output*/
+    uint16_t max_seq;       /*highest sequence number received*/
+    MSRtpJitterStats stats;
+}RtpJitterData;
+
+#define SLOT(d, seq)    (&(d)->slots[(seq) & (MS_RTP_JITTER_MAX_DEPTH - 1)])
+
+
+static void rtp_jitter_init(MSFilter *f)
+{
+    RtpJitterData *d = NULL;
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    d = ms_new0(RtpJitterData, 1);
+    d->slots = ms_new0(RtpJitterSlot, MS_RTP_JITTER_MAX_DEPTH);
+    d->depth = RTP_JITTER_DEFAULT_DEPTH;
+    d->delay = RTP_JITTER_DEFAULT_DELAY;
+    f->data = (void *)d;
+}
+
+static void rtp_jitter_preprocess(MSFilter *f)
+{
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+}
+
+/*output the packets following each other from next_seq*/
+static void release_ready(MSFilter *f, RtpJitterData *d)
+{
+    RtpJitterSlot *slot = NULL;
+
+    while (d->count > 0 && (slot = SLOT(d, d->next_seq))->m != NULL)
+    {
+        ms_queue_put(f->outputs[0], slot->m);
+        slot->m = NULL;
+        d->count--;
+        d->next_seq++;
+    }
+}
+
+/*give up on the packet awaited at next_seq*/
+static void skip_one(MSFilter *f, RtpJitterData *d)
+{
+    RtpJitterSlot *slot = SLOT(d, d->next_seq);
+
+    if (slot->m != NULL)
+    {
+        ms_queue_put(f->outputs[0], slot->m);
+        slot->m = NULL;
+        d->count--;
+    }
+    else
+    {
+        d->stats.lost++;
+    }
+    d->next_seq++;
+}
+
+/*output everything held, in order, counting the holes as lost*/
+static void flush_all(MSFilter *f, RtpJitterData *d)
+{
+    while (d->count > 0)
+    {
+        skip_one(f, d);
+        release_ready(f, d);
+    }
+}
+
+static void put_packet(MSFilter *f, RtpJitterData *d, mblk_t *im)
+{
+    uint16_t seq = mblk_get_cseq(im);
+    uint32_t ssrc = mblk_get_ssrc_info(im);
+    int diff = 0;
+    RtpJitterSlot *slot = NULL;
+
+    if (d->started && ssrc != d->ssrc)
+    {
+        /*another sender, or the same one restarted: its numbering has nothing to do with the last one*/
+        flush_all(f, d);
+        d->stats.resets++;
+        d->started = FALSE;
+    }
+    if (d->started == FALSE)
+    {
+        d->next_seq = d->max_seq = seq;
+        d->ssrc = ssrc;
+        d->started = TRUE;
+    }
+
+    diff = (int16_t)(seq - d->next_seq);
+    if (diff <= -RTP_SEQ_JUMP || diff >= RTP_SEQ_JUMP)
+    {
+        /*the sender restarted or the capture has a hole: start over from this packet*/
+        flush_all(f, d);
+        d->next_seq = d->max_seq = seq;
+        d->stats.resets++;
+        diff = 0;
+    }
+    else if (diff < 0)
+    {
+        d->stats.late++;
+        freemsg(im);
+        return;
+    }
+
+    /*no room in the window for this packet: stop waiting for the oldest ones*/
+    while (diff >= d->depth)
+    {
+        skip_one(f, d);
+        release_ready(f, d);
+        diff = (int16_t)(seq - d->next_seq);
+    }
+
+    slot = SLOT(d, seq);
+    if (slot->m != NULL)
+    {
+        d->stats.duplicated++;
+        freemsg(im);
+        return;
+    }
+    if ((int16_t)(seq - d->max_seq) < 0)   d->stats.reordered++;
+    else                                    d->max_seq = seq;
+
+    slot->m = im;
+    slot->arrival = f->ticker ? f->ticker->time : 0;
+    d->count++;
+    d->stats.received++;
+}
+
+/*the first packet held behind the hole at next_seq*/
+static RtpJitterSlot *first_held(RtpJitterData *d)
+{
+    uint16_t seq = d->next_seq;
+    int i;
+
+    for (i = 0; i < d->depth; i++, seq++)
+    {
+        if (SLOT(d, seq)->m != NULL)    return SLOT(d, seq);
+    }
+    return NULL;
+}
+
+static void rtp_jitter_process(MSFilter *f)
+{
+    RtpJitterData *d = NULL;
+    RtpJitterSlot *slot = NULL;
+    mblk_t *im = NULL;
+
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (RtpJitterData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    while ((im = ms_queue_get(f->inputs[0])) != NULL)
+    {
+        put_packet(f, d, im);
+        release_ready(f, d);
+    }
+
+    /*a hole waited for too long*/
+    while (d->count > 0 && d->delay > 0 && (slot = first_held(d)) != NULL
+        && f->ticker != NULL && slot->arrival + d->delay <= f->ticker->time)
+    {
+        while (SLOT(d, d->next_seq) != slot)    skip_one(f, d);
+        release_ready(f, d);
+    }
+}
+
+static void rtp_jitter_postprocess(MSFilter *f)
+{
+    RtpJitterData *d = NULL;
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+    if (f == NULL || (d = (RtpJitterData *)f->data) == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    /*end of the stream: nothing more will fill the holes*/
+    flush_all(f, d);
+    printf("%s : received = [%llu], lost = [%llu], late = [%llu], duplicated = [%llu], reordered = [%llu]\n", __func__,
+        (unsigned long long)d->stats.received, (unsigned long long)d->stats.lost, (unsigned long long)d->stats.late,
+        (unsigned long long)d->stats.duplicated, (unsigned long long)d->stats.reordered);
+}
+
+static void rtp_jitter_uninit(MSFilter *f)
+{
+    RtpJitterData *d = NULL;
+    int i;
+    printf("%s : %s : %d\n", __FILE__, __func__, __LINE__);
+
+    if (f == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+    d = (RtpJitterData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return;
+    }
+
+    for (i = 0; i < MS_RTP_JITTER_MAX_DEPTH; i++)
+    {
+        if (d->slots[i].m != NULL)  freemsg(d->slots[i].m);
+    }
+    ms_free(d->slots);
+    ms_free(d);
+}
+
+
+/*packets held behind a hole before it is given up, 1 to MS_RTP_JITTER_MAX_DEPTH*/
+static int rtp_jitter_set_depth(MSFilter *f, void *arg)
+{
+    RtpJitterData *d = NULL;
+    int depth = 0;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (RtpJitterData *)f->data;
+    depth = *(int *)arg;
+    if (d == NULL || depth < 1 || depth > MS_RTP_JITTER_MAX_DEPTH)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    printf("%s : depth = [%d]\n", __func__, depth);
+    d->depth = depth;
+    return 0;
+}
+
+/*miliseconds of ticker time a hole is waited for, 0 to only bound the buffer by its depth*/
+static int rtp_jitter_set_delay(MSFilter *f, void *arg)
+{
+    RtpJitterData *d = NULL;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (RtpJitterData *)f->data;
+    if (d == NULL || *(int *)arg < 0)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    printf("%s : delay = [%d ms]\n", __func__, *(int *)arg);
+    d->delay = *(int *)arg;
+    return 0;
+}
+
+static int rtp_jitter_get_stats(MSFilter *f, void *arg)
+{
+    RtpJitterData *d = NULL;
+
+    if (f == NULL || arg == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+    d = (RtpJitterData *)f->data;
+    if (d == NULL)
+    {
+        printf("%s failed.\n", __func__);
+        return -1;
+    }
+
+    *(MSRtpJitterStats *)arg = d->stats;
+    return 0;
+}
+
+
+MSFilterMethod rtp_jitter_methods[] = {
+    {MS_SET_JITTER_DEPTH, rtp_jitter_set_depth},
+    {MS_SET_JITTER_DELAY, rtp_jitter_set_delay},
+    {MS_GET_JITTER_STATS, rtp_jitter_get_stats},
+    {-1, NULL},
+};
+
+
+MSFilterDesc ms_rtp_jitter_desc = {
+    .id = MS_RTP_JITTER_ID,
+    .name = "RtpJitter",
+    .text = "reorder rtp packets",
+    .category = MS_FILTER_OTHER,
+    .enc_fmt = NULL,
+    .ninputs = 1,
+    .noutputs = 1,
+    .init = rtp_jitter_init,
+    .preprocess = rtp_jitter_preprocess,
+    .process = rtp_jitter_process,
+    .postprocess = rtp_jitter_postprocess,
+    .uninit = rtp_jitter_uninit,
+    .methods = rtp_jitter_methods,
+};
@@ -3,6 +3,7 @@
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
+#include <base/msvideo.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libavformat/avformat.h>
@@ -17,6 +18,7 @@ typedef struct Scale
     int dst_width;
     int dst_height;
     int dst_pix_fmt;
+    MSYuvBufAllocator *pool;
 }Scale;
 
 
@@ -28,18 +30,36 @@ static int scale_context_init(Scale *d)
     int src_width = d->src_width;
     int src_height = d->src_height;
     int src_pix_fmt = d->src_pix_fmt;
-    int dst_width = d->dst_width;
-    int dst_height = d->dst_height;
+    int dst_width = d->dst_width ? d->dst_width : src_width;
+    int dst_height = d->dst_height ? d->dst_height : src_height;
     int dst_pix_fmt = d->dst_pix_fmt;
+    struct SwsContext *c = NULL;
 
-    struct SwsContext *c = sws_getContext(src_width, src_height, src_pix_fmt,
-                                   dst_width, dst_height, dst_pix_fmt,
-                                   SWS_BICUBIC,
-                                   NULL, NULL, NULL);
+    if (src_width == 0 || src_height == 0)
+    {
+        /*not known before the first frame*/
+        d->sws_ctx = NULL;
+        return 0;
+    }
+    c = sws_getContext(src_width, src_height, src_pix_fmt,
+                       dst_width, dst_height, dst_pix_fmt,
+                       SWS_BICUBIC,
+                       NULL, NULL, NULL);
     d->sws_ctx = c;
     return 0;
 }
 
+static int scale_context_uninit(Scale *d)
+{
+    if (d->sws_ctx)
+    {
+        sws_freeContext(d->sws_ctx);
+        d->sws_ctx = NULL;
+    }
+
+    return 0;
+}
+
 
 void scale_init(struct _MSFilter *f)
 {
@@ -48,12 +68,14 @@ void scale_init(struct _MSFilter *f)
 
     d = ms_new0(Scale, 1);
     memset(d, 0, sizeof(Scale));
-    d->src_width = 1920;
-    d->src_height = 1920;
+    /*0: the input size comes with the frames, the output keeps it unless set*/
+    d->src_width = 0;
+    d->src_height = 0;
     d->src_pix_fmt = AV_PIX_FMT_YUV420P;
-    d->dst_width = 1920;
-    d->dst_height = 1920;
+    d->dst_width = 0;
+    d->dst_height = 0;
     d->dst_pix_fmt = AV_PIX_FMT_YUV420P;
+    d->pool = ms_yuv_buf_allocator_new();
     f->data = (void *)d;
 }
 
@@ -89,8 +111,8 @@ void scale_process(struct _MSFilter *f)
     int src_stride[3] = {0};
     uint8_t *dst_slice[3] = {0};
     int dst_stride[3] = {0};
-    int src_frame_size = 0;
-    int dst_frame_size = 0;
+    MSPicture pic;
+    MSPicture dst;
 
     if (f == NULL)
     {
@@ -103,8 +125,6 @@ void scale_process(struct _MSFilter *f)
         printf("%s failed.\n", __func__);
         return;
     }
-    src_frame_size = d->src_width * d->src_height;
-    dst_frame_size = d->dst_width * d->dst_height;
 
     while ((im = ms_queue_get(f->inputs[0])) != NULL)
     {
@@ -115,24 +135,41 @@ void scale_process(struct _MSFilter *f)
         memset(dst_slice, 0, sizeof(dst_slice));
         memset(dst_stride, 0, sizeof(dst_stride));
 
-        src_slice[0] = im->b_rptr;
-        src_slice[1] = im->b_rptr + src_frame_size;
-        src_slice[2] = im->b_rptr + src_frame_size * 5 / 4;
-        src_stride[0] = d->src_width;
-        src_stride[1] = d->src_width / 2;
-        src_stride[2] = d->src_width / 2;
-
-        om = allocb(dst_frame_size * 3 / 2, 0);
-        dst_slice[0] = om->b_wptr;
-        dst_slice[1] = om->b_wptr + dst_frame_size;
-        dst_slice[2] = om->b_wptr + dst_frame_size * 5 / 4;
-        dst_stride[0] = d->dst_width;
-        dst_stride[1] = d->dst_width / 2;
-        dst_stride[2] = d->dst_width / 2;
+        ms_yuv_buf_init_from_mblk(&pic, im, d->src_width, d->src_height);
+        if (d->sws_ctx == NULL || pic.w != d->src_width || pic.h != d->src_height || pic.pix_fmt != d->src_pix_fmt)
+        {
+            /*the input changed, follow the layout the frame comes with*/
+            printf("(%s) %s : input is now %dx%d pix_fmt [%d]\n", scale_name, __func__, pic.w, pic.h, pic.pix_fmt);
+            scale_context_uninit(d);
+            d->src_width = pic.w;
+            d->src_height = pic.h;
+            d->src_pix_fmt = pic.pix_fmt;
+            scale_context_init(d);
+        }
+        if (d->sws_ctx == NULL)
+        {
+            printf("(%s) %s : frame of unknown size, dropped.\n", scale_name, __func__);
+            freemsg(im);
+            continue;
+        }
+        src_slice[0] = pic.planes[0];
+        src_slice[1] = pic.planes[1];
+        src_slice[2] = pic.planes[2];
+        src_stride[0] = pic.strides[0];
+        src_stride[1] = pic.strides[1];
+        src_stride[2] = pic.strides[2];
+
+        om = ms_yuv_buf_allocator_get(d->pool, &dst, d->dst_width ? d->dst_width : d->src_width,
+                d->dst_height ? d->dst_height : d->src_height);
+        dst_slice[0] = dst.planes[0];
+        dst_slice[1] = dst.planes[1];
+        dst_slice[2] = dst.planes[2];
+        dst_stride[0] = dst.strides[0];
+        dst_stride[1] = dst.strides[1];
+        dst_stride[2] = dst.strides[2];
 
         ret = sws_scale(d->sws_ctx, (const uint8_t * const*)src_slice, (const int *)src_stride, 0, d->src_height, (uint8_t * const*)dst_slice, (const int *)dst_stride);
 
-        om->b_wptr += dst_frame_size * 3 / 2;
         mblk_set_timestamp_info(om, timestamp);
         ms_queue_put(f->outputs[0], om);
 
@@ -147,16 +184,6 @@ void scale_postprocess(struct _MSFilter *f)
 }
 
 
-static int scale_context_uninit(Scale *d)
-{
-    if (d->sws_ctx)
-    {
-        sws_freeContext(d->sws_ctx);
-    }
-
-    return 0;
-}
-
 void scale_uninit(struct _MSFilter *f)
 {
     Scale *d = NULL;
@@ -175,6 +202,7 @@ void scale_uninit(struct _MSFilter *f)
     }
 
     scale_context_uninit(d);
+    ms_yuv_buf_allocator_free(d->pool);
     ms_free(d);
 }
 
@@ -331,6 +359,6 @@ MSFilterDesc ms_scale_desc = {
     .postprocess = scale_postprocess,
     .uninit = scale_uninit,
     .methods = scale_methods,
-    .flags = MS_FILTER_IS_ENABLED
+    .flags = MS_FILTER_IS_ENABLED | MS_FILTER_IS_THREADED
 };
 
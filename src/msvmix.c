@@ -3,6 +3,7 @@
 #include <base/msfilter.h>
 #include <base/allfilter.h>
 #include <base/msqueue.h>
+#include <base/msvideo.h>
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
@@ -17,6 +18,7 @@
 #define MAX_STREAM_NUM 2
 //#define FILTERS_DESCR "[in0]scale=w=768:h=432[v1];[v1][in1]xstack=inputs=2:layout=0_0|0_h0[vv];[vv]scale=w=1280:h=720[out]"
 #define FILTERS_DESCR "[in0]scale=w=768:h=432[v1];[v1][in1]hstack=inputs=2[vv];[vv]scale=w=1280:h=720[out]"
+#define VMIX_CONFIG_WAIT 25     /*frames held on an input while another one has none yet, at most what the input can hold*/
 
 
 typedef struct VideoMixer
@@ -38,6 +40,7 @@ typedef struct VideoMixer
     int output_width;
     int output_height;
     int output_pix_fmt;
+    MSYuvBufAllocator *pool;
     FILE *fp;
 }VideoMixer;
 
@@ -52,6 +55,7 @@ void vmix_init(struct _MSFilter *f)
     d = ms_new0(VideoMixer, 1);
     d->frame = av_frame_alloc();
     d->filt_frame = av_frame_alloc();
+    d->pool = ms_yuv_buf_allocator_new();
     d->fp = fopen("video.yuv", "wb");
     f->data = (void *)d;
 }
@@ -190,8 +194,48 @@ void vmix_preprocess(struct _MSFilter *f)
     printf("%s : (output) --> width = [%d]\n", __func__, d->output_width);
     printf("%s : (output) --> height = [%d]\n", __func__, d->output_height);
     printf("%s : (output) --> pix_fmt = [%d]\n", __func__, d->output_pix_fmt);
+}
+
+
+/*
+ * Build the filter graph once the first frame of each input tells its size and pix_fmt, those
+ * given by MS_SET_VMIX_INFO being only a fallback for an input which stays silent.
+ */
+static bool_t vmix_configure(MSFilter *f, VideoMixer *d)
+{
+    bool_t ready = TRUE;
+    bool_t waited = FALSE;
+    int i;
+
+    for (i = 0; i < d->input_stream_count; i++)
+    {
+        if (ms_queue_empty(f->inputs[i]))   ready = FALSE;
+        /*a bounded input (pipeline mode) blocks its upstream once full: it cannot wait longer*/
+        else if (ms_queue_size(f->inputs[i]) >= VMIX_CONFIG_WAIT || ms_queue_full(f->inputs[i]))  waited = TRUE;
+    }
+    if (!ready && !waited)  return FALSE;
+
+    for (i = 0; i < d->input_stream_count; i++)
+    {
+        MSPicture pic;
+
+        if (!ms_queue_empty(f->inputs[i]))
+        {
+            ms_yuv_buf_init_from_mblk(&pic, ms_queue_peek_first(f->inputs[i]), d->input_width[i], d->input_height[i]);
+            d->input_width[i] = pic.w;
+            d->input_height[i] = pic.h;
+            d->input_pix_fmt[i] = pic.pix_fmt;
+        }
+        else if (d->input_width[i] == 0 || d->input_height[i] == 0)
+        {
+            d->input_width[i] = d->output_width;
+            d->input_height[i] = d->output_height;
+        }
+        printf("%s : (input %d) --> [%dx%d] pix_fmt = [%d]\n", __func__, i, d->input_width[i], d->input_height[i], d->input_pix_fmt[i]);
+    }
 
     init_filters(FILTERS_DESCR, d);
+    return TRUE;
 }
 
 
@@ -213,24 +257,27 @@ void vmix_process(struct _MSFilter *f)
         printf("%s failed.\n", __func__);
         return;
     }
+    if (d->filter_graph == NULL && !vmix_configure(f, d))   return;
 
     for (i = 0; i < d->input_stream_count; i++)
     {
         while ((im = ms_queue_get(f->inputs[i])) != NULL)
         {
-            int frame_size = d->input_width[i] * d->input_height[i];
+            MSPicture pic;
+            int j;
+
+            ms_yuv_buf_init_from_mblk(&pic, im, d->input_width[i], d->input_height[i]);
             d->frame->pts = mblk_get_timestamp_info(im);
-            d->frame->data[0] = im->b_rptr;
-            d->frame->data[1] = im->b_rptr + frame_size;
-            d->frame->data[2] = im->b_rptr + frame_size * 5 / 4;
-            d->frame->linesize[0] = d->input_width[i];
-            d->frame->linesize[1] = d->input_width[i]/2;
-            d->frame->linesize[2] = d->input_width[i]/2;
+            for (j = 0; j < 3; j++)
+            {
+                d->frame->data[j] = pic.planes[j];
+                d->frame->linesize[j] = pic.strides[j];
+            }
 
 
-            d->frame->format = d->input_pix_fmt[i];
-            d->frame->width = d->input_width[i];
-            d->frame->height = d->input_height[i];
+            d->frame->format = pic.pix_fmt;
+            d->frame->width = pic.w;
+            d->frame->height = pic.h;
 
             ret = av_buffersrc_add_frame_flags(d->buffersrc_ctx[i], d->frame, AV_BUFFERSRC_FLAG_KEEP_REF);
             if (ret < 0)
@@ -246,7 +293,7 @@ void vmix_process(struct _MSFilter *f)
 
     while (1)
     {
-        int y,u,v;
+        MSPicture src, dst;
         ret = av_buffersink_get_frame(d->buffersink_ctx, d->filt_frame);
 //        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)   break;
         if (ret == AVERROR(EAGAIN))   break;
@@ -259,28 +306,11 @@ void vmix_process(struct _MSFilter *f)
             return;
         }
 
-        om = allocb(d->filt_frame->width * d->filt_frame->height * 3 / 2, 0);
-
-        for (y = 0; y < d->filt_frame->height; y++)
-        {
-//            fwrite(d->filt_frame->data[0]+y*d->filt_frame->linesize[0], 1, d->filt_frame->width, d->fp);
-              memcpy(om->b_wptr+y*d->filt_frame->width, d->filt_frame->data[0]+y*d->filt_frame->linesize[0], d->filt_frame->width);
-        }
-        om->b_wptr += d->filt_frame->width * d->filt_frame->height;
-
-        for (u = 0; u < d->filt_frame->height / 2; u++)
-        {
-//            fwrite(d->filt_frame->data[1]+u*d->filt_frame->linesize[1], 1, d->filt_frame->width/2, d->fp);
-            memcpy(om->b_wptr+u*d->filt_frame->width/2, d->filt_frame->data[1]+u*d->filt_frame->linesize[1], d->filt_frame->width/2);
-        }
-        om->b_wptr += d->filt_frame->width * d->filt_frame->height / 4;
-
-        for (v = 0; v < d->filt_frame->height / 2; v++)
-        {
-//            fwrite(d->filt_frame->data[2]+v*d->filt_frame->linesize[2], 1, d->filt_frame->width/2, d->fp);
-            memcpy(om->b_wptr+v*d->filt_frame->width/2, d->filt_frame->data[2]+v*d->filt_frame->linesize[2], d->filt_frame->width/2);
-        }
-        om->b_wptr += d->filt_frame->width * d->filt_frame->height / 4;
+        om = ms_yuv_buf_allocator_get(d->pool, &dst, d->filt_frame->width, d->filt_frame->height);
+        src = dst;
+        memcpy(src.planes, d->filt_frame->data, sizeof(src.planes));
+        memcpy(src.strides, d->filt_frame->linesize, sizeof(src.strides));
+        ms_picture_copy(&dst, &src);
         mblk_set_timestamp_info(om, d->filt_frame->pts);
         printf("%s : d->filt_frame->pts = [%d]\n", __func__, d->filt_frame->pts);
 
@@ -319,6 +349,7 @@ void vmix_uninit(struct _MSFilter *f)
 
 
 
+    ms_yuv_buf_allocator_free(d->pool);
     ms_free(d);
 }
 
@@ -471,6 +502,7 @@ MSFilterDesc ms_vmix_desc = {
     .postprocess = vmix_postprocess,
     .uninit = vmix_uninit,
     .methods = vmix_methods,
+    .flags = MS_FILTER_IS_THREADED
 };
 
 
@@ -6,6 +6,7 @@
 #include <base/msfilter.h>
 #include <base/msticker.h>
 #include <base/mscommon.h>
+#include <base/mspcap.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/pixfmt.h>
 
@@ -28,6 +29,9 @@ typedef struct Parameter
         int     input_width;
         int     input_height;
         int     input_pix_fmt;
+        char    probed_src_addr[INET6_ADDRSTRLEN];  /*storage of the addresses found by probe_input()*/
+        char    probed_dst_addr[INET6_ADDRSTRLEN];
+        MSPcapPayloadTypes probed_pt;               /*0: the defaults of ParsePcap*/
     }in[MAX_STREAM_NUM];
     char *  output_file;
     int     output_sample_rate;
@@ -37,21 +41,30 @@ typedef struct Parameter
     int     output_width;
     int     output_height;
     int     output_pix_fmt;
+    bool_t  realtime;
+    int     threads;
+    bool_t  pipeline;
+    int64_t start_ms;
+    int64_t end_ms;
 }Parameter;
 
 typedef struct PcapStream
 {
     MSTicker *ticker;
-    MSFilter *source[MAX_STREAM_NUM];
+    MSFilter *source[MAX_STREAM_NUM];   /*inputs without a file of their own share the source of the previous one*/
+    int source_pin[MAX_STREAM_NUM];     /*output of the audio of the input on its source, the video is on the next one*/
     struct Audio
     {
+        MSFilter *jitter[MAX_STREAM_NUM];
         MSFilter *decoder[MAX_STREAM_NUM];
+        MSFilter *parser;       /*passthrough: MPEG audio frames of the single input*/
         MSFilter *resample;
         MSFilter *encoder;
         MSFilter *amix;
     }audio;
     struct Video
     {
+        MSFilter *jitter[MAX_STREAM_NUM];
         MSFilter *regroup[MAX_STREAM_NUM];
         MSFilter *decoder[MAX_STREAM_NUM];
         MSFilter *scale;
@@ -79,6 +92,11 @@ static struct option long_options[] = {
     {"acodec",      required_argument,  NULL, 'a' },
     {"size",        required_argument,  NULL, 's' },
     {"pix_fmt",     required_argument,  NULL, 'p' },
+    {"realtime",    no_argument,        NULL, 'R' },
+    {"threads",     required_argument,  NULL, 't' },
+    {"pipeline",    no_argument,        NULL, 'P' },
+    {"start",       required_argument,  NULL, '2' },
+    {"end",         required_argument,  NULL, '3' },
     {"help",        no_argument,        NULL, 'h' },
     {0,             0,                  0,     0  }
 };
@@ -88,15 +106,24 @@ static void print_usage()
     printf("Option:\n");
     printf("The option marked with * is required.\n");
     printf(" -i, --in=FILE       *       The file name for input file.\n");
+    printf("                             -i alone takes another participant from the previous file, in the same pass.\n");
     printf(" -o, --out=FILE      *       The file name for output file.\n");
-    printf(" --srcaddr=IP        *       The address to be filtered, src-dst.\n");
-    printf(" --dstaddr=IP        *       The address to be filtered, src-dst.\n");
+    printf(" --srcaddr=IP                The address to be filtered, src-dst.\n");
+    printf(" --dstaddr=IP                The address to be filtered, src-dst.\n");
+    printf("                             What is left out is probed from the capture, taking the first\n");
+    printf("                             participant not used by a previous input.\n");
     printf(" -r, --sample_rate=          The sample rate of audio.\n");
     printf(" -c, --channels=             The channels rate of audio.\n");
-    printf(" -f, --format,       *       The format of audio, eg: s16p/fltp.\n");
-    printf(" -a, --acodec,       *       The codec of audio.\n");
+    printf(" -f, --format,               The format of audio, eg: s16p/fltp.\n");
+    printf(" -a, --acodec,               The codec of audio.\n");
     printf(" -s, --size,                 The resolution of video.\n");
     printf(" -p, --pix_fmt,              The format of video, eg: yuv420P/yuv420.\n");
+    printf(" -R, --realtime              Pace the capture in real time and quit on 'q',\n");
+    printf("                             instead of converting as fast as possible.\n");
+    printf(" -t, --threads=N             Run the audio and video branches on N worker threads.\n");
+    printf(" -P, --pipeline              Run the video decoders, mixer and encoder on their own threads.\n");
+    printf(" --start=MS                  Skip the first MS miliseconds of the captures.\n");
+    printf(" --end=MS                    Stop at MS miliseconds from the start of the captures.\n");
     printf(" -h, --help                  Print this message and exit.\n");
 }
 
@@ -114,7 +141,7 @@ static void parse_options(int argc, const char *argv[], Parameter *param)
     int height = 0;
     int pix_fmt = AV_PIX_FMT_YUV420P;
 
-    while ((optc = getopt_long(argc, (char *const *)argv, "hi::o:r:c:f:a:s:p:", long_options, &opt_index)) != -1)
+    while ((optc = getopt_long(argc, (char *const *)argv, "hi::o:r:c:f:a:s:p:Rt:P", long_options, &opt_index)) != -1)
     {
         printf("optc = [%c] : optarg = [%s]\n", optc, optarg);
         switch (optc)
@@ -205,6 +232,31 @@ static void parse_options(int argc, const char *argv[], Parameter *param)
                 pix_fmt = av_get_pix_fmt(optarg);
                 break;
             }
+            case 'R':
+            {
+                param->realtime = TRUE;
+                break;
+            }
+            case 't':
+            {
+                param->threads = atoi(optarg);
+                break;
+            }
+            case 'P':
+            {
+                param->pipeline = TRUE;
+                break;
+            }
+            case '2':
+            {
+                param->start_ms = atoll(optarg);
+                break;
+            }
+            case '3':
+            {
+                param->end_ms = atoll(optarg);
+                break;
+            }
             case '?':
             case 'h':
             default:
@@ -217,50 +269,6 @@ static void parse_options(int argc, const char *argv[], Parameter *param)
 }
 
 
-void ms_filter_preprocess(MSFilter *f, struct _MSTicker *t)
-{
-    f->last_tick = 0;
-    f->ticker = t;
-    if (f->desc->preprocess != NULL) f->desc->preprocess(f);
-}
-
-static int ticker_attach(MSTicker *ticker, PcapStream *stream)
-{
-    bctbx_list_t *it = NULL;
-    bctbx_list_t *filters = NULL;
-
-    filters = bctbx_list_append(filters, stream->source[0]);
-    filters = bctbx_list_append(filters, stream->source[1]);
-    if (stream->audio.decoder[0])  filters = bctbx_list_append(filters, stream->audio.decoder[0]);
-    if (stream->audio.decoder[1])  filters = bctbx_list_append(filters, stream->audio.decoder[1]);
-    filters = bctbx_list_append(filters, stream->video.regroup[0]);
-    filters = bctbx_list_append(filters, stream->video.regroup[1]);
-    if (stream->video.decoder[0])  filters = bctbx_list_append(filters, stream->video.decoder[0]);
-    if (stream->video.decoder[1])  filters = bctbx_list_append(filters, stream->video.decoder[1]);
-    filters = bctbx_list_append(filters, stream->audio.amix);
-    filters = bctbx_list_append(filters, stream->video.vmix);
-    if (stream->audio.encoder)  filters = bctbx_list_append(filters, stream->audio.encoder);
-    if (stream->video.encoder)  filters = bctbx_list_append(filters, stream->video.encoder);
-    filters = bctbx_list_append(filters, stream->muxer);
-
-    for(it = filters; it != NULL; it = it->next)
-    {
-        ms_filter_preprocess((MSFilter*)it->data, ticker);
-    }    
-
-    ticker->execution_list = bctbx_list_concat(ticker->execution_list, filters);
-}
-
-static void pcap_file_end(void *userdata, struct _MSFilter *f, unsigned int id, void *arg)
-{
-    printf("%s : id =  [%d]\n", __func__, id);
-    if (id == 0)
-    {
-        ms_ticker_destroy(f->ticker);
-    }
-}
-
-
 /*
  * note: since not all filters implement MS_FILTER_GET_SAMPLE_RATE and MS_FILTER_GET_NCHANNELS, the PayloadType passed here is used to guess this information.
  */
@@ -365,9 +373,95 @@ static void stream_configure_scale(PcapStream *st, MSFilter *scale, MSFilter *fr
 
 
 
+static bool_t probe_addr_used(Parameter *param, int i, uint32_t src_addr)
+{
+    int j;
+    for (j = 0; j < i; j++)
+    {
+        if (param->in[j].input_src_addr != NULL && ms_pcap_addr_key(param->in[j].input_src_addr) == src_addr)  return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Fill what the command line left out of input i (addresses, codec, sample rate, channels, size)
+ * from the RTP streams found at the start of its capture.
+ */
+static void probe_input(Parameter *param, int i, MSFilter *source)
+{
+    struct Input *in = &param->in[i];
+    MSPcapProbe probe;
+    MSPcapFlowInfo *audio = NULL;
+    MSPcapFlowInfo *video = NULL;
+    int j;
+
+    if (in->input_src_addr && in->input_dst_addr && in->input_mime_type && in->input_sample_rate
+        && in->input_channels && in->input_width && in->input_height)
+    {
+        return;
+    }
+    if (ms_filter_call_method(source, MS_PROBE_INPUT_FORMAT, &probe) < 0)  return;
+
+    /*the participant: the given addresses, else the first one not taken, found by its audio or else its video*/
+    for (j = 0; j < probe.count && audio == NULL && video == NULL; j++)
+    {
+        MSPcapFlowInfo *info = &probe.flows[j];
+        if (info->encoding == NULL)     continue;
+        if (in->input_src_addr ? info->src_addr != ms_pcap_addr_key(in->input_src_addr) : probe_addr_used(param, i, info->src_addr))
+            continue;
+        if (in->input_dst_addr && info->dst_addr != ms_pcap_addr_key(in->input_dst_addr))    continue;
+        if (info->video)    video = info;
+        else                audio = info;
+    }
+    for (j = 0; j < probe.count && (audio || video); j++)
+    {
+        MSPcapFlowInfo *info = &probe.flows[j];
+        MSPcapFlowInfo *found = audio ? audio : video;
+        if (info->encoding == NULL || info->src_addr != found->src_addr || info->dst_addr != found->dst_addr)   continue;
+        if (info->video && video == NULL)       video = info;
+        if (!info->video && audio == NULL)      audio = info;
+    }
+    if (audio == NULL && video == NULL)
+    {
+        printf("%s : no RTP stream found for input %d.\n", __func__, i);
+        ms_pcap_probe_uninit(&probe);
+        return;
+    }
+
+    if (in->input_src_addr == NULL)
+    {
+        strcpy(in->probed_src_addr, audio ? audio->src : video->src);
+        in->input_src_addr = in->probed_src_addr;
+    }
+    if (in->input_dst_addr == NULL)
+    {
+        strcpy(in->probed_dst_addr, audio ? audio->dst : video->dst);
+        in->input_dst_addr = in->probed_dst_addr;
+    }
+    /*the payload types the source must route, dynamic or not*/
+    if (audio)  in->probed_pt.audio = audio->payload_type;
+    if (video)  in->probed_pt.video = video->payload_type;
+    if (audio)
+    {
+        if (in->input_mime_type == NULL)    in->input_mime_type = (char *)audio->mime_type;
+        if (in->input_sample_rate == 0)     in->input_sample_rate = audio->sample_rate;
+        if (in->input_channels == 0)        in->input_channels = audio->channels;
+    }
+    if (video && in->input_width == 0 && in->input_height == 0)
+    {
+        in->input_width = video->width;
+        in->input_height = video->height;
+    }
+    printf("%s : input %d : %s -> %s, %s %d Hz %d ch, %dx%d\n", __func__, i, in->input_src_addr, in->input_dst_addr,
+        in->input_mime_type ? in->input_mime_type : "unknown", in->input_sample_rate, in->input_channels,
+        in->input_width, in->input_height);
+    ms_pcap_probe_uninit(&probe);
+}
+
 static int pcap_stream_start_from_param(MSFactory *factory, PcapStream *stream, Parameter *param)
 {
     MSConnectionHelper h;
+    MSTickerParams ticker_params;
     int i, ret = -1;
     int src_sample_rate = param->in[0].input_sample_rate;
     int src_channels = param->in[0].input_channels;
@@ -384,13 +478,40 @@ static int pcap_stream_start_from_param(MSFactory *factory, PcapStream *stream,
     bool_t need_scale = FALSE;
 
     bool_t need_mix = FALSE;
+    int audio_passthrough = FALSE;
+    bool_t has_audio = TRUE;
 
-    for (i = 0; i < param->input_file_count; i++)
+    for (i = 0; i < param->input_stream_count; i++)
     {
+        if (param->in[i].input_file == NULL && i > 0)
+        {
+            /*another participant of the same capture: demuxed in the same pass*/
+            MSPcapFlowSpec spec;
+            stream->source[i] = stream->source[i - 1];
+            probe_input(param, i, stream->source[i]);
+            spec.pin = 0;
+            spec.src_addr = param->in[i].input_src_addr;
+            spec.dst_addr = param->in[i].input_dst_addr;
+            spec.pt = param->in[i].probed_pt;
+            ms_filter_call_method(stream->source[i], MS_ADD_FLOW, (void *)&spec);
+            stream->source_pin[i] = spec.pin;
+            continue;
+        }
         stream->source[i] = ms_factory_create_filter(factory, MS_PARSE_PCAP_ID);
+        stream->source_pin[i] = 0;
         ms_filter_call_method(stream->source[i], MS_SET_FILE_NAME, (void *)param->in[i].input_file);
+        probe_input(param, i, stream->source[i]);
         ms_filter_call_method(stream->source[i], MS_SET_SRC_ADDR, (void *)param->in[i].input_src_addr);
         ms_filter_call_method(stream->source[i], MS_SET_DEST_ADDR, (void *)param->in[i].input_dst_addr);
+        ms_filter_call_method(stream->source[i], MS_SET_PAYLOAD_TYPES, (void *)&param->in[i].probed_pt);
+        if (param->start_ms > 0 || param->end_ms > 0)
+        {
+            MSPcapTimeRange range;
+            range.start_us = param->start_ms * 1000;
+            range.end_us = param->end_ms > 0 ? param->end_ms * 1000 : -1;
+            range.rebase = TRUE;    /*the output starts at --start*/
+            ms_filter_call_method(stream->source[i], MS_SET_TIME_RANGE, (void *)&range);
+        }
 //        ms_filter_set_notify_callback(stream->source[i], pcap_file_end, NULL);
     }
 
@@ -407,23 +528,66 @@ static int pcap_stream_start_from_param(MSFactory *factory, PcapStream *stream,
             need_transcoding = TRUE;
         if (param->output_channels && param->output_channels != param->in[0].input_channels)
             need_transcoding = TRUE;
-        if (param->output_mime_type && strcasecmp(param->output_mime_type, param->in[0].input_mime_type) != 0)
+        /*an unknown input codec cannot be passed through*/
+        if (param->output_mime_type && (param->in[0].input_mime_type == NULL
+            || strcasecmp(param->output_mime_type, param->in[0].input_mime_type) != 0))
             need_transcoding = TRUE;
 
-        if (param->output_width != param->in[0].input_width)      need_scale = TRUE;
-        if (param->output_height != param->in[0].input_height)    need_scale = TRUE;
+        /*no size given: keep the input one*/
+        if (param->output_width && param->output_width != param->in[0].input_width)      need_scale = TRUE;
+        if (param->output_height && param->output_height != param->in[0].input_height)    need_scale = TRUE;
+    }
+    /*otherwise the regrouped access units go to the muxer as they are*/
+    printf("%s : video %s\n", __func__, (need_mix || need_scale) ? "transcoding" : "passthrough");
+    /*the audio of an input whose codec is unknown cannot be decoded: the output has none*/
+    for (i = 0; i < param->input_stream_count; i++)
+    {
+        if (param->in[i].input_mime_type == NULL)
+        {
+            printf("%s : no known audio codec for input %d\n", __func__, i);
+            has_audio = FALSE;
+        }
+    }
+    /*so do the MPEG audio frames, any other codec is transcoded*/
+    if (has_audio && !need_mix && !need_transcoding)
+    {
+        if (strcasecmp(param->in[0].input_mime_type, "MP3") == 0 || strcasecmp(param->in[0].input_mime_type, "MP2") == 0)
+            audio_passthrough = TRUE;
+        else
+            need_transcoding = TRUE;
     }
 
+    if (has_audio && (need_mix || need_transcoding))
+    {
+        for (i = 0; i < param->input_stream_count; i++)
+        {
+            stream->audio.decoder[i] = ms_factory_create_decoder(factory, param->in[i].input_mime_type);
+            if (stream->audio.decoder[i] == NULL)
+            {
+                printf("%s : no decoder for [%s] (input %d)\n", __func__, param->in[i].input_mime_type, i);
+                has_audio = FALSE;
+            }
+        }
+        if (!has_audio)
+        {
+            for (i = 0; i < param->input_stream_count; i++)
+            {
+                if (stream->audio.decoder[i])   ms_filter_destroy(stream->audio.decoder[i]);
+                stream->audio.decoder[i] = NULL;
+            }
+        }
+    }
+    printf("%s : audio %s\n", __func__, !has_audio ? "left out" : (audio_passthrough ? "passthrough" : "transcoding"));
 
 
 
 
 
-    if (need_mix || need_transcoding)
+
+    if (has_audio && (need_mix || need_transcoding))
     {
         for (i = 0; i < param->input_stream_count; i++)
         {
-            stream->audio.decoder[i] = ms_factory_create_decoder(factory, param->in[i].input_mime_type);
             if (stream->audio.decoder[i])
             {
 #if 0
@@ -498,7 +662,6 @@ static int pcap_stream_start_from_param(MSFactory *factory, PcapStream *stream,
             ms_filter_call_method(stream->video.vmix, MS_SET_OUTPUT_WIDTH, (void *)&dst_width);
             ms_filter_call_method(stream->video.vmix, MS_SET_OUTPUT_HEIGTH, (void *)&dst_height);
             ms_filter_call_method(stream->video.vmix, MS_SET_OUTPUT_PIX_FMT, &dst_pix_fmt);
-            ms_filter_set_notify_callback(stream->video.vmix, pcap_file_end, NULL);
         }
 
 
@@ -515,8 +678,12 @@ static int pcap_stream_start_from_param(MSFactory *factory, PcapStream *stream,
 
     for (i = 0; i < param->input_stream_count; i++)
     {
+        /*put the RTP packets back in order before they are depacketized*/
+        if (has_audio)  stream->audio.jitter[i] = ms_factory_create_filter(factory, MS_RTP_JITTER_ID);
+        stream->video.jitter[i] = ms_factory_create_filter(factory, MS_RTP_JITTER_ID);
         stream->video.regroup[i] = ms_factory_create_filter(factory, MS_H264_REGROUP_ID);
     }
+    if (audio_passthrough)  stream->audio.parser = ms_factory_create_filter(factory, MS_MP3_PARSER_ID);
 
     stream->muxer = ms_factory_create_filter(factory, MS_MUXER_ID);
     if (stream->muxer)
@@ -529,73 +696,129 @@ static int pcap_stream_start_from_param(MSFactory *factory, PcapStream *stream,
         ms_filter_call_method(stream->muxer, MS_SET_SAMPLE_RATE, (void *)&dst_sample_rate);
         ms_filter_call_method(stream->muxer, MS_SET_CHANNELS, (void *)&dst_channels);
         ms_filter_call_method(stream->muxer, MS_SET_SAMPLE_FMT, (void *)&dst_sample_fmt);
-        ms_filter_call_method(stream->muxer, MS_SET_MIME_TYPE, (void *)(param->output_mime_type));
+        ms_filter_call_method(stream->muxer, MS_SET_MIME_TYPE, (void *)(param->output_mime_type ? param->output_mime_type : DEFAULT_MIME_TYPE));
+        ms_filter_call_method(stream->muxer, MS_SET_PASSTHROUGH, (void *)&audio_passthrough);
     }
 
 
 
     for (i = 0; i < param->input_stream_count; i++)
     {
-        ms_connection_helper_start(&h);
-        ms_connection_helper_link(&h, stream->source[i], -1, 0);
-        if (stream->audio.decoder[i])   ms_connection_helper_link(&h, stream->audio.decoder[i], 0, 0);
-        if (stream->audio.amix)   ms_connection_helper_link(&h, stream->audio.amix, i, 0);
+        /*without audio, the source drops it and the muxer writes video only*/
+        if (stream->audio.jitter[i])
+        {
+            ms_connection_helper_start(&h);
+            ms_connection_helper_link(&h, stream->source[i], -1, stream->source_pin[i]);
+            ms_connection_helper_link(&h, stream->audio.jitter[i], 0, 0);
+            if (stream->audio.decoder[i])   ms_connection_helper_link(&h, stream->audio.decoder[i], 0, 0);
+            if (stream->audio.parser)   ms_connection_helper_link(&h, stream->audio.parser, 0, 0);
+            /*without a mixer, the single input goes to the muxer as it is*/
+            if (stream->audio.amix)   ms_connection_helper_link(&h, stream->audio.amix, i, 0);
+            else    ms_connection_helper_link(&h, stream->muxer, 0, -1);
+        }
 
         ms_connection_helper_start(&h);
-        ms_connection_helper_link(&h, stream->source[i], -1, 1);
+        ms_connection_helper_link(&h, stream->source[i], -1, stream->source_pin[i] + 1);
+        ms_connection_helper_link(&h, stream->video.jitter[i], 0, 0);
         ms_connection_helper_link(&h, stream->video.regroup[i], 0, 0);
         if (stream->video.decoder[i])   ms_connection_helper_link(&h, stream->video.decoder[i], 0, 0);
         if (stream->video.vmix)   ms_connection_helper_link(&h, stream->video.vmix, i, 0);
+        else    ms_connection_helper_link(&h, stream->muxer, 1, -1);
     }
 
-    ms_connection_helper_start(&h);
-    if (stream->audio.amix)   ms_connection_helper_link(&h, stream->audio.amix, -1, 0);
-    if (stream->audio.encoder)   ms_connection_helper_link(&h, stream->audio.encoder, 0, 0);
-    ms_connection_helper_link(&h, stream->muxer, 0, -1);
-
+    if (stream->audio.amix)
+    {
+        ms_connection_helper_start(&h);
+        ms_connection_helper_link(&h, stream->audio.amix, -1, 0);
+        if (stream->audio.encoder)   ms_connection_helper_link(&h, stream->audio.encoder, 0, 0);
+        ms_connection_helper_link(&h, stream->muxer, 0, -1);
+    }
 
-    ms_connection_helper_start(&h);
-    if (stream->video.vmix)   ms_connection_helper_link(&h, stream->video.vmix, -1, 0);
-    if (stream->video.encoder)   ms_connection_helper_link(&h, stream->video.encoder, 0, 0);
-    ms_connection_helper_link(&h, stream->muxer, 1, -1);
+    if (stream->video.vmix)
+    {
+        ms_connection_helper_start(&h);
+        ms_connection_helper_link(&h, stream->video.vmix, -1, 0);
+        if (stream->video.encoder)   ms_connection_helper_link(&h, stream->video.encoder, 0, 0);
+        ms_connection_helper_link(&h, stream->muxer, 1, -1);
+    }
 
 
 
-    stream->ticker = ms_ticker_new();
-    ticker_attach(stream->ticker, stream);
+    ticker_params.name = "MSTicker";
+    ticker_params.mode = param->realtime ? MS_TICKER_MODE_REALTIME : MS_TICKER_MODE_OFFLINE;
+    ticker_params.nthreads = param->threads;
+    ticker_params.pipeline = param->pipeline;
+    stream->ticker = ms_ticker_new_with_params(&ticker_params);
+    for (i = 0; i < param->input_stream_count; i++)
+    {
+        if (i > 0 && stream->source[i] == stream->source[i - 1])  continue;
+        ms_ticker_attach(stream->ticker, stream->source[i]);
+    }
 }
 
-#if 0
-static int pcap_stream_stop(MSFactory *factory, PcapStream *stream)
+static void pcap_stream_stop(PcapStream *stream, Parameter *param)
 {
     MSConnectionHelper h;
+    int i;
+
+    for (i = 0; i < param->input_stream_count; i++)
+    {
+        if (stream->audio.jitter[i])
+        {
+            ms_connection_helper_start(&h);
+            ms_connection_helper_unlink(&h, stream->source[i], -1, stream->source_pin[i]);
+            ms_connection_helper_unlink(&h, stream->audio.jitter[i], 0, 0);
+            if (stream->audio.decoder[i])   ms_connection_helper_unlink(&h, stream->audio.decoder[i], 0, 0);
+            if (stream->audio.parser)   ms_connection_helper_unlink(&h, stream->audio.parser, 0, 0);
+            if (stream->audio.amix)   ms_connection_helper_unlink(&h, stream->audio.amix, i, 0);
+            else    ms_connection_helper_unlink(&h, stream->muxer, 0, -1);
+        }
+
+        ms_connection_helper_start(&h);
+        ms_connection_helper_unlink(&h, stream->source[i], -1, stream->source_pin[i] + 1);
+        ms_connection_helper_unlink(&h, stream->video.jitter[i], 0, 0);
+        ms_connection_helper_unlink(&h, stream->video.regroup[i], 0, 0);
+        if (stream->video.decoder[i])   ms_connection_helper_unlink(&h, stream->video.decoder[i], 0, 0);
+        if (stream->video.vmix)   ms_connection_helper_unlink(&h, stream->video.vmix, i, 0);
+        else    ms_connection_helper_unlink(&h, stream->muxer, 1, -1);
+    }
+
+    if (stream->audio.amix)
+    {
+        ms_connection_helper_start(&h);
+        ms_connection_helper_unlink(&h, stream->audio.amix, -1, 0);
+        if (stream->audio.encoder)   ms_connection_helper_unlink(&h, stream->audio.encoder, 0, 0);
+        ms_connection_helper_unlink(&h, stream->muxer, 0, -1);
+    }
 
-    ms_connection_helper_start(&h);
-    ms_connection_helper_unlink(&h, stream->source, -1, 0);
-    if (stream->audio.decoder)  ms_connection_helper_unlink(&h, stream->audio.decoder, 0, 0);
-    if (stream->audio.resample)   ms_connection_helper_unlink(&h, stream->audio.resample, 0, 0);
-    if (stream->audio.encoder)  ms_connection_helper_unlink(&h, stream->audio.encoder, 0, 0);
-    ms_connection_helper_unlink(&h, stream->muxer, 0, -1);
-    ms_connection_helper_start(&h);
-    ms_connection_helper_unlink(&h, stream->source, -1, 1);
-//    ms_connection_helper_unlink(&h, stream->video.regroup, 0, 0);
-    if (stream->video.decoder)   ms_connection_helper_unlink(&h, stream->video.decoder, 0, 0);
-    if (stream->video.scale)     ms_connection_helper_unlink(&h, stream->video.scale, 0, 0);
-    if (stream->video.encoder)   ms_connection_helper_unlink(&h, stream->video.encoder, 0, 0);
-    ms_connection_helper_unlink(&h, stream->muxer, 1, -1);
-
-
-    if (stream->source)     ms_filter_destroy(stream->source);
-    if (stream->audio.decoder)    ms_filter_destroy(stream->audio.decoder);
-    if (stream->audio.resample)   ms_filter_destroy(stream->audio.resample);
-    if (stream->audio.encoder)    ms_filter_destroy(stream->audio.encoder);
-//    if (stream->video.regroup)    ms_filter_destroy(stream->video.regroup);
-    if (stream->video.decoder)    ms_filter_destroy(stream->video.decoder);
-    if (stream->video.scale)    ms_filter_destroy(stream->video.scale);
-    if (stream->video.encoder)    ms_filter_destroy(stream->video.encoder);
-    if (stream->muxer)      ms_filter_destroy(stream->muxer);
+    if (stream->video.vmix)
+    {
+        ms_connection_helper_start(&h);
+        ms_connection_helper_unlink(&h, stream->video.vmix, -1, 0);
+        if (stream->video.encoder)   ms_connection_helper_unlink(&h, stream->video.encoder, 0, 0);
+        ms_connection_helper_unlink(&h, stream->muxer, 1, -1);
+    }
+
+    for (i = 0; i < MAX_STREAM_NUM; i++)
+    {
+        if (stream->source[i] && (i == 0 || stream->source[i] != stream->source[i - 1]))
+            ms_filter_destroy(stream->source[i]);
+        if (stream->audio.jitter[i])    ms_filter_destroy(stream->audio.jitter[i]);
+        if (stream->audio.decoder[i])   ms_filter_destroy(stream->audio.decoder[i]);
+        if (stream->video.jitter[i])    ms_filter_destroy(stream->video.jitter[i]);
+        if (stream->video.regroup[i])   ms_filter_destroy(stream->video.regroup[i]);
+        if (stream->video.decoder[i])   ms_filter_destroy(stream->video.decoder[i]);
+    }
+    if (stream->audio.parser)       ms_filter_destroy(stream->audio.parser);
+    if (stream->audio.amix)         ms_filter_destroy(stream->audio.amix);
+    if (stream->audio.resample)     ms_filter_destroy(stream->audio.resample);
+    if (stream->audio.encoder)      ms_filter_destroy(stream->audio.encoder);
+    if (stream->video.vmix)         ms_filter_destroy(stream->video.vmix);
+    if (stream->video.scale)        ms_filter_destroy(stream->video.scale);
+    if (stream->video.encoder)      ms_filter_destroy(stream->video.encoder);
+    if (stream->muxer)              ms_filter_destroy(stream->muxer);
+    memset(stream, 0, sizeof(PcapStream));
 }
-#endif
 
 
 void print_options(Parameter *param)
@@ -626,6 +849,7 @@ void print_options(Parameter *param)
 int main(int argc, const char *argv[])
 {
     char ch = 0;
+    int i;
     MSFactory *factory = NULL;
     Parameter param;
     PcapStream stream;
@@ -653,18 +877,31 @@ int main(int argc, const char *argv[])
 
     pcap_stream_start_from_param(factory, &stream, &param);
 
-    while (1)
+    if (param.realtime)
     {
-        scanf("%c", &ch);
-        if (ch == 'q' || ch == 'Q')
+        while (1)
         {
-            printf("\n[%c : quit.]\n\n", ch);
-            break;
+            scanf("%c", &ch);
+            if (ch == 'q' || ch == 'Q')
+            {
+                printf("\n[%c : quit.]\n\n", ch);
+                break;
+            }
         }
+        for (i = 0; i < param.input_stream_count; i++)
+        {
+            if (i > 0 && stream.source[i] == stream.source[i - 1])    continue;
+            ms_ticker_detach(stream.ticker, stream.source[i]);
+        }
+    }
+    else
+    {
+        /*returns once every packet of the capture went through the muxer*/
+        ms_ticker_wait(stream.ticker);
     }
+    ms_ticker_destroy(stream.ticker);
 
-//    pcap_stream_stop(factory, &stream);
-    if (stream.muxer)      ms_filter_destroy(stream.muxer);
+    pcap_stream_stop(&stream, &param);
     ms_factory_destroy(factory);
     return 0;
 }
@@ -55,15 +55,22 @@ void ortp_set_memory_functions(OrtpMemoryFunctions *functions)
     ortp_allocator=*functions;
 }
 
+/*called from every thread: only written once, so that the flag does not bounce between caches*/
+static void set_allocator_used(void)
+{
+    if (!__atomic_load_n(&allocator_used, __ATOMIC_RELAXED))
+        __atomic_store_n(&allocator_used, TRUE, __ATOMIC_RELAXED);
+}
+
 void* ortp_malloc(size_t sz)
 {
-    allocator_used=TRUE;
+    set_allocator_used();
     return ortp_allocator.malloc_fun(sz);
 }
 
 void* ortp_realloc(void *ptr, size_t sz)
 {
-    allocator_used=TRUE;
+    set_allocator_used();
     return ortp_allocator.realloc_fun(ptr,sz);
 }
 
@@ -18,7 +18,154 @@
 */
 
 #include <string.h>
+#include <pthread.h>
 #include "ortp/str_utils.h"
+#include <libavutil/buffer.h>
+
+
+/*
+ * Block pools behind allocb()/freeb(). Data blocks (dblk_t + payload) are sorted in power of two
+ * size classes; mblk_t headers have a pool of their own. Each thread allocates from and frees to
+ * a cache of its own without any lock; a cache that grows too large gives a batch back to the
+ * shared depot, an empty one takes a batch from it. Blocks above the largest class are malloc'ed.
+ */
+#define MSGB_POOL_MIN_SHIFT	7		/* smallest class: 128 bytes, dblk_t included */
+#define MSGB_POOL_CLASSES	12		/* largest class: 256KB */
+#define MSGB_POOL_BATCH		16		/* blocks moved at once between a thread cache and the depot */
+#define MSGB_POOL_CACHE_BYTES	(1024*1024)	/* per class and per thread */
+#define MSGB_POOL_DEPOT_BYTES	(8*1024*1024)	/* per class */
+#define MSGB_POOL_MBLK		MSGB_POOL_CLASSES	/* index of the mblk_t pool */
+
+typedef struct _pool_block{
+	struct _pool_block *next;
+}pool_block_t;
+
+typedef struct _pool_list{
+	pool_block_t *head;
+	int count;
+}pool_list_t;
+
+typedef struct _pool_cache{
+	pool_list_t lists[MSGB_POOL_CLASSES+1];
+}pool_cache_t;
+
+static pool_cache_t pool_depot;
+static pthread_mutex_t pool_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once=PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static __thread pool_cache_t *pool_cache=NULL;
+
+static size_t pool_block_size(int cls){
+	if (cls==MSGB_POOL_MBLK) return sizeof(mblk_t);
+	return (size_t)1<<(cls+MSGB_POOL_MIN_SHIFT);
+}
+
+/* how many blocks of a class fit in bytes, never less than a batch */
+static int pool_limit(int cls, size_t bytes){
+	size_t n=bytes/pool_block_size(cls);
+	return n<MSGB_POOL_BATCH ? MSGB_POOL_BATCH : (int)n;
+}
+
+static int pool_class(size_t size){
+	int cls=0;
+	while(((size_t)1<<(cls+MSGB_POOL_MIN_SHIFT))<size) cls++;
+	return cls<MSGB_POOL_CLASSES ? cls : -1;
+}
+
+static void pool_push(pool_list_t *l, pool_block_t *b){
+	b->next=l->head;
+	l->head=b;
+	l->count++;
+}
+
+static pool_block_t *pool_pop(pool_list_t *l){
+	pool_block_t *b=l->head;
+	if (b!=NULL){
+		l->head=b->next;
+		l->count--;
+	}
+	return b;
+}
+
+/* move up to n blocks from a thread cache to the depot, freeing those the depot has no room for */
+static void pool_release(pool_list_t *cache, int cls, int n){
+	pool_block_t *b;
+	int depot_max=pool_limit(cls,MSGB_POOL_DEPOT_BYTES);
+	pthread_mutex_lock(&pool_lock);
+	while(n-->0 && (b=pool_pop(cache))!=NULL){
+		if (pool_depot.lists[cls].count<depot_max) pool_push(&pool_depot.lists[cls],b);
+		else ortp_free(b);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void pool_cache_destroy(void *arg){
+	pool_cache_t *cache=(pool_cache_t*)arg;
+	int cls;
+	for(cls=0;cls<=MSGB_POOL_CLASSES;cls++){
+		pool_release(&cache->lists[cls],cls,cache->lists[cls].count);
+	}
+	ortp_free(cache);
+	pool_cache=NULL;	/* a later destructor of the exiting thread may still free blocks */
+}
+
+static void pool_key_create(void){
+	pthread_key_create(&pool_key,pool_cache_destroy);
+}
+
+static pool_cache_t *pool_get_cache(void){
+	if (pool_cache==NULL){
+		pthread_once(&pool_once,pool_key_create);
+		pool_cache=(pool_cache_t*)ortp_malloc0(sizeof(pool_cache_t));
+		pthread_setspecific(pool_key,pool_cache);
+	}
+	return pool_cache;
+}
+
+static void *pool_alloc(int cls){
+	pool_list_t *cache=&pool_get_cache()->lists[cls];
+	pool_block_t *b;
+	if (cache->head==NULL){
+		int n=MSGB_POOL_BATCH;
+		pthread_mutex_lock(&pool_lock);
+		while(n-->0 && (b=pool_pop(&pool_depot.lists[cls]))!=NULL) pool_push(cache,b);
+		pthread_mutex_unlock(&pool_lock);
+	}
+	b=pool_pop(cache);
+	if (b!=NULL) return b;
+	return ortp_malloc(pool_block_size(cls));
+}
+
+static void pool_free(int cls, void *ptr){
+	pool_list_t *cache=&pool_get_cache()->lists[cls];
+	pool_push(cache,(pool_block_t*)ptr);
+	if (cache->count>pool_limit(cls,MSGB_POOL_CACHE_BYTES)) pool_release(cache,cls,MSGB_POOL_BATCH);
+}
+
+void msgb_pool_trim(void){
+	pool_block_t *b;
+	int cls;
+	if (pool_cache!=NULL){
+		for(cls=0;cls<=MSGB_POOL_CLASSES;cls++){
+			while((b=pool_pop(&pool_cache->lists[cls]))!=NULL) ortp_free(b);
+		}
+	}
+	pthread_mutex_lock(&pool_lock);
+	for(cls=0;cls<=MSGB_POOL_CLASSES;cls++){
+		while((b=pool_pop(&pool_depot.lists[cls]))!=NULL) ortp_free(b);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void msgb_pool_recycle(dblk_t *db);
+
+static mblk_t *mblk_alloc(void){
+	return (mblk_t *)pool_alloc(MSGB_POOL_MBLK);
+}
+
+static void mblk_free(mblk_t *mp){
+	pool_free(MSGB_POOL_MBLK,mp);
+}
 
 
 void qinit(queue_t *q){
@@ -34,6 +181,8 @@ void mblk_init(mblk_t *mp)
 	mp->b_rptr=mp->b_wptr=NULL;
 	mp->reserved1=0;
 	mp->reserved2=0;
+	mp->reserved3=0;
+	mp->reserved4=0;
 #if defined(ORTP_TIMESTAMP)
 	memset(&(mp->timestamp), 0, sizeof(struct timeval));
 #endif
@@ -42,6 +191,8 @@ void mblk_init(mblk_t *mp)
 void mblk_meta_copy(const mblk_t *source, mblk_t *dest) {
 	dest->reserved1 = source->reserved1;
 	dest->reserved2 = source->reserved2;
+	dest->reserved3 = source->reserved3;
+	dest->reserved4 = source->reserved4;
 #if defined(ORTP_TIMESTAMP)
 	dest->timestamp = source->timestamp;
 #endif
@@ -50,24 +201,31 @@ void mblk_meta_copy(const mblk_t *source, mblk_t *dest) {
 dblk_t *datab_alloc(int size){
 	dblk_t *db;
 	int total_size=sizeof(dblk_t)+size;
-	db=(dblk_t *) ortp_malloc(total_size);
+	int cls=pool_class(total_size);
+	if (cls>=0) db=(dblk_t *) pool_alloc(cls);
+	else db=(dblk_t *) ortp_malloc(total_size);
 	db->db_base=(uint8_t*)db+sizeof(dblk_t);
 	db->db_lim=db->db_base+size;
 	db->db_ref=1;
+	db->db_pool=cls;
+	db->db_allocator=NULL;
+	db->db_meta=NULL;
 	db->db_freefn=NULL;	/* the buffer pointed by db_base must never be freed !*/
+	db->db_freearg=NULL;
 	return db;
 }
 
 static inline void datab_ref(dblk_t *d){
-	d->db_ref++;
+	__atomic_add_fetch(&d->db_ref,1,__ATOMIC_RELAXED);
 }
 
 static inline void datab_unref(dblk_t *d){
-	d->db_ref--;
-	if (d->db_ref==0){
+	if (__atomic_sub_fetch(&d->db_ref,1,__ATOMIC_ACQ_REL)==0){
 		if (d->db_freefn!=NULL)
-			d->db_freefn(d->db_base);
-		ortp_free(d);
+			d->db_freefn(d->db_freearg);
+		if (d->db_allocator!=NULL) msgb_pool_recycle(d);
+		else if (d->db_pool>=0) pool_free(d->db_pool,d);
+		else ortp_free(d);
 	}
 }
 
@@ -77,7 +235,7 @@ mblk_t *allocb(int size, int pri)
 	mblk_t *mp;
 	dblk_t *datab;
 	
-	mp=(mblk_t *) ortp_malloc(sizeof(mblk_t));
+	mp=mblk_alloc();
 	mblk_init(mp);
 	datab=datab_alloc(size);
 	
@@ -88,19 +246,27 @@ mblk_t *allocb(int size, int pri)
 }
 
 mblk_t *esballoc(uint8_t *buf, int size, int pri, void (*freefn)(void*) )
+{
+	return esballoc_with_arg(buf,size,pri,freefn,buf);
+}
+
+mblk_t *esballoc_with_arg(uint8_t *buf, int size, int pri, void (*freefn)(void*), void *arg)
 {
 	mblk_t *mp;
 	dblk_t *datab;
 	
-	mp=(mblk_t *) ortp_malloc(sizeof(mblk_t));
+	mp=mblk_alloc();
 	mblk_init(mp);
-	datab=(dblk_t *) ortp_malloc(sizeof(dblk_t));
-	
+	datab=(dblk_t *) pool_alloc(0);
+	datab->db_pool=0;
+	datab->db_allocator=NULL;
+	datab->db_meta=NULL;
 
 	datab->db_base=buf;
 	datab->db_lim=buf+size;
 	datab->db_ref=1;
 	datab->db_freefn=freefn;
+	datab->db_freearg=arg;
 	
 	mp->b_datap=datab;
 	mp->b_rptr=mp->b_wptr=buf;
@@ -115,7 +281,7 @@ void freeb(mblk_t *mp)
 	return_if_fail(mp->b_datap->db_base!=NULL);
 	
 	datab_unref(mp->b_datap);
-	ortp_free(mp);
+	mblk_free(mp);
 }
 
 void freemsg(mblk_t *mp)
@@ -137,7 +303,7 @@ mblk_t *dupb(mblk_t *mp)
 	return_val_if_fail(mp->b_datap->db_base!=NULL,NULL);
 	
 	datab_ref(mp->b_datap);
-	newm=(mblk_t *) ortp_malloc(sizeof(mblk_t));
+	newm=mblk_alloc();
 	mblk_init(newm);
 	mblk_meta_copy(mp, newm);
 	newm->b_datap=mp->b_datap;
@@ -322,28 +488,128 @@ mblk_t *concatb(mblk_t *mp, mblk_t *newm){
 	return newm;
 }
 
+#define MSGB_ALLOCATOR_MIN_SHIFT	6	/* smallest bucket: 64 bytes */
+#define MSGB_ALLOCATOR_BUCKETS		25	/* largest bucket: 1GB */
+
+/* a free block links to the next one through its own payload */
+#define dblk_next(db)	(*(dblk_t **)(db)->db_base)
+
+struct _msgb_pool{
+	dblk_t *avail[MSGB_ALLOCATOR_BUCKETS];	/* owner thread only */
+	dblk_t *returned[MSGB_ALLOCATOR_BUCKETS];	/* lock-free stacks, pushed by the threads freeing blocks */
+	int refs;	/* one for the allocator, one per block in use */
+	int in_use;
+};
+
+static int msgb_bucket(int size){
+	int b=0;
+	while(b<MSGB_ALLOCATOR_BUCKETS && (1<<(b+MSGB_ALLOCATOR_MIN_SHIFT))<size) b++;
+	return b<MSGB_ALLOCATOR_BUCKETS ? b : -1;
+}
+
+static void dblk_list_free(dblk_t *db){
+	while(db!=NULL){
+		dblk_t *next=dblk_next(db);
+		ortp_free(db);
+		db=next;
+	}
+}
+
+static void msgb_pool_unref(struct _msgb_pool *p){
+	int b;
+	if (__atomic_sub_fetch(&p->refs,1,__ATOMIC_ACQ_REL)!=0) return;
+	/* the allocator is gone and every block is back */
+	for(b=0;b<MSGB_ALLOCATOR_BUCKETS;b++){
+		dblk_list_free(p->avail[b]);
+		dblk_list_free(p->returned[b]);
+	}
+	ortp_free(p);
+}
+
+static void msgb_pool_recycle(dblk_t *db){
+	struct _msgb_pool *p=db->db_allocator;
+	dblk_t **top=&p->returned[msgb_bucket((int)(db->db_lim-db->db_base))];
+	dblk_t *head=__atomic_load_n(top,__ATOMIC_RELAXED);
+	/* only ever emptied all at once by the owner, so there is no ABA issue */
+	do{
+		dblk_next(db)=head;
+	}while(!__atomic_compare_exchange_n(top,&head,db,TRUE,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+	__atomic_sub_fetch(&p->in_use,1,__ATOMIC_RELAXED);
+	msgb_pool_unref(p);
+}
+
 void msgb_allocator_init(msgb_allocator_t *a){
-	qinit(&a->q);
+	a->pool=(struct _msgb_pool *)ortp_malloc0(sizeof(struct _msgb_pool));
+	a->pool->refs=1;
+	a->max_blocks=0;
+}
+
+void msgb_allocator_set_max_blocks(msgb_allocator_t *a, int max_blocks){
+	a->max_blocks=max_blocks;
 }
 
 mblk_t *msgb_allocator_alloc(msgb_allocator_t *a, int size){
-	queue_t *q=&a->q;
-	mblk_t *m,*found=NULL;
-
-	/*lookup for an unused msgb (data block with ref count ==1)*/
-	for(m=qbegin(q);!qend(q,m);m=qnext(q,m)){
-		if (m->b_datap->db_ref==1 && m->b_datap->db_lim-m->b_datap->db_base>=size){
-			found=m;
-			break;
-		}
-	}
-	if (found==NULL){
-		found=allocb(size,0);
-		putq(q,found);
+	struct _msgb_pool *p=a->pool;
+	int b=msgb_bucket(size);
+	dblk_t *db;
+	mblk_t *mp;
+
+	if (b<0) return allocb(size,0);
+	if (p->avail[b]==NULL) p->avail[b]=__atomic_exchange_n(&p->returned[b],NULL,__ATOMIC_ACQUIRE);
+	db=p->avail[b];
+	if (db!=NULL){
+		p->avail[b]=dblk_next(db);
+	}else{
+		int capacity=1<<(b+MSGB_ALLOCATOR_MIN_SHIFT);
+		if (a->max_blocks>0 && __atomic_load_n(&p->in_use,__ATOMIC_RELAXED)>=a->max_blocks) return allocb(size,0);
+		db=(dblk_t *) ortp_malloc(sizeof(dblk_t)+capacity);
+		db->db_base=(uint8_t*)db+sizeof(dblk_t);
+		db->db_lim=db->db_base+capacity;
+		db->db_freefn=NULL;
+		db->db_freearg=NULL;
+		db->db_pool=-1;
+		db->db_allocator=p;
 	}
-	return dupb(found);
+	db->db_ref=1;
+	db->db_meta=NULL;
+	__atomic_add_fetch(&p->in_use,1,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->refs,1,__ATOMIC_RELAXED);
+
+	mp=mblk_alloc();
+	mblk_init(mp);
+	mp->b_datap=db;
+	mp->b_rptr=mp->b_wptr=db->db_base;
+	return mp;
 }
 
 void msgb_allocator_uninit(msgb_allocator_t *a){
-	flushq(&a->q,-1);
+	struct _msgb_pool *p=a->pool;
+	int b;
+	for(b=0;b<MSGB_ALLOCATOR_BUCKETS;b++){
+		dblk_list_free(p->avail[b]);
+		p->avail[b]=NULL;
+		dblk_list_free(__atomic_exchange_n(&p->returned[b],NULL,__ATOMIC_ACQUIRE));
+	}
+	a->pool=NULL;
+	/* blocks still in use keep the pool alive, they are freed as they come back */
+	msgb_pool_unref(p);
+}
+
+static void avbuffer_unref(void *arg){
+	AVBufferRef *ref=(AVBufferRef*)arg;
+	av_buffer_unref(&ref);
+}
+
+mblk_t *msgb_from_avbuffer(msgb_allocator_t *fallback, AVBufferRef *buf, uint8_t *data, int size){
+	AVBufferRef *ref=NULL;
+	mblk_t *mp;
+
+	if (buf!=NULL && (ref=av_buffer_ref(buf))!=NULL){
+		mp=esballoc_with_arg(data,size,0,avbuffer_unref,ref);
+	}else{
+		mp=fallback!=NULL ? msgb_allocator_alloc(fallback,size) : allocb(size,0);
+		memcpy(mp->b_wptr,data,size);
+	}
+	mp->b_wptr+=size;
+	return mp;
 }